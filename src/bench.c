@@ -0,0 +1,323 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "simulation.h"
+
+#ifndef BENCH_VERSION
+#define BENCH_VERSION "unknown"
+#endif
+
+// maximum number of values of a swept parameter
+#define SWEEP_VALUES 16
+
+typedef struct sweep_s {
+    int n[SWEEP_VALUES];            // numbers of bodies
+    int n_count;
+    double theta[SWEEP_VALUES];     // opening angles
+    int theta_count;
+    int threads[SWEEP_VALUES];      // numbers of threads
+    int threads_count;
+    int bucket[SWEEP_VALUES];       // leaf bucket sizes
+    int bucket_count;
+    bool json;                      // JSON output instead of CSV
+    const char *output;             // output file, NULL for stdout
+} sweep_t;
+
+static void print_help(void)
+{
+    printf("USAGE:\n\t./barnes_hut_bench [options]\n\n"
+           "runs the simulation on every combination of the swept parameters, "
+           "each run in\nits own process, and reports the mean time of each "
+           "phase of a step\n\nSWEPT OPTIONS (comma separated lists):\n"
+           "\t-n n,...\t\tnumbers of bodies (default: 10000,100000)\n"
+           "\t--theta theta,...\topening angles (default: 0.5,1)\n"
+           "\t-t, --threads n,...\tnumbers of threads (default: 1 and the "
+           "number of\n\t\t\t\tonline processors)\n"
+           "\t--bucket n,...\t\tleaf bucket sizes (default: 8,16,32)\n\n"
+           "OPTIONS:\n"
+           "\t--steps n\t\tmeasured steps of each run (default: 3)\n"
+           "\t--kernel name\t\tauto (default), scalar, avx2 or avx512\n"
+           "\t--mac name\t\tbh (default), box or relative\n"
+           "\t--order name\t\tmonopole (default) or quadrupole\n"
+           "\t--engine name\t\ttree (default) or fmm (theta at most 1)\n"
+           "\t--validate n|all\tbodies whose final accelerations are "
+           "checked against\n\t\t\t\ta direct summation (default: "
+           "1000)\n"
+           "\t--format name\t\tcsv (default) or json\n"
+           "\t-o, --output path\twrite the results to a file instead of "
+           "stdout\n");
+}
+
+/* FUNCTION: parse_list
+ * --------------------------------------
+ * parses a comma separated list of positive numbers
+ *
+ * arg: list to parse
+ * values: output, the numbers
+ * count: output, the number of values
+ *
+ * returns: false if the list is invalid or too long
+ */
+static bool parse_list(const char *arg, double values[SWEEP_VALUES], int *count)
+{
+    char *end;
+
+    *count = 0;
+    while (*count < SWEEP_VALUES) {
+        values[*count] = strtod(arg, &end);
+        if (end == arg || values[*count] <= 0)
+            return false;
+        *count += 1;
+        if (*end == '\0')
+            return true;
+        if (*end != ',')
+            return false;
+        arg = end + 1;
+    }
+    return false;
+}
+
+/* FUNCTION: parse_int_list
+ * --------------------------------------
+ * parses a comma separated list of positive integers
+ *
+ * arg: list to parse
+ * values: output, the integers
+ * count: output, the number of values
+ *
+ * returns: false if the list is invalid, holds a value which is not an
+ * integer between 1 and INT_MAX, or is too long
+ */
+static bool parse_int_list(const char *arg, int values[SWEEP_VALUES],
+                           int *count)
+{
+    char *end;
+    long value;
+
+    *count = 0;
+    while (*count < SWEEP_VALUES) {
+        errno = 0;
+        value = strtol(arg, &end, 10);
+        if (end == arg || errno != 0 || value < 1 || value > INT_MAX)
+            return false;
+        values[*count] = (int)value;
+        *count += 1;
+        if (*end == '\0')
+            return true;
+        if (*end != ',')
+            return false;
+        arg = end + 1;
+    }
+    return false;
+}
+
+/* FUNCTION: parse_args
+ * --------------------------------------
+ * fills the sweep and the fixed parameters of the runs from the command line
+ *
+ * sweep: sweep to fill
+ * config: output, parameters shared by all the runs
+ * argc: number of arguments
+ * argv: arguments
+ *
+ * returns: false if the command line is invalid or asks for help
+ */
+static bool parse_args(sweep_t *sweep, config_t *config, int argc, char **argv)
+{
+    bool ok = true;
+
+    memset(sweep, 0, sizeof(sweep_t));
+    bh_init_config(config);
+    sweep->n[0] = 10000;
+    sweep->n[1] = 100000;
+    sweep->n_count = 2;
+    sweep->theta[0] = 0.5;
+    sweep->theta[1] = 1;
+    sweep->theta_count = 2;
+    sweep->threads[0] = 1;
+    sweep->threads[1] = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    sweep->threads_count = sweep->threads[1] > 1 ? 2 : 1;
+    sweep->bucket[0] = 8;
+    sweep->bucket[1] = 16;
+    sweep->bucket[2] = 32;
+    sweep->bucket_count = 3;
+    config->steps = 3;
+    config->validate = 1000;
+    for (int i = 1; ok && i < argc; i += 1) {
+        if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help"))
+            return false;
+        if (++i == argc)
+            return false;
+        if (!strcmp(argv[i - 1], "-n"))
+            ok = parse_int_list(argv[i], sweep->n, &sweep->n_count);
+        else if (!strcmp(argv[i - 1], "--theta"))
+            ok = parse_list(argv[i], sweep->theta, &sweep->theta_count);
+        else if (!strcmp(argv[i - 1], "-t") || !strcmp(argv[i - 1], "--threads"))
+            ok = parse_int_list(argv[i], sweep->threads,
+                                &sweep->threads_count);
+        else if (!strcmp(argv[i - 1], "--bucket"))
+            ok = parse_int_list(argv[i], sweep->bucket, &sweep->bucket_count);
+        else if (!strcmp(argv[i - 1], "--steps"))
+            ok = (config->steps = atoi(argv[i])) > 0;
+        else if (!strcmp(argv[i - 1], "--kernel"))
+            ok = find_kernel(argv[i], &config->kernel);
+        else if (!strcmp(argv[i - 1], "--mac"))
+            ok = find_mac(argv[i], &config->mac);
+        else if (!strcmp(argv[i - 1], "--order"))
+            ok = find_expansion(argv[i], &config->expansion);
+        else if (!strcmp(argv[i - 1], "--engine"))
+            ok = find_engine(argv[i], &config->engine);
+        else if (!strcmp(argv[i - 1], "--validate"))
+            ok = (config->validate = strcmp(argv[i], "all")
+                                     ? atoi(argv[i]) : INT_MAX) > 0;
+        else if (!strcmp(argv[i - 1], "--format"))
+            ok = (sweep->json = !strcmp(argv[i], "json"))
+                 || !strcmp(argv[i], "csv");
+        else if (!strcmp(argv[i - 1], "-o") || !strcmp(argv[i - 1], "--output"))
+            sweep->output = argv[i];
+        else
+            ok = false;
+    }
+    // (r1 + r2) < theta * d only keeps the nodes apart for theta <= 1
+    for (int i = 0; ok && config->engine == BH_ENGINE_FMM
+                    && i < sweep->theta_count; i += 1)
+        ok = sweep->theta[i] <= 1;
+    return ok;
+}
+
+/* FUNCTION: measure_run
+ * --------------------------------------
+ * runs a benchmark in a child process, so that each run starts from a fresh
+ * heap and its peak memory is its own
+ *
+ * config: parameters of the run
+ * bench: output, measures of the run
+ *
+ * returns: the peak resident memory of the run in KiB, -1 if it failed
+ */
+static long measure_run(const config_t *config, bench_t *bench)
+{
+    struct rusage usage;
+    ssize_t size = 0;
+    ssize_t got;
+    int fds[2];
+    int status;
+    pid_t pid;
+
+    if (pipe(fds) < 0)
+        exit(1);
+    fflush(NULL);
+    pid = fork();
+    if (pid < 0)
+        exit(1);
+    if (pid == 0) {
+        close(fds[0]);
+        run_benchmark(config, bench);
+        _exit(write_all(fds[1], bench, sizeof(bench_t)) ? 0 : 1);
+    }
+    close(fds[1]);
+    while (size < (ssize_t)sizeof(bench_t)
+           && (got = read(fds[0], (char *)bench + size, sizeof(bench_t) - size)) > 0)
+        size += got;
+    close(fds[0]);
+    if (wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status)
+        || WEXITSTATUS(status) != 0 || size != sizeof(bench_t))
+        return -1;
+    return usage.ru_maxrss;
+}
+
+/* FUNCTION: print_result
+ * --------------------------------------
+ * writes the measures of a run as a CSV line or a JSON object
+ *
+ * out: output stream
+ * sweep: sweep giving the format
+ * config: parameters of the run
+ * bench: measures of the run
+ * memory: peak resident memory of the run in KiB
+ * first: true for the first run of the sweep
+ */
+static void print_result(FILE *out, const sweep_t *sweep,
+                         const config_t *config, const bench_t *bench,
+                         long memory, bool first)
+{
+    const char *format = sweep->json
+        ? "%s  {\"version\": \"%s\", \"engine\": \"%s\", \"kernel\": \"%s\", "
+          "\"n\": %d, "
+          "\"theta\": %g, \"threads\": %d, \"bucket\": %d, \"steps\": %d, "
+          "\"build_ms\": %.3f, \"gravity_center_ms\": %.3f, "
+          "\"forces_ms\": %.3f, \"integration_ms\": %.3f, \"step_ms\": %.3f, "
+          "\"interactions_per_s\": %.4g, \"nodes_per_body\": %.1f, "
+          "\"interactions_per_body\": %.1f, \"peak_kib\": %ld, "
+          "\"error_median\": %.3e, \"error_p90\": %.3e, \"error_p99\": %.3e, "
+          "\"error_max\": %.3e}"
+        : "%s%s,%s,%s,%d,%g,%d,%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.4g,%.1f,%.1f,%ld,"
+          "%.3e,%.3e,%.3e,%.3e\n";
+    double step = bench->times[0] + bench->times[1] + bench->times[2]
+                  + bench->times[3];
+
+    fprintf(out, format, sweep->json ? (first ? "" : ",\n") : "", BENCH_VERSION,
+            config->engine == BH_ENGINE_FMM ? "fmm" : "tree",
+            get_kernel(config->kernel)->name, config->n, config->theta,
+            config->threads, config->bucket_size, config->steps,
+            bench->times[0], bench->times[1], bench->times[2], bench->times[3],
+            step, bench->times[2] > 0 ? bench->interactions * 1e3 / bench->times[2] : 0,
+            bench->visited, bench->interactions / config->n, memory,
+            bench->error[0], bench->error[1], bench->error[2], bench->error[3]);
+    fflush(out);
+}
+
+int main(int argc, char **argv)
+{
+    sweep_t sweep;
+    config_t config;
+    bench_t bench;
+    FILE *out = stdout;
+    bool first = true;
+    long memory;
+
+    if (!parse_args(&sweep, &config, argc, argv)) {
+        print_help();
+        return 0;
+    }
+    if (get_kernel(config.kernel) == NULL) {
+        fprintf(stderr, "the force kernel is not supported by this CPU\n");
+        return 1;
+    }
+    if (sweep.output != NULL && (out = fopen(sweep.output, "w")) == NULL) {
+        fprintf(stderr, "cannot create %s\n", sweep.output);
+        return 1;
+    }
+    fprintf(out, sweep.json ? "[\n" : "version,engine,kernel,n,theta,threads,bucket,"
+            "steps,build_ms,gravity_center_ms,forces_ms,integration_ms,step_ms,"
+            "interactions_per_s,nodes_per_body,interactions_per_body,"
+            "peak_kib,error_median,error_p90,error_p99,error_max\n");
+    for (int n = 0; n < sweep.n_count; n += 1)
+    for (int bucket = 0; bucket < sweep.bucket_count; bucket += 1)
+    for (int theta = 0; theta < sweep.theta_count; theta += 1)
+    for (int threads = 0; threads < sweep.threads_count; threads += 1) {
+        config.n = sweep.n[n];
+        config.bucket_size = sweep.bucket[bucket];
+        config.theta = sweep.theta[theta];
+        config.threads = sweep.threads[threads];
+        memory = measure_run(&config, &bench);
+        if (memory < 0) {
+            fprintf(stderr, "run n=%d theta=%g threads=%d bucket=%d failed\n",
+                    config.n, config.theta, config.threads, config.bucket_size);
+            continue;
+        }
+        print_result(out, &sweep, &config, &bench, memory, first);
+        first = false;
+    }
+    if (sweep.json)
+        fprintf(out, "\n]\n");
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
@@ -0,0 +1,163 @@
+#ifndef BARNES_HUT_H
+#define BARNES_HUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * public interface of libbarnes_hut, the only symbols exported by the
+ * shared library: a bh_simulation_t holds everything a simulation needs, so
+ * that a program can run several independent simulations at once
+ *      *  bh_init_config fills the default parameters
+ *      *  bh_create_simulation sets up a simulation on a copy of a buffer of
+ *         bodies and computes their initial accelerations
+ *      *  bh_step_simulation moves the bodies by a step, refusing a time
+ *         step which is not positive and finite
+ *      *  bh_get_particles gives the bodies in place, reordered by the
+ *         builds of the octree, their id following them
+ *      *  bh_get_stats measures the last step
+ *      *  bh_free_simulation releases the simulation
+ */
+
+#define BH_API __attribute__((visibility("default")))
+
+typedef enum bh_integrator_e {
+    BH_INTEGRATOR_LEAPFROG = 0,     // kick-drift-kick leapfrog
+    BH_INTEGRATOR_VERLET = 1,       // velocity Verlet
+} bh_integrator_et;
+
+typedef enum bh_kernel_e {
+    BH_KERNEL_AUTO = -1,            // widest kernel supported by the CPU
+    BH_KERNEL_SCALAR = 0,           // portable kernel
+    BH_KERNEL_AVX2 = 1,             // AVX2 + FMA kernel
+    BH_KERNEL_AVX512 = 2,           // AVX-512F kernel
+} bh_kernel_et;
+
+typedef enum bh_mac_e {
+    BH_MAC_BH = 0,                  // s / d from the center of mass
+    BH_MAC_BOX = 1,                 // s / d from the bounding box
+    BH_MAC_RELATIVE = 2,            // force error relative to the last step
+} bh_mac_et;
+
+typedef enum bh_engine_e {
+    BH_ENGINE_TREE = 0,             // a tree walk for each group of bodies
+    BH_ENGINE_FMM = 1,              // dual tree walk with local expansions
+} bh_engine_et;
+
+typedef enum bh_encoding_e {
+    BH_ENCODING_FLOAT32 = 0,        // positions as written by the simulation
+    BH_ENCODING_FLOAT16 = 1,        // positions as IEEE half floats
+    BH_ENCODING_QUANTIZED = 2,      // positions as 16-bit fixed point in the
+                                    // bounding cube of the frame
+} bh_encoding_et;
+
+typedef enum bh_expansion_e {
+    BH_EXPANSION_MONOPOLE = 0,          // nodes act as their center of mass
+    BH_EXPANSION_QUADRUPOLE = 1,        // nodes add their quadrupole moment
+} bh_expansion_et;
+
+typedef enum bh_build_e {
+    BH_BUILD_INSERT = 0,                // bodies inserted one by one from
+                                        // the root
+    BH_BUILD_MORTON = 1,                // bulk build from the Morton-sorted
+                                        // bodies
+} bh_build_et;
+
+// n, steps, load, checkpoint, trajectory, encoding, validate and ranks,
+// with their intervals, are only read by the barnes_hut command line
+typedef struct bh_config_s {
+    int n;                          // number of bodies in the galaxy
+    int threads;                    // number of threads of the simulation
+    bh_integrator_et integrator;    // scheme moving the bodies
+    float dt;                       // time step
+    bh_kernel_et kernel;            // force kernel
+    float softening;                // softening length of the interactions
+    int bucket_size;                // maximum number of bodies in a leaf
+    bh_mac_et mac;                  // opening criterion of the tree walk
+    float theta;                    // opening angle of BH_MAC_BH and BH_MAC_BOX
+    float alpha;                    // relative error of BH_MAC_RELATIVE
+    bh_expansion_et expansion;      // multipole expansion of the nodes
+    bh_engine_et engine;            // force engine
+    bh_build_et build;              // construction of the octree
+    float refit;                    // fraction of the bodies out of their
+                                    // leaf above which the octree is
+                                    // rebuilt instead of refitted, 0 to
+                                    // rebuild it every step
+    int steps;                      // step at which the simulation stops
+    const char *load;               // snapshot to start from, NULL for
+                                    // n random bodies
+    const char *checkpoint;         // snapshot written during the run,
+                                    // NULL for none
+    int checkpoint_every;           // steps between two checkpoints
+    const char *trajectory;         // file the positions are appended to by
+                                    // a background writer, NULL for none
+    int trajectory_every;           // steps between two trajectory frames
+    bh_encoding_et encoding;        // encoding of the trajectory positions
+    int validate;                   // bodies whose accelerations are checked
+                                    // against a direct summation, 0 for
+                                    // none, n or more for all of them
+    int validate_every;             // steps between two checks
+    int levels;                     // time step levels, a body of level l
+                                    // moving by steps of dt / 2^l, 1 for
+                                    // the same step dt for every body
+    float eta;                      // accuracy of the time step criterion
+                                    // eta * sqrt(softening / |a|)
+    int ranks;                      // processes sharing the bodies, 1 for
+                                    // a single process
+} bh_config_t;
+
+typedef struct bh_particles_s {
+    int count;                      // number of bodies in the store
+    int capacity;                   // number of bodies allocated
+    int *id;                        // identity of the body, which follows
+                                    // it when the store is reordered
+    float *x;                       // 3D position
+    float *y;                       // 3D position
+    float *z;                       // 3D position
+    float *mass;                    // mass of the body, positive
+    float *vx;                      // 3D velocity vector
+    float *vy;                      // 3D velocity vector
+    float *vz;                      // 3D velocity vector
+    float *ax;                      // 3D acceleration vector, computed
+    float *ay;                      // from the positions of the bodies when
+    float *az;                      // the octree was built
+    int *level;                     // time step level of the body, its step
+                                    // being dt / 2^level (config->levels)
+    float *scratch;                 // spare array used to reorder the store
+    void *mapping;                  // snapshot mapping holding some of the
+                                    // arrays, NULL
+    size_t mapping_size;            // size of the mapping in bytes
+} bh_particles_t;
+
+typedef struct bh_step_stats_s {
+    uint64_t step;                  // number of steps done
+    double time;                    // simulated time
+    bool rebuilt;                   // the octree was rebuilt by the last
+                                    // step instead of refitted
+    double times[4];                // build, gravity center, forces and
+                                    // integration times of the last step
+                                    // in milliseconds
+    uint64_t evaluated;             // accelerations computed by the last
+                                    // step
+    uint64_t interactions;          // body-source interactions of the last
+                                    // force computation
+    uint64_t visited;               // nodes tested for each body in the
+                                    // last force computation, summed over
+                                    // the bodies
+} bh_step_stats_t;
+
+typedef struct bh_simulation_s bh_simulation_t;
+
+BH_API void bh_init_config(bh_config_t *config);
+BH_API bh_simulation_t *bh_create_simulation(const bh_config_t *config,
+                                             int count, const float *positions,
+                                             const float *velocities,
+                                             const float *masses);
+BH_API bool bh_step_simulation(bh_simulation_t *simulation, float dt);
+BH_API const bh_particles_t *bh_get_particles(
+    const bh_simulation_t *simulation);
+BH_API const bh_step_stats_t *bh_get_stats(const bh_simulation_t *simulation);
+BH_API void bh_free_simulation(bh_simulation_t *simulation);
+
+#endif
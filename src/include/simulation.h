@@ -1,28 +1,133 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "barnes_hut.h"
+
+/*
+ * internal interface of libbarnes_hut, whose functions are hidden from the
+ * programs linking the shared library (see barnes_hut.h for the public one)
+ */
+
 /*
  * =============================== GENERAL ===============================
  */
 
 static const int GALAXY_SIZE = 2000;
 
+// internal names of the public types
+typedef bh_config_t config_t;
+typedef bh_particles_t particles_t;
+typedef bh_step_stats_t step_stats_t;
+
+// most time step levels of the block time steps (2^15 substeps per step)
+#define MAX_LEVELS 16
+
+typedef struct bench_s {
+    double times[4];                // mean build, gravity center, forces and
+                                    // integration time of a step in ms
+    double interactions;            // mean body-source interactions per step
+    double visited;                 // mean nodes tested per body per step
+    double error[4];                // median, 90th and 99th percentiles and
+                                    // maximum of the relative acceleration
+                                    // error at the last step (validate > 0)
+} bench_t;
+
+void run_simulation(const config_t *config);
+void run_benchmark(const config_t *config, bench_t *bench);
+
+/*
+ * =============================== STATISTICS ===============================
+ */
+
+// the counters of the tree walk and of the builds are only compiled with
+// STATS defined (make STATS=1), STAT(statement) being empty otherwise
+#ifdef STATS
+#define STAT(...) __VA_ARGS__
+#else
+#define STAT(...)
+#endif
+
+// depths of the depth histogram, 0 to MORTON_LEVELS
+#define STATS_DEPTHS 22
+
+typedef struct counters_s {
+    uint64_t tests;                 // nodes tested by the opening criterion
+    uint64_t openings;              // parent nodes opened
+    uint64_t rejections;            // nodes rejected by the criterion,
+                                    // opened or giving their bodies
+    uint64_t leaf_interactions;     // bodies of the rejected leaves added to
+                                    // the interaction lists
+    uint64_t node_interactions;     // accepted nodes added to the lists
+    uint64_t walks;                 // groups walked from the root
+    double busy;                    // time spent in force tasks in ms
+} counters_t;
 
-void run_simulation(int n);
+typedef struct stats_s {
+    counters_t total;               // counters of all the threads, the busy
+                                    // time being the mean of the threads
+    uint64_t depths[STATS_DEPTHS];  // bodies in the leaves at each depth
+    int depth;                      // depth of the deepest leaf
+    int threads;                    // number of threads of the force phase
+    double busy_max;                // busy time of the slowest thread in ms
+    double imbalance;               // busy_max / mean busy time, 1 when
+                                    // perfectly balanced
+} stats_t;
+
+/*
+ * =============================== THREAD POOL ===============================
+ */
+
+// a task of a batch, called with the index of the task and of the thread
+typedef void (*task_ft)(void *data, int task, int thread);
+
+typedef struct worker_s {
+    _Alignas(64) _Atomic uint64_t range;  // tasks left to the worker, packed
+                                    // as begin << 32 | end, one cache line
+                                    // per worker to avoid false sharing
+    struct pool_s *pool;            // pool owning the worker
+    pthread_t thread;               // thread of the worker (unused for 0)
+} worker_t;
+
+typedef struct pool_s {
+    int threads;                    // number of workers, the caller included
+    worker_t *workers;              // workers, 0 being the calling thread
+    pthread_mutex_t lock;           // protects the fields below
+    pthread_cond_t start;           // signaled when a new batch starts
+    pthread_cond_t done;            // signaled when the last worker is done
+    int generation;                 // number of batches started
+    int running;                    // number of workers still in the batch
+    bool stop;                      // asks the workers to exit
+    task_ft task;                   // task of the current batch
+    void *data;                     // parameter of the task
+} pool_t;
+
+void init_pool(pool_t *pool, int threads);
+void run_pool(pool_t *pool, int tasks, task_ft task, void *data);
+void free_pool(pool_t *pool);
 
 /*
  * =============================== BODIES ===============================
  */
 
-typedef struct body_s {
-    float x;                        // 3D position between 0 and GALAXY_SIZE
-    float y;                        // 3D position between 0 and GALAXY_SIZE
-    float z;                        // 3D position between 0 and GALAXY_SIZE
-    float weight;                   // weight of the body in UNIT
-    float velocity[3];              // 3D velocity vector
-} body_t;
+// iterates on every body index of a particle store
+#define FOREACH_PARTICLE(particles, i) \
+    for (int i = 0; i < (particles)->count; i += 1)
 
-typedef struct bodies_s {
-    body_t *body;
-    struct bodies_s *next;
-} bodies_t;
+void init_particles(particles_t *particles, int capacity);
+void resize_particles(particles_t *particles, int capacity);
+int add_particle(particles_t *particles, float x, float y, float z, float mass);
+void permute_particles(particles_t *particles, const int *order,
+                       pool_t *pool);
+void get_particles_bounds(particles_t *particles, pool_t *pool, float min[3],
+                          float max[3]);
+void attach_particles(particles_t *particles, void *mapping, size_t size,
+                      int count, void *arrays[8]);
+void free_particles(particles_t *particles);
+bool check_particles(const particles_t *particles);
+void init_bodies(particles_t *particles, int n, uint64_t seed);
 
 /*
  * =============================== OCTREE ===============================
@@ -31,31 +136,457 @@ typedef struct bodies_s {
 typedef enum type_e {
     CHILD = 0,
     PARENT = 1,
+    EMPTY = 2,
 } type_et;
 
+// the parallel build and gravity center pass work on independent sub-trees
+// rooted at this depth, the levels above being handled by a single thread
+#define SPLIT_LEVEL 3
+#define SPLIT_BUCKETS (1 << (3 * SPLIT_LEVEL))
+
 typedef struct oct_node_s {
-    type_et type;                   // parent or child node ?
-    body_t *body;                   // each node corresponds to a body
+    type_et type;                   // parent, child or empty node ?
+    int body;                       // if child => index of its first body
+    int count;                      // if child => number of bodies
     float min[3];                   // min position of the interval
     float max[3];                   // max position of the interval
     float position[3];              // if child => copy of body position
                                     // if parent => average position of children
     float weight;                   // if child => copy of body weight
                                     // if parent => average weight of children
-    struct oct_node_s *child[8];    // children
+    float box[2][3];                // bounding box (min then max) of the
+                                    // bodies under the node
+    float quadrupole[6];            // traceless quadrupole moment about
+                                    // position, see XX to ZZ
+                                    // (BH_EXPANSION_QUADRUPOLE only)
+    int child;                      // index of the first of the 8 contiguous
+                                    // children in the arena, -1 if none
 } oct_node_t;
 
+// node of the walk stream of an octree, the copy of an oct_node_t holding
+// what the opening criterion reads, built by the force walks from the nodes
+// below the root in depth first order, the EMPTY ones left out: an opened
+// node is followed by its first child, the walk skipping to next after a
+// leaf or an accepted node, so that it reads the stream forward without a
+// stack (one cache line per node)
+typedef struct walk_node_s {
+    _Alignas(64) float position[3]; // gravity center
+    float weight;                   // mass of the node
+    float box[2][3];                // box the distance of the criterion is
+                                    // measured from: bounding box of the
+                                    // bodies (BH_MAC_BOX), or its union with
+                                    // the cell (BH_MAC_RELATIVE)
+    float size;                     // largest side of the union of the cell
+                                    // and of the bounding box of the bodies
+    int next;                       // node following the sub-tree of this
+                                    // one, the length of the stream at the
+                                    // end
+    int body;                       // if leaf => index of its first body,
+                                    // -1 for a parent
+    int count;                      // if leaf => number of bodies
+} walk_node_t;
+
+typedef struct subtree_s {
+    int node;                       // root of the sub-tree, at SPLIT_LEVEL
+    int first;                      // index of the first body of the sub-tree
+    int last;                       // index following its last body
+    int thread;                     // thread which built it
+    int root;                       // index of its root in the thread arena
+    int size;                       // number of nodes, the root included
+    int dest;                       // index in the octree where the nodes
+                                    // below its root are copied
+} subtree_t;
+
+typedef struct octree_s {
+    oct_node_t *nodes;              // node arena, nodes[0] is the root
+    int count;                      // number of nodes in use
+    int capacity;                   // number of nodes allocated
+    bh_build_et build;              // how create_octree builds the tree
+    bh_expansion_et expansion;      // moments of the gravity center pass
+    float refit;                    // fraction of the bodies out of their
+                                    // leaf triggering a rebuild in
+                                    // update_octree, 0 to always rebuild
+    int bucket_size;                // maximum number of bodies in a leaf
+    uint64_t *keys;                 // Morton key of each body (BH_BUILD_MORTON)
+    uint64_t *keys_tmp;             // scratch buffer of the key sort
+    int *order;                     // order of the bodies sorted by key
+    int *order_tmp;                 // scratch buffer of the key sort
+    int *links;                     // next body in the list of a leaf while
+                                    // bodies are inserted (BH_BUILD_INSERT)
+    int key_capacity;               // number of bodies the buffers can hold
+    int *groups;                    // leaves, in tree (Morton) order, each
+                                    // walking the tree as a group of bodies
+    int group_count;                // number of groups
+    int group_capacity;             // number of groups the buffer can hold
+    int buckets[SPLIT_BUCKETS + 1]; // first body of each sub-tree at
+                                    // SPLIT_LEVEL (BH_BUILD_MORTON)
+    subtree_t subtrees[SPLIT_BUCKETS]; // sub-trees at SPLIT_LEVEL
+    int subtree_count;              // number of sub-trees
+    struct octree_s *arenas;        // node arena of each thread, where the
+                                    // sub-trees are built before being
+                                    // copied under the top levels
+    int arena_count;                // number of thread arenas
+    uint64_t depths[STATS_DEPTHS];  // bodies in the leaves at each depth,
+                                    // counted by the last build (STATS)
+    walk_node_t *walk_nodes;        // walk stream of the nodes
+    float (*walk_quadrupoles)[6];   // quadrupole of each node of the stream
+                                    // (BH_EXPANSION_QUADRUPOLE only)
+    int walk_count;                 // number of nodes in the stream, 0 when
+                                    // the moments changed since it was built
+    int walk_capacity;              // number of nodes allocated
+} octree_t;
+
+
+void init_octree(octree_t *tree, int n, int bucket_size);
+void reset_octree(octree_t *tree);
+void free_octree(octree_t *tree);
+void create_octree(octree_t *tree, particles_t *particles, pool_t *pool);
+bool update_octree(octree_t *tree, particles_t *particles, pool_t *pool);
+bool find_build(const char *name, bh_build_et *build);
+void calculate_nodes_gravity_center(octree_t *tree, pool_t *pool);
+
+/*
+ * =============================== FORCES ===============================
+ */
+
+static const float GRAVITATIONAL_CONSTANT = 6.67428e-11;
+
+// interaction lists are padded to a multiple of the widest vector
+#define INTERACTIONS_ALIGNMENT 16
+
+typedef struct interactions_s {
+    float *x;                       // 3D position of the sources
+    float *y;                       // 3D position of the sources
+    float *z;                       // 3D position of the sources
+    float *mass;                    // mass of the sources
+    float *quadrupole[6];           // quadrupole of the sources, see XX to
+                                    // ZZ (multipole lists only)
+    int count;                      // number of sources, padding included
+    int capacity;                   // number of sources allocated
+} interactions_t;
+
+// adds to the accelerations of the bodies first to last - 1 the ones due to
+// the sources of an interaction list, eps2 being the squared softening length
+typedef void (*kernel_ft)(const interactions_t *list, particles_t *particles,
+                          int first, int last, float eps2);
+
+typedef struct kernel_s {
+    const char *name;               // name of the kernel on command line
+    kernel_ft run;                  // point masses
+    kernel_ft run_quadrupole;       // point masses with a quadrupole moment
+} kernel_t;
+
+typedef struct walk_s {
+    _Alignas(64) interactions_t masses; // bodies, and accepted nodes with
+                                    // BH_EXPANSION_MONOPOLE, one cache line
+                                    // per thread to avoid false sharing
+    interactions_t multipoles;      // accepted nodes with
+                                    // BH_EXPANSION_QUADRUPOLE
+    uint64_t interactions;          // body-source interactions of the step
+    uint64_t visited;               // nodes tested by the opening criterion,
+                                    // summed over the bodies of each group
+    counters_t counters;            // counters of the step (STATS)
+} walk_t;
+
+// local expansion of the acceleration field about the gravity center g of
+// a node, a(g + d) = a + b d + c d d / 2, the symmetric tensors being
+// stored as their independent components (see XX to ZZ for b, c in the
+// order xxx, xxy, xxz, xyy, xyz, xzz, yyy, yyz, yzz, zzz)
+typedef struct local_s {
+    float a[3];                     // acceleration at the center
+    float b[6];                     // gradient of the acceleration
+    float c[10];                    // second derivatives of the acceleration
+} local_t;
+
+typedef struct fmm_s {
+    local_t *locals;                // local expansion of each node
+    float *radii;                   // distance from the gravity center of
+                                    // each node to its farthest body
+    int capacity;                   // number of nodes allocated
+    int *sinks;                     // roots of the sub-trees of the tasks
+    int sink_count;                 // number of sub-trees
+    int sink_capacity;              // number of sub-trees allocated
+    uint64_t **pairs;               // close leaf pairs of each thread, the
+                                    // sink in the high 32 bits
+    int *pair_capacity;             // number of pairs allocated per thread
+    int threads;                    // number of threads with pairs
+} fmm_t;
+
+typedef struct forces_s {
+    const kernel_t *kernel;         // kernel evaluating interaction lists
+    float softening;                // softening length
+    bh_mac_et mac;                  // opening criterion
+    float theta;                    // opening angle of BH_MAC_BH and BH_MAC_BOX
+    float alpha;                    // relative error of BH_MAC_RELATIVE
+    bh_expansion_et expansion;      // multipole expansion of the nodes
+    bh_engine_et engine;            // force engine
+    int steps;                      // number of force computations done
+    int active;                     // only the groups holding a body of
+                                    // this level or above are computed,
+                                    // 0 for all of them
+    int evaluated;                  // bodies of the groups computed in the
+                                    // last step
+    uint64_t interactions;          // body-source interactions of the last
+                                    // step
+    uint64_t visited;               // nodes tested for each body in the
+                                    // last step, summed over the bodies
+    walk_t *walks;                  // interaction lists of each thread
+    int walk_count;                 // number of threads with lists
+    octree_t *remote;               // octree of the nodes and bodies sent
+                                    // by the other ranks, walked after the
+                                    // local one, NULL if none
+    particles_t *remote_bodies;     // store of the remote octree
+    float *costs;                   // output, interactions of each body in
+                                    // the last step, NULL if not needed
+                                    // (BH_ENGINE_TREE only)
+    fmm_t fmm;                      // buffers of BH_ENGINE_FMM
+} forces_t;
+
+const kernel_t *get_kernel(bh_kernel_et kind);
+bool find_kernel(const char *name, bh_kernel_et *kind);
+bool find_mac(const char *name, bh_mac_et *mac);
+bool find_expansion(const char *name, bh_expansion_et *expansion);
+bool find_engine(const char *name, bh_engine_et *engine);
+void reserve_interactions(interactions_t *list, int count);
+void pad_interactions(interactions_t *list);
+bool init_forces(forces_t *forces, const config_t *config);
+void free_walk(walk_t *walk);
+void free_forces(forces_t *forces);
+void run_forces(forces_t *forces, octree_t *tree, particles_t *particles,
+                pool_t *pool);
+void get_essential_nodes(const forces_t *forces, octree_t *tree,
+                         particles_t *particles, const float box[2][3],
+                         float acceleration, walk_t *walk);
+void get_stats(const forces_t *forces, const octree_t *tree, stats_t *stats);
+void run_fmm(forces_t *forces, octree_t *tree, particles_t *particles,
+             pool_t *pool);
+void free_fmm(fmm_t *fmm);
+
+/*
+ * =============================== INTEGRATOR ===============================
+ */
+
+// a pass of an integrator on the bodies first to last - 1
+typedef void (*integrate_ft)(particles_t *particles, int first, int last,
+                             float dt);
 
-oct_node_t *create_octree(bodies_t *bodies);
-void clean_tree(oct_node_t *tree);
-void calculate_nodes_gravity_center(oct_node_t *tree);
-void run_forces(oct_node_t *tree);
+typedef struct integrator_s {
+    const char *name;               // name of the integrator on command line
+    integrate_ft begin;             // pass run before the forces
+    integrate_ft end;               // pass run after the forces
+} integrator_t;
+
+const integrator_t *get_integrator(bh_integrator_et kind);
+bool find_integrator(const char *name, bh_integrator_et *kind);
+void integrate(particles_t *particles, integrate_ft pass, float dt,
+               pool_t *pool);
+void drift_bodies(particles_t *particles, float dt, pool_t *pool);
+void kick_levels(particles_t *particles, float dt, int active, pool_t *pool);
+void assign_levels(particles_t *particles, const config_t *config, int active,
+                   pool_t *pool);
+int get_active_level(int substep, int levels);
+
+/*
+ * =============================== VALIDATION ===============================
+ */
+
+typedef struct accuracy_s {
+    float error[4];                 // median, 90th and 99th percentiles and
+                                    // maximum of |a - a_direct| / |a_direct|
+                                    // over the sampled bodies
+    double energy;                  // total energy (potential estimated from
+                                    // the sampled bodies)
+    double energy_drift;            // (energy - first energy) / |first energy|
+    double momentum_drift;          // |p - first p| / sum of m |v|
+} accuracy_t;
+
+typedef struct validation_s {
+    const kernel_t *kernel;         // kernel of the direct summation
+    float softening;                // softening length
+    int *sample;                    // identity of the sampled bodies
+    int sample_count;               // number of sampled bodies
+    int *index;                     // index in the store of each identity
+    interactions_t sources;         // all the bodies, padded
+    particles_t targets;            // sampled bodies, receiving the direct
+                                    // accelerations
+    double *potential;              // sum of m_j / r_ij of each sampled body
+    float *error;                   // relative error of each sampled body
+    bool started;                   // the first energy and momentum are set
+    double energy;                  // energy of the first check
+    double momentum[3];             // momentum of the first check
+} validation_t;
+
+bool init_validation(validation_t *validation, const config_t *config,
+                     particles_t *particles);
+void validate_forces(validation_t *validation, particles_t *particles,
+                     pool_t *pool, accuracy_t *accuracy);
+void free_validation(validation_t *validation);
+
+/*
+ * =============================== CONTEXT ===============================
+ */
+
+// the public bh_simulation_t
+typedef struct bh_simulation_s {
+    config_t config;                // parameters, config.dt being the step
+                                    // of the last bh_step_simulation
+    const integrator_t *integrator; // scheme moving the bodies
+    particles_t particles;          // store of all the bodies
+    octree_t tree;                  // octree of the last force computation
+    pool_t pool;                    // threads of the simulation
+    forces_t forces;                // force engine
+    step_stats_t stats;             // measures of the last step
+} simulation_t;
+
+bool init_simulation(simulation_t *simulation, const config_t *config,
+                     particles_t *particles);
+void free_simulation(simulation_t *simulation);
+
+/*
+ * =============================== DISTRIBUTED ===============================
+ */
+
+// the bodies are split between the ranks on the Morton key ranges of the
+// cells of this depth
+#define DOMAIN_LEVELS 5
+#define DOMAIN_CELLS (1 << (3 * DOMAIN_LEVELS))
+
+typedef struct comm_s {
+    int rank;                       // index of this process
+    int ranks;                      // number of processes
+    int *fds;                       // socket to each rank, -1 for itself
+} comm_t;
+
+void exchange_all(const comm_t *comm, void *const *send,
+                  const size_t *send_sizes, void **recv, size_t *recv_sizes);
+void run_distributed(const config_t *config);
+
+/*
+ * =============================== SNAPSHOT ===============================
+ */
+
+/*
+ * a snapshot file is a snapshot_header_t followed by the arrays of the
+ * bodies, in native (little-endian) byte order: identity (int32), x, y, z,
+ * mass, vx, vy and vz (float32), each padded to a multiple of
+ * SNAPSHOT_ALIGNMENT bytes so that a mapping of the file gives aligned
+ * arrays
+ */
+
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ALIGNMENT 64
+
+typedef struct snapshot_header_s {
+    char magic[8];                  // "BHSNAP" padded with zeros
+    uint32_t version;               // SNAPSHOT_VERSION
+    uint32_t header_size;           // offset of the first array, a multiple
+                                    // of SNAPSHOT_ALIGNMENT
+    uint64_t count;                 // number of bodies
+    uint64_t step;                  // number of steps done
+    double time;                    // simulated time
+    uint8_t reserved[24];           // zeros, pads the header to 64 bytes
+} snapshot_header_t;
+
+bool load_snapshot(particles_t *particles, const char *path,
+                   snapshot_header_t *header);
+bool save_snapshot(particles_t *particles, const char *path, uint64_t step,
+                   double time);
+bool write_all(int fd, const void *buffer, size_t size);
+
+/*
+ * a trajectory file is a sequence of frames, each one a frame_header_t
+ * followed by the identity (int32) of the bodies and their x, y and z
+ * arrays in the encoding of the frame (4 bytes per value for
+ * BH_ENCODING_FLOAT32, 2 otherwise), each array padded to a multiple of
+ * SNAPSHOT_ALIGNMENT bytes; a quantized value q stands for the position
+ * min + q * size / 65535
+ */
+
+typedef struct frame_header_s {
+    char magic[8];                  // "BHFRAME" padded with zeros
+    uint32_t version;               // SNAPSHOT_VERSION
+    uint32_t encoding;              // bh_encoding_et of the positions
+    uint64_t count;                 // number of bodies
+    uint64_t step;                  // number of steps done
+    double time;                    // simulated time
+    float min[3];                   // corner of the bounding cube of the
+                                    // bodies (BH_ENCODING_QUANTIZED)
+    float size;                     // width of the bounding cube
+                                    // (BH_ENCODING_QUANTIZED)
+    uint8_t reserved[8];            // zeros, pads the header to 64 bytes
+} frame_header_t;
+
+typedef struct frame_s {
+    int count;                      // number of bodies staged
+    int capacity;                   // number of bodies allocated
+    uint64_t step;                  // number of steps done
+    double time;                    // simulated time
+    int *id;                        // identity of the bodies
+    float *position[3];             // x, y and z of the bodies
+    uint16_t *encoded;              // positions of an axis once encoded,
+                                    // used by the I/O thread
+} frame_t;
+
+typedef struct writer_s {
+    int fd;                         // trajectory file
+    bh_encoding_et encoding;        // encoding of the positions
+    frame_t frames[2];              // staging buffers, filled by the
+                                    // simulation while the other is written
+    pthread_t thread;               // I/O thread
+    pthread_mutex_t lock;           // protects the fields below
+    pthread_cond_t changed;         // signaled when a frame is queued or
+                                    // taken, or on stop
+    int queued;                     // frame waiting for the I/O thread, -1
+    int writing;                    // frame being written, -1 if none
+    bool stop;                      // asks the I/O thread to exit once the
+                                    // queued frame is written
+    bool failed;                    // a write failed
+} writer_t;
+
+bool find_encoding(const char *name, bh_encoding_et *encoding);
+bool init_writer(writer_t *writer, const char *path, bh_encoding_et encoding);
+void push_frame(writer_t *writer, particles_t *particles, uint64_t step,
+                double time);
+bool free_writer(writer_t *writer);
+
+/*
+ * =============================== MORTON ===============================
+ */
+
+static const int MORTON_LEVELS = 21;  // levels of the octree a key can address
+
+/* FUNCTION: morton_octant
+ * --------------------------------------
+ * gets the sub-cube of a body in a node from its Morton key
+ *
+ * key: Morton key of the body
+ * level: depth of the node (0 for the root)
+ *
+ * returns: the sub-cube index, same order as get_body_interval
+ */
+static inline int morton_octant(uint64_t key, int level)
+{
+    return (int)(key >> (3 * (MORTON_LEVELS - 1 - level))) & 7;
+}
+
+void compute_morton_keys(particles_t *particles, const float min[3],
+                         float size, uint64_t *keys, int first, int last);
+void sort_morton_keys(uint64_t *keys, int *order, uint64_t *keys_tmp,
+                      int *order_tmp, int n, int bits);
+void sort_bodies(octree_t *tree, particles_t *particles, pool_t *pool);
 
 
 static const int X = 0;              // coordinates in min/max arrays   
 static const int Y = 1;              // coordinates in min/max arrays   
 static const int Z = 2;              // coordinates in min/max arrays   
 
+static const int XX = 0;             // components of the quadrupole arrays
+static const int XY = 1;             // components of the quadrupole arrays
+static const int XZ = 2;             // components of the quadrupole arrays
+static const int YY = 3;             // components of the quadrupole arrays
+static const int YZ = 4;             // components of the quadrupole arrays
+static const int ZZ = 5;             // components of the quadrupole arrays
+
 static const int BSW = 0;            // Bottom Sud West   
 static const int BSE = 1;            // Bottom Sud East   
 static const int BNW = 2;            // Bottom North West   
@@ -64,5 +595,3 @@ static const int TSW = 4;            // Top South West
 static const int TSE = 5;            // Top South East   
 static const int TNW = 6;            // Top North West   
 static const int TNE = 7;            // Top North East
-
-static const float THETA = 1.0;
\ No newline at end of file
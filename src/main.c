@@ -1,23 +1,209 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 
 #include "simulation.h"
 
-#include <GL/glut.h>
-
 static void print_help(void)
 {
-    printf("USAGE:\n\t./barnes_hut n\n\nPARAMETERS:\n\tn\t"
-           "number of bodies in the galaxy\n");
+    printf("USAGE:\n\t./barnes_hut n [options]\n\t./barnes_hut --load snapshot "
+           "[options]\n\nPARAMETERS:\n\tn\t"
+           "number of bodies in the galaxy\n\nOPTIONS:\n"
+           "\t-t, --threads n\t\tnumber of threads (default: number of "
+           "online processors)\n"
+           "\t--dt dt\t\t\ttime step (default: 1)\n"
+           "\t--steps n\t\tstep at which the simulation stops "
+           "(default: 10)\n"
+           "\t--integrator name\tleapfrog (kick-drift-kick, default) or "
+           "verlet\n"
+           "\t--levels n\t\tblock time steps: a body moves by steps of dt "
+           "/ 2^l,\n\t\t\t\tl < n chosen from its acceleration, "
+           "with a\n\t\t\t\tkick-drift-kick leapfrog (default: 1, the "
+           "same step\n\t\t\t\tfor every body)\n"
+           "\t--eta eta\t\ttime step criterion eta * sqrt(softening / "
+           "|a|)\n\t\t\t\tof the levels (default: 0.025)\n"
+           "\t--kernel name\t\tauto (default), scalar, avx2 or avx512\n"
+           "\t--softening eps\t\tsoftening length (default: 1)\n"
+           "\t--bucket n\t\tmaximum number of bodies in a leaf "
+           "(default: 16)\n"
+           "\t--mac name\t\topening criterion: bh (s / d from the center "
+           "of mass,\n\t\t\t\tdefault), box (s / d from the bounding box) "
+           "or\n\t\t\t\trelative (error relative to the last "
+           "acceleration)\n"
+           "\t--theta theta\t\topening angle of bh, box and fmm, at most 1 "
+           "with fmm\n\t\t\t\t(default: 1)\n"
+           "\t--alpha alpha\t\trelative error of relative (default: "
+           "0.005)\n"
+           "\t--order name\t\tmultipole expansion of the nodes: monopole "
+           "(default)\n\t\t\t\tor quadrupole\n"
+           "\t--engine name\t\tforce engine: tree (a tree walk per group "
+           "of bodies,\n\t\t\t\tdefault) or fmm (fast multipole "
+           "method, nodes\n\t\t\t\tinteracting when (r1 + r2) / d < "
+           "theta <= 1,\n\t\t\t\t--mac being ignored, not with --ranks)\n"
+           "\t--build name\t\tconstruction of the octree: morton (a "
+           "parallel bulk\n\t\t\t\tbuild from the Morton-sorted bodies, "
+           "default) or\n\t\t\t\tinsert (bodies inserted one by one)\n"
+           "\t--refit fraction\trefit the octree of the last step until "
+           "this\n\t\t\t\tfraction of the bodies left their leaf "
+           "(default: 0,\n\t\t\t\trebuild every step)\n"
+           "\t--load path\t\tstart from a snapshot, resuming at its step\n"
+           "\t--checkpoint path\twrite a snapshot during the run\n"
+           "\t--every n\t\tsteps between two checkpoints (default: 1)\n"
+           "\t--trajectory path\tappend the positions to a trajectory, "
+           "written\n\t\t\t\tin the background\n"
+           "\t--frame-every n\t\tsteps between two trajectory frames "
+           "(default: 1)\n"
+           "\t--encoding name\t\tpositions of the trajectory: float32 "
+           "(default),\n\t\t\t\tfloat16 or quantized (16-bit fixed "
+           "point)\n"
+           "\t--validate n|all\tcheck the accelerations of n random bodies "
+           "(or all\n\t\t\t\tof them) against a direct summation, and "
+           "track the\n\t\t\t\tenergy and momentum drift\n"
+           "\t--validate-every n\tsteps between two checks (default: 1)\n"
+           "\t--ranks n\t\tsplit the bodies between n processes "
+           "exchanging\n\t\t\t\ttheir essential octree nodes, the "
+           "threads being\n\t\t\t\tshared between them (default: 1, "
+           "not with --levels,\n\t\t\t\t--trajectory or --validate)\n");
+}
+
+/* FUNCTION: parse_args
+ * --------------------------------------
+ * fills the configuration of the simulation from the command line
+ *
+ * config: configuration to fill
+ * argc: number of arguments
+ * argv: arguments
+ *
+ * returns: false if the command line is invalid or asks for help
+ */
+static bool parse_args(config_t *config, int argc, char **argv)
+{
+    bh_init_config(config);
+    config->n = -1;
+    for (int i = 1; i < argc; i += 1) {
+        if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help"))
+            return false;
+        if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--threads")) {
+            if (++i == argc || atoi(argv[i]) < 1)
+                return false;
+            config->threads = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "--dt")) {
+            if (++i == argc || atof(argv[i]) <= 0)
+                return false;
+            config->dt = atof(argv[i]);
+        } else if (!strcmp(argv[i], "--integrator")) {
+            if (++i == argc || !find_integrator(argv[i], &config->integrator))
+                return false;
+        } else if (!strcmp(argv[i], "--levels")) {
+            if (++i == argc || atoi(argv[i]) < 1 || atoi(argv[i]) > MAX_LEVELS)
+                return false;
+            config->levels = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "--eta")) {
+            if (++i == argc || atof(argv[i]) <= 0)
+                return false;
+            config->eta = atof(argv[i]);
+        } else if (!strcmp(argv[i], "--kernel")) {
+            if (++i == argc || !find_kernel(argv[i], &config->kernel))
+                return false;
+        } else if (!strcmp(argv[i], "--softening")) {
+            if (++i == argc || atof(argv[i]) < 0)
+                return false;
+            config->softening = atof(argv[i]);
+        } else if (!strcmp(argv[i], "--bucket")) {
+            if (++i == argc || atoi(argv[i]) < 1)
+                return false;
+            config->bucket_size = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "--mac")) {
+            if (++i == argc || !find_mac(argv[i], &config->mac))
+                return false;
+        } else if (!strcmp(argv[i], "--theta")) {
+            if (++i == argc || atof(argv[i]) <= 0)
+                return false;
+            config->theta = atof(argv[i]);
+        } else if (!strcmp(argv[i], "--alpha")) {
+            if (++i == argc || atof(argv[i]) <= 0)
+                return false;
+            config->alpha = atof(argv[i]);
+        } else if (!strcmp(argv[i], "--order")) {
+            if (++i == argc || !find_expansion(argv[i], &config->expansion))
+                return false;
+        } else if (!strcmp(argv[i], "--engine")) {
+            if (++i == argc || !find_engine(argv[i], &config->engine))
+                return false;
+        } else if (!strcmp(argv[i], "--build")) {
+            if (++i == argc || !find_build(argv[i], &config->build))
+                return false;
+        } else if (!strcmp(argv[i], "--refit")) {
+            if (++i == argc || atof(argv[i]) < 0 || atof(argv[i]) > 1)
+                return false;
+            config->refit = atof(argv[i]);
+        } else if (!strcmp(argv[i], "--steps")) {
+            if (++i == argc || atoi(argv[i]) < 0)
+                return false;
+            config->steps = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "--load")) {
+            if (++i == argc)
+                return false;
+            config->load = argv[i];
+        } else if (!strcmp(argv[i], "--checkpoint")) {
+            if (++i == argc)
+                return false;
+            config->checkpoint = argv[i];
+        } else if (!strcmp(argv[i], "--every")) {
+            if (++i == argc || atoi(argv[i]) < 1)
+                return false;
+            config->checkpoint_every = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "--trajectory")) {
+            if (++i == argc)
+                return false;
+            config->trajectory = argv[i];
+        } else if (!strcmp(argv[i], "--frame-every")) {
+            if (++i == argc || atoi(argv[i]) < 1)
+                return false;
+            config->trajectory_every = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "--encoding")) {
+            if (++i == argc || !find_encoding(argv[i], &config->encoding))
+                return false;
+        } else if (!strcmp(argv[i], "--validate")) {
+            if (++i == argc || (strcmp(argv[i], "all") && atoi(argv[i]) < 1))
+                return false;
+            config->validate = strcmp(argv[i], "all") ? atoi(argv[i]) : INT_MAX;
+        } else if (!strcmp(argv[i], "--validate-every")) {
+            if (++i == argc || atoi(argv[i]) < 1)
+                return false;
+            config->validate_every = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "--ranks")) {
+            if (++i == argc || atoi(argv[i]) < 1)
+                return false;
+            config->ranks = atoi(argv[i]);
+        } else if (config->n < 0) {
+            config->n = atoi(argv[i]);
+        } else {
+            return false;
+        }
+    }
+    // (r1 + r2) < theta * d only keeps the nodes apart for theta <= 1
+    if (config->engine == BH_ENGINE_FMM && config->theta > 1)
+        return false;
+    if (config->ranks > 1 && (config->levels > 1 || config->trajectory != NULL
+                              || config->validate > 0
+                              || config->engine != BH_ENGINE_TREE))
+        return false;
+    return config->n >= 0 || config->load != NULL;
 }
 
 int main(int argc, char **argv)
 {
-    if (argc != 2 || !strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
+    config_t config;
+
+    if (!parse_args(&config, argc, argv)) {
         print_help();
         return 0;
     }
-    run_simulation(atoi(argv[1]));
+    if (config.ranks > 1)
+        run_distributed(&config);
+    else
+        run_simulation(&config);
     return 0;
 }
@@ -0,0 +1,367 @@
+#include "simulation.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+
+/* FUNCTION: get_time
+ * --------------------------------------
+ * returns: a monotonic time in milliseconds
+ */
+static double get_time(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec * 1e-6;
+}
+
+/* FUNCTION: compute_accelerations
+ * --------------------------------------
+ * computes the acceleration of every body from its current position
+ *
+ * simulation: simulation whose octree is rebuilt or refitted by this call
+ * times: output, build, gravity center and forces times in milliseconds
+ *
+ * returns: true if the octree was rebuilt, false if it was refitted
+ */
+static bool compute_accelerations(simulation_t *simulation, double times[3])
+{
+    double start = get_time();
+    bool rebuilt = update_octree(&simulation->tree, &simulation->particles,
+                                 &simulation->pool);
+
+    times[0] = get_time() - start;
+    start += times[0];
+    calculate_nodes_gravity_center(&simulation->tree, &simulation->pool);
+    times[1] = get_time() - start;
+    start += times[1];
+    run_forces(&simulation->forces, &simulation->tree, &simulation->particles,
+               &simulation->pool);
+    times[2] = get_time() - start;
+    return rebuilt;
+}
+
+/* FUNCTION: run_block_step
+ * --------------------------------------
+ * moves the bodies by a step of config.dt with block time steps (see
+ * kick_levels), in 2^(config.levels - 1) substeps of the finest level:
+ * each substep only computes the accelerations of the groups holding a body
+ * ending its step, on the octree refitted to the drifted positions, the
+ * last one, ending the step of every body, following config.refit
+ *
+ * simulation: simulation whose bodies have their levels
+ * times: output, build, gravity center, forces and integration times of
+ * the substeps in milliseconds
+ * evaluated: output, number of accelerations computed by the substeps
+ *
+ * returns: true if the octree was rebuilt by a substep
+ */
+static bool run_block_step(simulation_t *simulation, double times[4],
+                           uint64_t *evaluated)
+{
+    const config_t *config = &simulation->config;
+    particles_t *particles = &simulation->particles;
+    pool_t *pool = &simulation->pool;
+    int substeps = 1 << (config->levels - 1);
+    float dt = config->dt / substeps;
+    double phases[3];
+    double start;
+    bool rebuilt = false;
+    int active = 0;
+
+    memset(times, 0, sizeof(double) * 4);
+    *evaluated = 0;
+    for (int i = 1; i <= substeps; i += 1) {
+        start = get_time();
+        kick_levels(particles, config->dt, active, pool);
+        drift_bodies(particles, dt, pool);
+        times[3] += get_time() - start;
+        active = get_active_level(i, config->levels);
+        simulation->tree.refit = i == substeps ? config->refit : 1;
+        simulation->forces.active = active;
+        rebuilt = compute_accelerations(simulation, phases) || rebuilt;
+        *evaluated += simulation->forces.evaluated;
+        for (int phase = 0; phase < 3; phase += 1)
+            times[phase] += phases[phase];
+        start = get_time();
+        kick_levels(particles, config->dt, active, pool);
+        assign_levels(particles, config, active, pool);
+        times[3] += get_time() - start;
+    }
+    return rebuilt;
+}
+
+/* FUNCTION: bh_init_config
+ * --------------------------------------
+ * fills a configuration with the default parameters: no body, a thread per
+ * online processor, a leapfrog of step 1 and a tree walk with theta = 1
+ * on the widest kernel of the CPU
+ *
+ * config: configuration to fill
+ */
+void bh_init_config(config_t *config)
+{
+    memset(config, 0, sizeof(config_t));
+    config->threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    config->integrator = BH_INTEGRATOR_LEAPFROG;
+    config->dt = 1;
+    config->kernel = BH_KERNEL_AUTO;
+    config->softening = 1;
+    config->bucket_size = 16;
+    config->mac = BH_MAC_BH;
+    config->theta = 1;
+    config->alpha = 0.005;
+    config->expansion = BH_EXPANSION_MONOPOLE;
+    config->engine = BH_ENGINE_TREE;
+    config->build = BH_BUILD_MORTON;
+    config->refit = 0;
+    config->steps = 10;
+    config->checkpoint_every = 1;
+    config->trajectory_every = 1;
+    config->encoding = BH_ENCODING_FLOAT32;
+    config->validate_every = 1;
+    config->levels = 1;
+    config->eta = 0.025;
+    config->ranks = 1;
+}
+
+/* FUNCTION: check_dt
+ * --------------------------------------
+ * checks a time step
+ *
+ * dt: time step
+ *
+ * returns: false if the time step is not positive and finite
+ */
+static bool check_dt(float dt)
+{
+    return dt > 0 && isfinite(dt);
+}
+
+/* FUNCTION: check_config
+ * --------------------------------------
+ * checks the parameters read by a simulation, the kinds included, so that
+ * they can index the tables of integrators and kernels
+ *
+ * config: parameters of the simulation
+ *
+ * returns: false if a parameter is out of its range
+ */
+static bool check_config(const config_t *config)
+{
+    return (int)config->integrator >= BH_INTEGRATOR_LEAPFROG
+           && (int)config->integrator <= BH_INTEGRATOR_VERLET
+           && (int)config->kernel >= BH_KERNEL_AUTO
+           && (int)config->kernel <= BH_KERNEL_AVX512
+           && (int)config->mac >= BH_MAC_BH
+           && (int)config->mac <= BH_MAC_RELATIVE
+           && (int)config->expansion >= BH_EXPANSION_MONOPOLE
+           && (int)config->expansion <= BH_EXPANSION_QUADRUPOLE
+           && (int)config->engine >= BH_ENGINE_TREE
+           && (int)config->engine <= BH_ENGINE_FMM
+           && (int)config->build >= BH_BUILD_INSERT
+           && (int)config->build <= BH_BUILD_MORTON
+           && config->threads >= 1 && config->bucket_size >= 1
+           && config->levels >= 1 && config->levels <= MAX_LEVELS
+           && check_dt(config->dt) && config->softening >= 0
+           && config->theta > 0 && config->alpha > 0
+           && (config->engine != BH_ENGINE_FMM || config->theta <= 1)
+           && config->refit >= 0 && config->refit <= 1
+           && (config->levels == 1 || config->eta > 0);
+}
+
+/* FUNCTION: init_simulation
+ * --------------------------------------
+ * sets up a simulation on a store of bodies: allocates the octree node arena
+ * and the threads, computes the initial accelerations and, with
+ * config->levels > 1, the initial levels of the bodies
+ *
+ * the files of the configuration (load, checkpoint, trajectory) and its
+ * validation and ranks are left to the caller
+ *
+ * simulation: simulation to set up
+ * config: parameters of the simulation, copied
+ * particles: store of the bodies, taken over by the simulation (freed by
+ * free_simulation) unless this call fails
+ *
+ * returns: false if the force kernel is not supported by the CPU, if a
+ * parameter is out of its range or if the bodies are invalid (see
+ * check_particles)
+ */
+bool init_simulation(simulation_t *simulation, const config_t *config,
+                     particles_t *particles)
+{
+    memset(simulation, 0, sizeof(simulation_t));
+    if (!check_config(config) || !check_particles(particles)
+        || !init_forces(&simulation->forces, config))
+        return false;
+    simulation->config = *config;
+    simulation->integrator = get_integrator(config->integrator);
+    simulation->particles = *particles;
+    init_octree(&simulation->tree, particles->count, config->bucket_size);
+    simulation->tree.build = config->build;
+    simulation->tree.expansion = config->expansion;
+    simulation->tree.refit = config->refit;
+    init_pool(&simulation->pool, config->threads);
+    simulation->stats.rebuilt = compute_accelerations(simulation,
+                                                      simulation->stats.times);
+    simulation->stats.evaluated = simulation->forces.evaluated;
+    simulation->stats.interactions = simulation->forces.interactions;
+    simulation->stats.visited = simulation->forces.visited;
+    if (config->levels > 1)
+        assign_levels(&simulation->particles, &simulation->config, 0,
+                      &simulation->pool);
+    return true;
+}
+
+/* FUNCTION: bh_create_simulation
+ * --------------------------------------
+ * sets up a simulation on a copy of a buffer of bodies (see init_simulation)
+ *
+ * config: parameters of the simulation, copied
+ * count: number of bodies
+ * positions: x, y and z of each body, 3 * count floats
+ * velocities: vx, vy and vz of each body, 3 * count floats, NULL for bodies
+ * at rest
+ * masses: mass of each body, count floats
+ *
+ * returns: the simulation, NULL if the force kernel is not supported by the
+ * CPU, if a parameter or a kind is out of its range or if a body has a
+ * non-finite coordinate or a mass which is not positive
+ */
+simulation_t *bh_create_simulation(const config_t *config, int count,
+                                   const float *positions,
+                                   const float *velocities,
+                                   const float *masses)
+{
+    simulation_t *simulation;
+    particles_t particles;
+
+    if (count < 0)
+        return NULL;
+    simulation = (simulation_t *)malloc(sizeof(simulation_t));
+    if (simulation == NULL)
+        exit(1);
+    init_particles(&particles, count);
+    for (int i = 0; i < count; i += 1) {
+        add_particle(&particles, positions[3 * i], positions[3 * i + 1],
+                     positions[3 * i + 2], masses[i]);
+        if (velocities != NULL) {
+            particles.vx[i] = velocities[3 * i];
+            particles.vy[i] = velocities[3 * i + 1];
+            particles.vz[i] = velocities[3 * i + 2];
+        }
+    }
+    if (!init_simulation(simulation, config, &particles)) {
+        free_particles(&particles);
+        free(simulation);
+        return NULL;
+    }
+    return simulation;
+}
+
+/* FUNCTION: bh_step_simulation
+ * --------------------------------------
+ * moves the bodies by a step:
+ *      *  first pass of the integrator (moves the bodies)
+ *      *  create or refit the octree (reusing the arena)
+ *      *  compute the accelerations of the bodies
+ *      *  second pass of the integrator
+ *      *  or, with config.levels > 1, the substeps of the block time steps
+ *         (see run_block_step)
+ * and measures it in simulation->stats
+ *
+ * simulation: simulation to move
+ * dt: time step, becoming config.dt
+ *
+ * returns: false, the simulation being left as it is, if dt is not positive
+ * and finite
+ */
+bool bh_step_simulation(simulation_t *simulation, float dt)
+{
+    step_stats_t *stats = &simulation->stats;
+    double start;
+
+    if (!check_dt(dt))
+        return false;
+    simulation->config.dt = dt;
+    if (simulation->config.levels > 1) {
+        stats->rebuilt = run_block_step(simulation, stats->times,
+                                        &stats->evaluated);
+    } else {
+        start = get_time();
+        integrate(&simulation->particles, simulation->integrator->begin, dt,
+                  &simulation->pool);
+        stats->times[3] = get_time() - start;
+        stats->rebuilt = compute_accelerations(simulation, stats->times);
+        start = get_time();
+        integrate(&simulation->particles, simulation->integrator->end, dt,
+                  &simulation->pool);
+        stats->times[3] += get_time() - start;
+        stats->evaluated = simulation->forces.evaluated;
+    }
+    stats->interactions = simulation->forces.interactions;
+    stats->visited = simulation->forces.visited;
+    stats->step += 1;
+    stats->time += dt;
+    return true;
+}
+
+/* FUNCTION: bh_get_particles
+ * --------------------------------------
+ * gives the bodies of a simulation in place, reordered by the builds of the
+ * octree, their id following them
+ *
+ * simulation: simulation holding the bodies
+ *
+ * returns: the store of the bodies, valid until the next step
+ */
+const particles_t *bh_get_particles(const simulation_t *simulation)
+{
+    return &simulation->particles;
+}
+
+/* FUNCTION: bh_get_stats
+ * --------------------------------------
+ * gives the measures of the last step of a simulation
+ *
+ * simulation: simulation to measure
+ *
+ * returns: the measures, updated by each step
+ */
+const step_stats_t *bh_get_stats(const simulation_t *simulation)
+{
+    return &simulation->stats;
+}
+
+/* FUNCTION: free_simulation
+ * --------------------------------------
+ * stops the threads and releases everything held by a simulation set up by
+ * init_simulation, its bodies included
+ *
+ * simulation: simulation to free
+ */
+void free_simulation(simulation_t *simulation)
+{
+    free_pool(&simulation->pool);
+    free_forces(&simulation->forces);
+    free_octree(&simulation->tree);
+    free_particles(&simulation->particles);
+}
+
+/* FUNCTION: bh_free_simulation
+ * --------------------------------------
+ * releases a simulation created by bh_create_simulation
+ *
+ * simulation: simulation to free, or NULL
+ */
+void bh_free_simulation(simulation_t *simulation)
+{
+    if (simulation == NULL)
+        return;
+    free_simulation(simulation);
+    free(simulation);
+}
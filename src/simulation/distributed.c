@@ -0,0 +1,835 @@
+#include "simulation.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <float.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+/*
+ * the distributed mode runs the simulation on config->ranks processes, each
+ * one owning a part of the bodies, connected to each other by local stream
+ * sockets; every step:
+ *      *  the bodies are split on Morton key ranges of the root cube of all
+ *         the bodies, each rank getting the same share of the cost of the
+ *         forces of the last step (the interactions of its bodies), and
+ *         migrate to their rank
+ *      *  each rank builds the octree of its bodies
+ *      *  each rank sends to every other rank the nodes and bodies of its
+ *         octree needed by the walks of the bodies of the other rank (its
+ *         locally essential tree, see get_essential_nodes), from the
+ *         bounding box of these bodies
+ *      *  each rank builds a second octree of the nodes and bodies it
+ *         received, seen as point masses, and walks both octrees for the
+ *         forces of its bodies
+ * the rank 0 is the process which started the simulation, it displays the
+ * steps and writes the checkpoints from the bodies gathered on it
+ */
+
+typedef struct body_record_s {
+    int id;
+    float position[3];
+    float mass;
+    float velocity[3];
+    float acceleration[3];
+    float cost;                     // interactions of the last step
+} body_record_t;
+
+typedef struct point_record_s {
+    float position[3];
+    float mass;
+} point_record_t;
+
+typedef struct domain_s {
+    float box[2][3];                // bounding box of the bodies of a rank
+    float acceleration;             // smallest acceleration of its bodies
+    int count;                      // number of bodies
+} domain_t;
+
+typedef struct rank_stats_s {
+    int count;                      // bodies of the rank
+    int received;                   // nodes and bodies of the other ranks
+    double times[5];                // migration, build, essential tree,
+                                    // forces and integration times in ms
+} rank_stats_t;
+
+typedef struct rank_s {
+    const config_t *config;
+    comm_t comm;
+    pool_t pool;
+    forces_t forces;
+    particles_t particles;          // bodies of the rank
+    octree_t tree;                  // octree of the bodies of the rank
+    particles_t remote_bodies;      // nodes and bodies of the other ranks
+    octree_t remote;                // octree of remote_bodies
+    float *costs;                   // interactions of each body
+    int cost_capacity;              // number of costs allocated
+    walk_t walk;                    // lists of the essential trees
+    rank_stats_t stats;             // measures of the step
+} rank_t;
+
+/* FUNCTION: get_time
+ * --------------------------------------
+ * returns: a monotonic time in milliseconds
+ */
+static double get_time(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec * 1e-6;
+}
+
+/* FUNCTION: transfer
+ * --------------------------------------
+ * sends a buffer to each rank and receives one from each rank at the same
+ * time, polling the non-blocking sockets so that no rank waits on a full
+ * socket while the others do the same
+ *
+ * comm: ranks
+ * outputs: buffer to send to each rank
+ * send_sizes: size of each buffer to send
+ * inputs: buffer receiving the data of each rank
+ * recv_sizes: size of each buffer to receive
+ */
+static void transfer(const comm_t *comm, void *const *outputs,
+                     const size_t *send_sizes, void **inputs,
+                     const size_t *recv_sizes)
+{
+    struct pollfd *polls = (struct pollfd *)malloc(sizeof(struct pollfd)
+                                                   * comm->ranks);
+    size_t *sent = (size_t *)calloc(comm->ranks, sizeof(size_t));
+    size_t *received = (size_t *)calloc(comm->ranks, sizeof(size_t));
+    int pending = 1;
+    ssize_t done;
+
+    if (polls == NULL || sent == NULL || received == NULL)
+        exit(1);
+    if (send_sizes[comm->rank] > 0)
+        memcpy(inputs[comm->rank], outputs[comm->rank], send_sizes[comm->rank]);
+    while (pending > 0) {
+        pending = 0;
+        for (int r = 0; r < comm->ranks; r += 1) {
+            polls[r].fd = r == comm->rank ? -1 : comm->fds[r];
+            polls[r].events = (sent[r] < send_sizes[r] ? POLLOUT : 0)
+                              | (received[r] < recv_sizes[r] ? POLLIN : 0);
+            polls[r].revents = 0;
+            if (polls[r].fd >= 0 && polls[r].events)
+                pending += 1;
+            else
+                polls[r].fd = -1;
+        }
+        if (pending == 0)
+            break;
+        if (poll(polls, comm->ranks, -1) < 0)
+            exit(1);
+        for (int r = 0; r < comm->ranks; r += 1) {
+            if (polls[r].revents & POLLNVAL)
+                exit(1);
+            if ((polls[r].revents & (POLLOUT | POLLERR | POLLHUP))
+                && sent[r] < send_sizes[r]) {
+                done = send(comm->fds[r], (char *)outputs[r] + sent[r],
+                            send_sizes[r] - sent[r], MSG_NOSIGNAL);
+                if (done < 0 && errno != EAGAIN && errno != EINTR)
+                    exit(1);
+                sent[r] += done > 0 ? done : 0;
+            }
+            if ((polls[r].revents & (POLLIN | POLLHUP))
+                && received[r] < recv_sizes[r]) {
+                done = recv(comm->fds[r], (char *)inputs[r] + received[r],
+                            recv_sizes[r] - received[r], 0);
+                // a closed socket means that the other rank died
+                if (done == 0 || (done < 0 && errno != EAGAIN && errno != EINTR))
+                    exit(1);
+                received[r] += done > 0 ? done : 0;
+            }
+        }
+    }
+    free(polls);
+    free(sent);
+    free(received);
+}
+
+/* FUNCTION: exchange_all
+ * --------------------------------------
+ * sends a buffer of any size to each rank and receives the buffers sent by
+ * every rank, the buffer of a rank to itself being copied
+ *
+ * comm: ranks
+ * send: buffer to send to each rank
+ * send_sizes: size of each buffer to send
+ * recv: output, buffer received from each rank, to be freed by the caller
+ * recv_sizes: output, size of each received buffer
+ */
+void exchange_all(const comm_t *comm, void *const *send,
+                  const size_t *send_sizes, void **recv, size_t *recv_sizes)
+{
+    void **sizes_send = (void **)malloc(sizeof(void *) * comm->ranks);
+    void **sizes_recv = (void **)malloc(sizeof(void *) * comm->ranks);
+    size_t *sizes = (size_t *)malloc(sizeof(size_t) * comm->ranks);
+
+    if (sizes_send == NULL || sizes_recv == NULL || sizes == NULL)
+        exit(1);
+    for (int r = 0; r < comm->ranks; r += 1) {
+        sizes_send[r] = (void *)&send_sizes[r];
+        sizes_recv[r] = &recv_sizes[r];
+        sizes[r] = sizeof(size_t);
+    }
+    transfer(comm, sizes_send, sizes, sizes_recv, sizes);
+    for (int r = 0; r < comm->ranks; r += 1) {
+        recv[r] = malloc(recv_sizes[r] + 1);
+        if (recv[r] == NULL)
+            exit(1);
+    }
+    transfer(comm, send, send_sizes, recv, recv_sizes);
+    free(sizes_send);
+    free(sizes_recv);
+    free(sizes);
+}
+
+/* FUNCTION: gather_all
+ * --------------------------------------
+ * sends the same value to every rank and receives the value of every rank
+ *
+ * comm: ranks
+ * value: value of this rank
+ * size: size of the value
+ * values: output, value of each rank, comm->ranks * size bytes
+ */
+static void gather_all(const comm_t *comm, const void *value, size_t size,
+                       void *values)
+{
+    void **send = (void **)malloc(sizeof(void *) * comm->ranks);
+    void **recv = (void **)malloc(sizeof(void *) * comm->ranks);
+    size_t *sizes = (size_t *)malloc(sizeof(size_t) * comm->ranks);
+
+    if (send == NULL || recv == NULL || sizes == NULL)
+        exit(1);
+    for (int r = 0; r < comm->ranks; r += 1) {
+        send[r] = (void *)value;
+        recv[r] = (char *)values + r * size;
+        sizes[r] = size;
+    }
+    transfer(comm, send, sizes, recv, sizes);
+    free(send);
+    free(recv);
+    free(sizes);
+}
+
+/* FUNCTION: pack_body
+ * --------------------------------------
+ * copies a body of a store to a record sent to another rank
+ *
+ * rank: rank owning the body
+ * body: index of the body in the store of the rank
+ * record: output, record of the body
+ */
+static void pack_body(const rank_t *rank, int body, body_record_t *record)
+{
+    const particles_t *particles = &rank->particles;
+
+    record->id = particles->id[body];
+    record->position[X] = particles->x[body];
+    record->position[Y] = particles->y[body];
+    record->position[Z] = particles->z[body];
+    record->mass = particles->mass[body];
+    record->velocity[X] = particles->vx[body];
+    record->velocity[Y] = particles->vy[body];
+    record->velocity[Z] = particles->vz[body];
+    record->acceleration[X] = particles->ax[body];
+    record->acceleration[Y] = particles->ay[body];
+    record->acceleration[Z] = particles->az[body];
+    record->cost = body < rank->cost_capacity ? rank->costs[body] : 1;
+}
+
+/* FUNCTION: unpack_bodies
+ * --------------------------------------
+ * appends received bodies to a store, with their cost
+ *
+ * particles: store to append to
+ * records: bodies to append
+ * count: number of records
+ * costs: costs of the store, large enough for the new bodies
+ */
+static void unpack_bodies(particles_t *particles, const body_record_t *records,
+                          int count, float *costs)
+{
+    int body;
+
+    for (int i = 0; i < count; i += 1) {
+        body = add_particle(particles, records[i].position[X],
+                            records[i].position[Y], records[i].position[Z],
+                            records[i].mass);
+        particles->id[body] = records[i].id;
+        particles->vx[body] = records[i].velocity[X];
+        particles->vy[body] = records[i].velocity[Y];
+        particles->vz[body] = records[i].velocity[Z];
+        particles->ax[body] = records[i].acceleration[X];
+        particles->ay[body] = records[i].acceleration[Y];
+        particles->az[body] = records[i].acceleration[Z];
+        if (costs != NULL)
+            costs[body] = records[i].cost;
+    }
+}
+
+/* FUNCTION: reserve_costs
+ * --------------------------------------
+ * makes room for the cost of every body of the rank
+ *
+ * rank: rank owning the costs
+ * count: number of bodies
+ */
+static void reserve_costs(rank_t *rank, int count)
+{
+    if (count <= rank->cost_capacity)
+        return;
+    rank->cost_capacity = count;
+    rank->costs = (float *)realloc(rank->costs, sizeof(float) * count);
+    if (rank->costs == NULL)
+        exit(1);
+}
+
+/* FUNCTION: get_domain_cube
+ * --------------------------------------
+ * gets the root cube of all the bodies of all the ranks, shared by the
+ * Morton keys of the decomposition
+ *
+ * rank: rank of this process
+ * min: output, corner of the cube
+ * size: output, width of the cube
+ */
+static void get_domain_cube(rank_t *rank, float min[3], float *size)
+{
+    float (*bounds)[2][3] = (float (*)[2][3])malloc(sizeof(float[2][3])
+                                                    * rank->comm.ranks);
+    float local[2][3];
+    float max[3];
+    float magnitude = 0;
+
+    if (bounds == NULL)
+        exit(1);
+    get_particles_bounds(&rank->particles, &rank->pool, local[0], local[1]);
+    gather_all(&rank->comm, local, sizeof(local), bounds);
+    *size = 0;
+    for (int axis = 0; axis < 3; axis += 1) {
+        min[axis] = INFINITY;
+        max[axis] = -INFINITY;
+        for (int r = 0; r < rank->comm.ranks; r += 1) {
+            min[axis] = fminf(min[axis], bounds[r][0][axis]);
+            max[axis] = fmaxf(max[axis], bounds[r][1][axis]);
+        }
+        *size = fmaxf(*size, max[axis] - min[axis]);
+        magnitude = fmaxf(magnitude, fmaxf(fabsf(min[axis]), fabsf(max[axis])));
+    }
+    free(bounds);
+    if (min[X] > max[X]) {
+        // no bodies at all, same cube as create_octree
+        for (int axis = 0; axis < 3; axis += 1)
+            min[axis] = 0;
+        *size = GALAXY_SIZE;
+        return;
+    }
+    if (!isfinite(*size))
+        exit(1);
+    // same margin as the root cube of create_octree
+    *size = *size * (1 + 1e-5f) + 4 * FLT_EPSILON * magnitude;
+    if (*size == 0)
+        *size = 1;
+}
+
+/* FUNCTION: migrate_bodies
+ * --------------------------------------
+ * splits the Morton curve of the root cube of all the bodies in ranges of
+ * DOMAIN_CELLS cells of equal cost, from the costs of the last step summed
+ * over the ranks, and sends each body to the rank of its range
+ *
+ * rank: rank of this process, its store being replaced
+ */
+static void migrate_bodies(rank_t *rank)
+{
+    int ranks = rank->comm.ranks;
+    particles_t *particles = &rank->particles;
+    double *costs = (double *)calloc(DOMAIN_CELLS, sizeof(double));
+    double *all_costs = (double *)malloc(sizeof(double) * DOMAIN_CELLS * ranks);
+    uint64_t *keys = (uint64_t *)malloc(sizeof(uint64_t) * (particles->count + 1));
+    int *owners = (int *)malloc(sizeof(int) * (DOMAIN_CELLS + 1));
+    int *counts = (int *)calloc(ranks, sizeof(int));
+    void **send = (void **)calloc(ranks, sizeof(void *));
+    void **recv = (void **)malloc(sizeof(void *) * ranks);
+    size_t *send_sizes = (size_t *)malloc(sizeof(size_t) * ranks);
+    size_t *recv_sizes = (size_t *)malloc(sizeof(size_t) * ranks);
+    particles_t migrated;
+    double total = 0;
+    double sum = 0;
+    float min[3];
+    float size;
+    int cell;
+    int owner = 0;
+    int count = 0;
+
+    if (costs == NULL || all_costs == NULL || keys == NULL || owners == NULL
+        || counts == NULL || send == NULL || recv == NULL
+        || send_sizes == NULL || recv_sizes == NULL)
+        exit(1);
+    get_domain_cube(rank, min, &size);
+    compute_morton_keys(particles, min, size, keys, 0, particles->count);
+    FOREACH_PARTICLE(particles, i) {
+        cell = (int)(keys[i] >> (3 * (MORTON_LEVELS - DOMAIN_LEVELS)));
+        costs[cell] += i < rank->cost_capacity ? rank->costs[i] : 1;
+    }
+    gather_all(&rank->comm, costs, sizeof(double) * DOMAIN_CELLS, all_costs);
+    // every rank sums the costs in the same order, getting the same ranges
+    for (cell = 0; cell < DOMAIN_CELLS; cell += 1) {
+        costs[cell] = 0;
+        for (int r = 0; r < ranks; r += 1)
+            costs[cell] += all_costs[r * DOMAIN_CELLS + cell];
+        total += costs[cell];
+    }
+    for (cell = 0; cell < DOMAIN_CELLS; cell += 1) {
+        while (owner < ranks - 1 && sum + costs[cell] / 2
+                                    > total * (owner + 1) / ranks)
+            owner += 1;
+        owners[cell] = owner;
+        sum += costs[cell];
+    }
+    FOREACH_PARTICLE(particles, i) {
+        keys[i] = owners[keys[i] >> (3 * (MORTON_LEVELS - DOMAIN_LEVELS))];
+        counts[keys[i]] += 1;
+    }
+    for (int r = 0; r < ranks; r += 1) {
+        send[r] = malloc(sizeof(body_record_t) * counts[r] + 1);
+        if (send[r] == NULL)
+            exit(1);
+        send_sizes[r] = 0;
+    }
+    FOREACH_PARTICLE(particles, i) {
+        pack_body(rank, i, (body_record_t *)((char *)send[keys[i]]
+                                             + send_sizes[keys[i]]));
+        send_sizes[keys[i]] += sizeof(body_record_t);
+    }
+    exchange_all(&rank->comm, send, send_sizes, recv, recv_sizes);
+    for (int r = 0; r < ranks; r += 1)
+        count += recv_sizes[r] / sizeof(body_record_t);
+    reserve_costs(rank, count);
+    init_particles(&migrated, count);
+    for (int r = 0; r < ranks; r += 1) {
+        unpack_bodies(&migrated, (body_record_t *)recv[r],
+                      recv_sizes[r] / sizeof(body_record_t), rank->costs);
+        free(send[r]);
+        free(recv[r]);
+    }
+    free_particles(particles);
+    *particles = migrated;
+    free(costs);
+    free(all_costs);
+    free(keys);
+    free(owners);
+    free(counts);
+    free(send);
+    free(recv);
+    free(send_sizes);
+    free(recv_sizes);
+}
+
+/* FUNCTION: get_domain
+ * --------------------------------------
+ * describes the bodies of the rank for the essential trees of the others
+ *
+ * rank: rank of this process
+ * domain: output, domain of the rank
+ */
+static void get_domain(rank_t *rank, domain_t *domain)
+{
+    particles_t *particles = &rank->particles;
+    float acceleration;
+
+    memset(domain, 0, sizeof(domain_t));
+    domain->count = particles->count;
+    domain->acceleration = INFINITY;
+    get_particles_bounds(particles, &rank->pool, domain->box[0], domain->box[1]);
+    FOREACH_PARTICLE(particles, i) {
+        acceleration = sqrtf(particles->ax[i] * particles->ax[i]
+                             + particles->ay[i] * particles->ay[i]
+                             + particles->az[i] * particles->az[i]);
+        domain->acceleration = fminf(domain->acceleration, acceleration);
+    }
+}
+
+/* FUNCTION: pack_points
+ * --------------------------------------
+ * appends the sources of an interaction list to a buffer of point masses,
+ * the padding and the quadrupoles being dropped
+ *
+ * list: interaction list
+ * points: buffer to append to
+ * count: number of points in the buffer
+ *
+ * returns: the buffer, reallocated
+ */
+static point_record_t *pack_points(const interactions_t *list,
+                                   point_record_t *points, int *count)
+{
+    points = (point_record_t *)realloc(points, sizeof(point_record_t)
+                                       * (*count + list->count + 1));
+    if (points == NULL)
+        exit(1);
+    for (int i = 0; i < list->count; i += 1) {
+        points[*count].position[X] = list->x[i];
+        points[*count].position[Y] = list->y[i];
+        points[*count].position[Z] = list->z[i];
+        points[*count].mass = list->mass[i];
+        *count += 1;
+    }
+    return points;
+}
+
+/* FUNCTION: exchange_essential_trees
+ * --------------------------------------
+ * sends to every other rank the essential tree of the octree of this rank
+ * for its domain, and builds the octree of the nodes and bodies received
+ *
+ * rank: rank of this process, with its octree and moments computed
+ */
+static void exchange_essential_trees(rank_t *rank)
+{
+    int ranks = rank->comm.ranks;
+    domain_t *domains = (domain_t *)malloc(sizeof(domain_t) * ranks);
+    void **send = (void **)calloc(ranks, sizeof(void *));
+    void **recv = (void **)malloc(sizeof(void *) * ranks);
+    size_t *send_sizes = (size_t *)calloc(ranks, sizeof(size_t));
+    size_t *recv_sizes = (size_t *)malloc(sizeof(size_t) * ranks);
+    domain_t domain;
+    int count;
+
+    if (domains == NULL || send == NULL || recv == NULL || send_sizes == NULL
+        || recv_sizes == NULL)
+        exit(1);
+    get_domain(rank, &domain);
+    gather_all(&rank->comm, &domain, sizeof(domain_t), domains);
+    for (int r = 0; r < ranks; r += 1) {
+        if (r == rank->comm.rank || domains[r].count == 0
+            || rank->particles.count == 0)
+            continue;
+        count = 0;
+        get_essential_nodes(&rank->forces, &rank->tree, &rank->particles,
+                            domains[r].box, domains[r].acceleration,
+                            &rank->walk);
+        send[r] = pack_points(&rank->walk.masses, (point_record_t *)send[r],
+                              &count);
+        send[r] = pack_points(&rank->walk.multipoles,
+                              (point_record_t *)send[r], &count);
+        send_sizes[r] = sizeof(point_record_t) * count;
+    }
+    exchange_all(&rank->comm, send, send_sizes, recv, recv_sizes);
+    rank->remote_bodies.count = 0;
+    for (int r = 0; r < ranks; r += 1) {
+        for (size_t i = 0; i < recv_sizes[r] / sizeof(point_record_t); i += 1) {
+            point_record_t *point = (point_record_t *)recv[r] + i;
+
+            add_particle(&rank->remote_bodies, point->position[X],
+                         point->position[Y], point->position[Z], point->mass);
+        }
+        free(send[r]);
+        free(recv[r]);
+    }
+    rank->stats.received = rank->remote_bodies.count;
+    create_octree(&rank->remote, &rank->remote_bodies, &rank->pool);
+    // the root of an empty octree has no gravity center
+    if (rank->remote_bodies.count > 0)
+        calculate_nodes_gravity_center(&rank->remote, &rank->pool);
+    free(domains);
+    free(send);
+    free(recv);
+    free(send_sizes);
+    free(recv_sizes);
+}
+
+/* FUNCTION: compute_rank_accelerations
+ * --------------------------------------
+ * computes the acceleration of every body of the rank from the current
+ * positions of all the bodies, after their migration to the rank of their
+ * Morton key range
+ *
+ * rank: rank of this process
+ */
+static void compute_rank_accelerations(rank_t *rank)
+{
+    double start = get_time();
+
+    migrate_bodies(rank);
+    rank->stats.times[0] = get_time() - start;
+    start += rank->stats.times[0];
+    create_octree(&rank->tree, &rank->particles, &rank->pool);
+    if (rank->particles.count > 0)
+        calculate_nodes_gravity_center(&rank->tree, &rank->pool);
+    rank->stats.times[1] = get_time() - start;
+    start += rank->stats.times[1];
+    exchange_essential_trees(rank);
+    rank->stats.times[2] = get_time() - start;
+    start += rank->stats.times[2];
+    reserve_costs(rank, rank->particles.count);
+    rank->forces.costs = rank->costs;
+    run_forces(&rank->forces, &rank->tree, &rank->particles, &rank->pool);
+    rank->stats.times[3] = get_time() - start;
+    rank->stats.count = rank->particles.count;
+}
+
+/* FUNCTION: report_ranks
+ * --------------------------------------
+ * gathers the measures of the step of every rank, the rank 0 displaying
+ * the slowest time of each phase, the spread of the bodies and of the
+ * essential trees over the ranks and the imbalance of the force phase
+ *
+ * rank: rank of this process
+ * step: index of the step
+ */
+static void report_ranks(rank_t *rank, int step)
+{
+    rank_stats_t *stats = (rank_stats_t *)malloc(sizeof(rank_stats_t)
+                                                 * rank->comm.ranks);
+    rank_stats_t max;
+    rank_stats_t min;
+    double forces = 0;
+
+    if (stats == NULL)
+        exit(1);
+    gather_all(&rank->comm, &rank->stats, sizeof(rank_stats_t), stats);
+    max = stats[0];
+    min = stats[0];
+    for (int r = 0; r < rank->comm.ranks; r += 1) {
+        for (int phase = 0; phase < 5; phase += 1)
+            max.times[phase] = fmax(max.times[phase], stats[r].times[phase]);
+        max.count = stats[r].count > max.count ? stats[r].count : max.count;
+        min.count = stats[r].count < min.count ? stats[r].count : min.count;
+        max.received = stats[r].received > max.received
+                       ? stats[r].received : max.received;
+        min.received = stats[r].received < min.received
+                       ? stats[r].received : min.received;
+        forces += stats[r].times[3] / rank->comm.ranks;
+    }
+    if (rank->comm.rank == 0) {
+        printf("step %d: migration %.3f ms, build %.3f ms, essential trees "
+               "%.3f ms, forces %.3f ms, integration %.3f ms\n", step,
+               max.times[0], max.times[1], max.times[2], max.times[3],
+               max.times[4]);
+        printf("\tranks: %d to %d bodies, %d to %d remote sources, force "
+               "imbalance %.2f\n", min.count, max.count, min.received,
+               max.received, forces > 0 ? max.times[3] / forces : 1);
+    }
+    free(stats);
+}
+
+/* FUNCTION: save_ranks
+ * --------------------------------------
+ * gathers the bodies of every rank on the rank 0, which writes them to a
+ * snapshot
+ *
+ * rank: rank of this process
+ * step: number of steps done
+ * time: simulated time
+ */
+static void save_ranks(rank_t *rank, uint64_t step, double time)
+{
+    int ranks = rank->comm.ranks;
+    void **send = (void **)calloc(ranks, sizeof(void *));
+    void **recv = (void **)malloc(sizeof(void *) * ranks);
+    size_t *send_sizes = (size_t *)calloc(ranks, sizeof(size_t));
+    size_t *recv_sizes = (size_t *)malloc(sizeof(size_t) * ranks);
+    particles_t gathered;
+    int count = 0;
+
+    if (send == NULL || recv == NULL || send_sizes == NULL
+        || recv_sizes == NULL)
+        exit(1);
+    send[0] = malloc(sizeof(body_record_t) * rank->particles.count + 1);
+    if (send[0] == NULL)
+        exit(1);
+    FOREACH_PARTICLE(&rank->particles, i)
+        pack_body(rank, i, (body_record_t *)send[0] + i);
+    send_sizes[0] = sizeof(body_record_t) * rank->particles.count;
+    exchange_all(&rank->comm, send, send_sizes, recv, recv_sizes);
+    if (rank->comm.rank == 0) {
+        for (int r = 0; r < ranks; r += 1)
+            count += recv_sizes[r] / sizeof(body_record_t);
+        init_particles(&gathered, count);
+        for (int r = 0; r < ranks; r += 1)
+            unpack_bodies(&gathered, (body_record_t *)recv[r],
+                          recv_sizes[r] / sizeof(body_record_t), NULL);
+        if (!save_snapshot(&gathered, rank->config->checkpoint, step, time))
+            fprintf(stderr, "cannot write %s\n", rank->config->checkpoint);
+        free_particles(&gathered);
+    }
+    for (int r = 0; r < ranks; r += 1)
+        free(recv[r]);
+    free(send[0]);
+    free(send);
+    free(recv);
+    free(send_sizes);
+    free(recv_sizes);
+}
+
+/* FUNCTION: run_rank
+ * --------------------------------------
+ * runs the steps of the simulation on a rank, from its share of the
+ * initial bodies, with the kick-drift-kick of run_simulation around
+ * compute_rank_accelerations
+ *
+ * config: parameters of the simulation
+ * comm: sockets of this rank
+ * bodies: all the initial bodies, of which the rank takes an equal slice,
+ * freed by this call
+ * header: step and time of the initial bodies
+ */
+static void run_rank(const config_t *config, const comm_t *comm,
+                     particles_t *bodies, const snapshot_header_t *header)
+{
+    const integrator_t *integrator = get_integrator(config->integrator);
+    int first = (int)((long)bodies->count * comm->rank / comm->ranks);
+    int last = (int)((long)bodies->count * (comm->rank + 1) / comm->ranks);
+    int threads = config->threads / comm->ranks;
+    rank_t rank;
+    double start;
+    int body;
+
+    memset(&rank, 0, sizeof(rank_t));
+    rank.config = config;
+    rank.comm = *comm;
+    init_forces(&rank.forces, config);
+    rank.forces.remote = &rank.remote;
+    rank.forces.remote_bodies = &rank.remote_bodies;
+    init_particles(&rank.particles, last - first);
+    for (int i = first; i < last; i += 1) {
+        body = add_particle(&rank.particles, bodies->x[i], bodies->y[i],
+                            bodies->z[i], bodies->mass[i]);
+        rank.particles.id[body] = bodies->id[i];
+        rank.particles.vx[body] = bodies->vx[i];
+        rank.particles.vy[body] = bodies->vy[i];
+        rank.particles.vz[body] = bodies->vz[i];
+    }
+    free_particles(bodies);
+    init_particles(&rank.remote_bodies, 1);
+    init_octree(&rank.tree, last - first, config->bucket_size);
+    init_octree(&rank.remote, 1, config->bucket_size);
+    rank.tree.build = config->build;
+    rank.remote.build = config->build;
+    rank.tree.expansion = config->expansion;
+    rank.remote.expansion = config->expansion;
+    init_pool(&rank.pool, threads > 0 ? threads : 1);
+    compute_rank_accelerations(&rank);
+    for (int i = (int)header->step; i < config->steps; i += 1) {
+        start = get_time();
+        integrate(&rank.particles, integrator->begin, config->dt, &rank.pool);
+        rank.stats.times[4] = get_time() - start;
+        compute_rank_accelerations(&rank);
+        start = get_time();
+        integrate(&rank.particles, integrator->end, config->dt, &rank.pool);
+        rank.stats.times[4] += get_time() - start;
+        report_ranks(&rank, i);
+        if (config->checkpoint != NULL
+            && (i + 1) % config->checkpoint_every == 0)
+            save_ranks(&rank, i + 1, header->time + (double)config->dt
+                       * (i + 1 - header->step));
+    }
+    fflush(stdout);
+    free_pool(&rank.pool);
+    free_forces(&rank.forces);
+    free_walk(&rank.walk);
+    free_octree(&rank.tree);
+    free_octree(&rank.remote);
+    free_particles(&rank.particles);
+    free_particles(&rank.remote_bodies);
+    free(rank.costs);
+}
+
+/* FUNCTION: run_distributed
+ * --------------------------------------
+ * runs the simulation on config->ranks processes of this machine (see the
+ * top of this file): the initial bodies are created or loaded by this
+ * process, which then forks the other ranks, connected to each other by
+ * pairs of local stream sockets, and runs the rank 0 itself
+ *
+ * config: parameters of the simulation, as for run_simulation
+ */
+void run_distributed(const config_t *config)
+{
+    int ranks = config->ranks;
+    int *fds = (int *)malloc(sizeof(int) * ranks * ranks);
+    pid_t *pids = (pid_t *)malloc(sizeof(pid_t) * ranks);
+    particles_t bodies;
+    snapshot_header_t header = {0};
+    forces_t forces;
+    comm_t comm = {0, ranks, NULL};
+    int pair[2];
+    int status;
+    bool failed = false;
+
+    if (fds == NULL || pids == NULL)
+        exit(1);
+    if (!init_forces(&forces, config)) {
+        fprintf(stderr, "the force kernel is not supported by this CPU\n");
+        free(fds);
+        free(pids);
+        return;
+    }
+    printf("force kernel: %s, %d ranks\n", forces.kernel->name, ranks);
+    free_forces(&forces);
+    if (config->load == NULL) {
+        init_bodies(&bodies, config->n, 0);
+    } else if (!load_snapshot(&bodies, config->load, &header)) {
+        fprintf(stderr, "%s is not a valid snapshot\n", config->load);
+        free(fds);
+        free(pids);
+        return;
+    } else {
+        printf("loaded %d bodies at step %lu\n", bodies.count,
+               (unsigned long)header.step);
+    }
+    // fds[r * ranks + s] is the socket of the rank r to the rank s
+    for (int r = 0; r < ranks; r += 1) {
+        fds[r * ranks + r] = -1;
+        for (int s = r + 1; s < ranks; s += 1) {
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+                exit(1);
+            fcntl(pair[0], F_SETFL, O_NONBLOCK);
+            fcntl(pair[1], F_SETFL, O_NONBLOCK);
+            fds[r * ranks + s] = pair[0];
+            fds[s * ranks + r] = pair[1];
+        }
+    }
+    fflush(NULL);
+    for (int r = 1; r < ranks; r += 1) {
+        pids[r] = fork();
+        if (pids[r] < 0)
+            exit(1);
+        if (pids[r] == 0) {
+            comm.rank = r;
+            break;
+        }
+    }
+    // each rank keeps its own row of sockets
+    for (int i = 0; i < ranks * ranks; i += 1)
+        if (i / ranks != comm.rank && fds[i] >= 0)
+            close(fds[i]);
+    comm.fds = fds + comm.rank * ranks;
+    run_rank(config, &comm, &bodies, &header);
+    for (int s = 0; s < ranks; s += 1)
+        if (comm.fds[s] >= 0)
+            close(comm.fds[s]);
+    if (comm.rank != 0)
+        _exit(0);
+    for (int r = 1; r < ranks; r += 1)
+        if (waitpid(pids[r], &status, 0) < 0 || !WIFEXITED(status)
+            || WEXITSTATUS(status) != 0)
+            failed = true;
+    if (failed)
+        fprintf(stderr, "a rank of the simulation failed\n");
+    free(fds);
+    free(pids);
+}
@@ -0,0 +1,534 @@
+#include "simulation.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/*
+ * the fast multipole engine (BH_ENGINE_FMM) computes the accelerations from the
+ * octree and moments used by the tree walks, with a dual tree walk on pairs
+ * of nodes (sink A, source B), in the manner of Dehnen (2002):
+ *      *  A and B well separated, (r_A + r_B) < theta * |g_A - g_B| where g
+ *         is the gravity center of a node and r the distance from g to its
+ *         farthest body: the multipole of B is translated to the local
+ *         expansion of A (M2L)
+ *      *  A and B leaves: the bodies of B go to the interaction list of the
+ *         bodies of A, evaluated by the force kernel (P2P)
+ *      *  else the larger node is split, the walk going on with its children
+ * the local expansions are then translated down to the children (L2L) and
+ * evaluated at the bodies of the leaves (L2P)
+ *
+ * a node interacts with a node as a whole instead of each of its groups of
+ * bodies, so that the cost of the far field does not grow with the number
+ * of bodies in the node, O(N) instead of O(N log N) for the tree walks
+ *
+ * the multipoles are the monopole and, with BH_EXPANSION_QUADRUPOLE, the
+ * quadrupole about the gravity center; the local expansions hold the
+ * acceleration and its first and second derivatives, the quadrupole only
+ * adding to the acceleration (all the terms of the potential up to the
+ * third order in 1/d)
+ *
+ * the walk is split in tasks on the sub-trees of sinks rooted at
+ * SPLIT_LEVEL (or at the leaves above it), each task walking the whole tree
+ * of sources for its own sub-tree and writing only its own local
+ * expansions and accelerations; the nodes above SPLIT_LEVEL are never
+ * sinks, which costs a few more M2L on the top levels
+ */
+
+// a radius task works on NODES_PER_TASK consecutive nodes
+static const int NODES_PER_TASK = 4096;
+
+// axes of the components of local_t.b
+static const int PAIRS[6][2] = {
+    {0, 0}, {0, 1}, {0, 2}, {1, 1}, {1, 2}, {2, 2},
+};
+
+// component of local_t.b of each pair of axes
+static const int PAIR_INDEX[3][3] = {
+    {0, 1, 2},
+    {1, 3, 4},
+    {2, 4, 5},
+};
+
+// component of local_t.c of each triplet of axes
+static const int TRIPLET_INDEX[3][3][3] = {
+    {{0, 1, 2}, {1, 3, 4}, {2, 4, 5}},
+    {{1, 3, 4}, {3, 6, 7}, {4, 7, 8}},
+    {{2, 4, 5}, {4, 7, 8}, {5, 8, 9}},
+};
+
+typedef struct fmm_task_s {
+    forces_t *forces;
+    octree_t *tree;
+    particles_t *particles;
+} fmm_task_t;
+
+/* FUNCTION: reserve_fmm
+ * --------------------------------------
+ * makes room in the buffers of the engine for the nodes of an octree and
+ * the threads of a pool
+ *
+ * fmm: buffers to grow
+ * tree: octree of the step
+ * pool: threads of the step
+ */
+static void reserve_fmm(fmm_t *fmm, const octree_t *tree, const pool_t *pool)
+{
+    if (tree->count > fmm->capacity) {
+        fmm->capacity = tree->count;
+        free(fmm->locals);
+        free(fmm->radii);
+        fmm->locals = (local_t *)malloc(sizeof(local_t) * fmm->capacity);
+        fmm->radii = (float *)malloc(sizeof(float) * fmm->capacity);
+        if (fmm->locals == NULL || fmm->radii == NULL)
+            exit(1);
+    }
+    if (pool->threads > fmm->threads) {
+        fmm->pairs = (uint64_t **)realloc(fmm->pairs, sizeof(uint64_t *)
+                                          * pool->threads);
+        fmm->pair_capacity = (int *)realloc(fmm->pair_capacity, sizeof(int)
+                                            * pool->threads);
+        if (fmm->pairs == NULL || fmm->pair_capacity == NULL)
+            exit(1);
+        for (int i = fmm->threads; i < pool->threads; i += 1) {
+            fmm->pairs[i] = NULL;
+            fmm->pair_capacity[i] = 0;
+        }
+        fmm->threads = pool->threads;
+    }
+}
+
+/* FUNCTION: radius_task
+ * --------------------------------------
+ * computes the distance from the gravity center of NODES_PER_TASK nodes to
+ * the farthest corner of the bounding box of their bodies
+ *
+ * data: fmm_task_t of the step
+ * task: index of the first node divided by NODES_PER_TASK
+ * thread: unused, each task only writes its own nodes
+ */
+static void radius_task(void *data, int task, int thread)
+{
+    fmm_task_t *fmm = (fmm_task_t *)data;
+    octree_t *tree = fmm->tree;
+    oct_node_t *node;
+    int first = task * NODES_PER_TASK;
+    int last = first + NODES_PER_TASK;
+    float d[3];
+
+    (void)thread;
+    if (last > tree->count)
+        last = tree->count;
+    for (int i = first; i < last; i += 1) {
+        node = &tree->nodes[i];
+        if (node->type == EMPTY)
+            continue;
+        for (int axis = 0; axis < 3; axis += 1)
+            d[axis] = fmaxf(node->position[axis] - node->box[0][axis],
+                            node->box[1][axis] - node->position[axis]);
+        fmm->forces->fmm.radii[i] = sqrtf(d[X] * d[X] + d[Y] * d[Y]
+                                          + d[Z] * d[Z]);
+    }
+}
+
+/* FUNCTION: collect_sinks
+ * --------------------------------------
+ * lists the roots of the sub-trees of the tasks: the nodes at SPLIT_LEVEL
+ * and the leaves above it
+ *
+ * fmm: buffers of the engine
+ * tree: octree of the step
+ * index: index of a PARENT node
+ * level: depth of the node (0 for the root)
+ */
+static void collect_sinks(fmm_t *fmm, const octree_t *tree, int index,
+                          int level)
+{
+    int child;
+
+    for (int i = 0; i < 8; i += 1) {
+        child = tree->nodes[index].child + i;
+        if (tree->nodes[child].type == EMPTY)
+            continue;
+        if (tree->nodes[child].type == PARENT && level + 1 < SPLIT_LEVEL) {
+            collect_sinks(fmm, tree, child, level + 1);
+            continue;
+        }
+        if (fmm->sink_count == fmm->sink_capacity) {
+            fmm->sink_capacity = fmm->sink_capacity ? 2 * fmm->sink_capacity : 64;
+            fmm->sinks = (int *)realloc(fmm->sinks, sizeof(int)
+                                        * fmm->sink_capacity);
+            if (fmm->sinks == NULL)
+                exit(1);
+        }
+        fmm->sinks[fmm->sink_count] = child;
+        fmm->sink_count += 1;
+    }
+}
+
+/* FUNCTION: clear_sinks
+ * --------------------------------------
+ * clears the local expansions of a sub-tree and the accelerations of its
+ * bodies
+ *
+ * fmm: fmm_task_t of the step
+ * index: index of the root of the sub-tree
+ */
+static void clear_sinks(fmm_task_t *fmm, int index)
+{
+    oct_node_t *node = &fmm->tree->nodes[index];
+    particles_t *particles = fmm->particles;
+
+    memset(&fmm->forces->fmm.locals[index], 0, sizeof(local_t));
+    if (node->type == CHILD) {
+        for (int i = node->body; i < node->body + node->count; i += 1) {
+            particles->ax[i] = 0;
+            particles->ay[i] = 0;
+            particles->az[i] = 0;
+        }
+        return;
+    }
+    for (int i = 0; i < 8; i += 1)
+        if (fmm->tree->nodes[node->child + i].type != EMPTY)
+            clear_sinks(fmm, node->child + i);
+}
+
+/* FUNCTION: translate_multipole
+ * --------------------------------------
+ * adds the field of the multipole of a source node to the local expansion
+ * of a sink node (M2L), with the derivatives of the softened potential
+ * 1 / R, R^2 = |r|^2 + eps^2, r going from the source to the sink:
+ *
+ *      a = G (M D1 + Q : D3 / 6), b = G M D2, c = G M D3
+ *
+ * D1 to D3 being the first to third derivatives of 1 / R at r
+ *
+ * forces: force engine
+ * local: local expansion of the sink
+ * sink: sink node
+ * source: source node with its moments computed
+ */
+static void translate_multipole(const forces_t *forces, local_t *local,
+                                const oct_node_t *sink,
+                                const oct_node_t *source)
+{
+    float r[3];
+    float rr[6];
+    float inv_r;
+    float inv_r2;
+    float g1;
+    float g2;
+    float g3;
+    float qr[3];
+    float rqr;
+
+    for (int axis = 0; axis < 3; axis += 1)
+        r[axis] = sink->position[axis] - source->position[axis];
+    for (int k = 0; k < 6; k += 1)
+        rr[k] = r[PAIRS[k][0]] * r[PAIRS[k][1]];
+    inv_r2 = 1.0f / (rr[XX] + rr[YY] + rr[ZZ]
+                     + forces->softening * forces->softening);
+    inv_r = sqrtf(inv_r2);
+    // G M times the factors of the terms of D1, D2 and D3
+    g1 = GRAVITATIONAL_CONSTANT * source->weight * inv_r * inv_r2;
+    g2 = 3 * g1 * inv_r2;
+    g3 = -5 * g2 * inv_r2;
+    for (int i = 0; i < 3; i += 1)
+        local->a[i] -= g1 * r[i];
+    for (int k = 0; k < 6; k += 1)
+        local->b[k] += g2 * rr[k];
+    local->b[XX] -= g1;
+    local->b[YY] -= g1;
+    local->b[ZZ] -= g1;
+    local->c[0] += (g3 * rr[XX] + 3 * g2) * r[X];
+    local->c[1] += (g3 * rr[XX] + g2) * r[Y];
+    local->c[2] += (g3 * rr[XX] + g2) * r[Z];
+    local->c[3] += (g3 * rr[YY] + g2) * r[X];
+    local->c[4] += g3 * rr[YZ] * r[X];
+    local->c[5] += (g3 * rr[ZZ] + g2) * r[X];
+    local->c[6] += (g3 * rr[YY] + 3 * g2) * r[Y];
+    local->c[7] += (g3 * rr[YY] + g2) * r[Z];
+    local->c[8] += (g3 * rr[ZZ] + g2) * r[Y];
+    local->c[9] += (g3 * rr[ZZ] + 3 * g2) * r[Z];
+    if (forces->expansion != BH_EXPANSION_QUADRUPOLE)
+        return;
+    // Q : D3 / 6 = Q r / R^5 - 5 / 2 (r . Q r) r / R^7 for a traceless Q
+    qr[X] = source->quadrupole[XX] * r[X] + source->quadrupole[XY] * r[Y]
+            + source->quadrupole[XZ] * r[Z];
+    qr[Y] = source->quadrupole[XY] * r[X] + source->quadrupole[YY] * r[Y]
+            + source->quadrupole[YZ] * r[Z];
+    qr[Z] = source->quadrupole[XZ] * r[X] + source->quadrupole[YZ] * r[Y]
+            + source->quadrupole[ZZ] * r[Z];
+    rqr = r[X] * qr[X] + r[Y] * qr[Y] + r[Z] * qr[Z];
+    g1 = GRAVITATIONAL_CONSTANT * inv_r * inv_r2 * inv_r2;
+    for (int i = 0; i < 3; i += 1)
+        local->a[i] += g1 * (qr[i] - 2.5f * rqr * r[i] * inv_r2);
+}
+
+/* FUNCTION: add_pair
+ * --------------------------------------
+ * records a pair of close leaves, evaluated by the kernel once the walk of
+ * the task is over
+ *
+ * fmm: buffers of the engine
+ * thread: thread of the task
+ * count: number of pairs of the thread
+ * sink: index of the sink leaf
+ * source: index of the source leaf
+ */
+static void add_pair(fmm_t *fmm, int thread, int *count, int sink, int source)
+{
+    if (*count == fmm->pair_capacity[thread]) {
+        fmm->pair_capacity[thread] = *count ? 2 * *count : 1024;
+        fmm->pairs[thread] = (uint64_t *)realloc(fmm->pairs[thread],
+            sizeof(uint64_t) * fmm->pair_capacity[thread]);
+        if (fmm->pairs[thread] == NULL)
+            exit(1);
+    }
+    fmm->pairs[thread][*count] = (uint64_t)sink << 32 | (uint32_t)source;
+    *count += 1;
+}
+
+/* FUNCTION: interact
+ * --------------------------------------
+ * walks a pair of nodes (see the top of this file)
+ *
+ * fmm: fmm_task_t of the step
+ * walk: counters of the thread
+ * thread: thread of the task
+ * count: number of close pairs of the thread
+ * sink: index of the sink node
+ * source: index of the source node
+ */
+static void interact(fmm_task_t *fmm, walk_t *walk, int thread, int *count,
+                     int sink, int source)
+{
+    const forces_t *forces = fmm->forces;
+    const float *radii = forces->fmm.radii;
+    oct_node_t *nodes = fmm->tree->nodes;
+    oct_node_t *a = &nodes[sink];
+    oct_node_t *b = &nodes[source];
+    float d[3];
+    float d2;
+    float r;
+
+    walk->visited += 1;
+    STAT(walk->counters.tests += 1);
+    for (int axis = 0; axis < 3; axis += 1)
+        d[axis] = a->position[axis] - b->position[axis];
+    d2 = d[X] * d[X] + d[Y] * d[Y] + d[Z] * d[Z];
+    r = radii[sink] + radii[source];
+    if (sink != source && r * r < forces->theta * forces->theta * d2) {
+        STAT(walk->counters.node_interactions += 1);
+        walk->interactions += 1;
+        translate_multipole(forces, &forces->fmm.locals[sink], a, b);
+        return;
+    }
+    STAT(walk->counters.rejections += 1);
+    if (a->type == CHILD && b->type == CHILD) {
+        STAT(walk->counters.leaf_interactions += (uint64_t)a->count * b->count);
+        walk->interactions += (uint64_t)a->count * b->count;
+        add_pair(&fmm->forces->fmm, thread, count, sink, source);
+        return;
+    }
+    STAT(walk->counters.openings += 1);
+    if (b->type == CHILD || (a->type == PARENT && radii[sink] > radii[source])) {
+        for (int i = 0; i < 8; i += 1)
+            if (nodes[a->child + i].type != EMPTY)
+                interact(fmm, walk, thread, count, a->child + i, source);
+    } else {
+        for (int i = 0; i < 8; i += 1)
+            if (nodes[b->child + i].type != EMPTY)
+                interact(fmm, walk, thread, count, sink, b->child + i);
+    }
+}
+
+/* FUNCTION: compare_pairs
+ * --------------------------------------
+ * orders two leaf pairs for qsort, by sink then by source
+ */
+static int compare_pairs(const void *a, const void *b)
+{
+    uint64_t pair_a = *(const uint64_t *)a;
+    uint64_t pair_b = *(const uint64_t *)b;
+
+    return (pair_a > pair_b) - (pair_a < pair_b);
+}
+
+/* FUNCTION: run_pairs
+ * --------------------------------------
+ * evaluates the close leaf pairs of a task (P2P), the bodies of all the
+ * sources of a sink leaf going through the kernel at once
+ *
+ * fmm: fmm_task_t of the step
+ * list: interaction list of the thread
+ * pairs: pairs of the task
+ * count: number of pairs
+ */
+static void run_pairs(fmm_task_t *fmm, interactions_t *list, uint64_t *pairs,
+                      int count)
+{
+    const forces_t *forces = fmm->forces;
+    particles_t *particles = fmm->particles;
+    float eps2 = forces->softening * forces->softening;
+    oct_node_t *sink;
+    oct_node_t *source;
+    uint64_t leaf;
+    int first = 0;
+
+    qsort(pairs, count, sizeof(uint64_t), compare_pairs);
+    while (first < count) {
+        leaf = pairs[first] >> 32;
+        sink = &fmm->tree->nodes[leaf];
+        list->count = 0;
+        for (int i = first; i < count && pairs[i] >> 32 == leaf; i += 1) {
+            source = &fmm->tree->nodes[(uint32_t)pairs[i]];
+            reserve_interactions(list, list->count + source->count
+                                       + INTERACTIONS_ALIGNMENT);
+            for (int j = source->body; j < source->body + source->count; j += 1) {
+                list->x[list->count] = particles->x[j];
+                list->y[list->count] = particles->y[j];
+                list->z[list->count] = particles->z[j];
+                list->mass[list->count] = particles->mass[j];
+                list->count += 1;
+            }
+            first = i + 1;
+        }
+        pad_interactions(list);
+        forces->kernel->run(list, particles, sink->body,
+                            sink->body + sink->count, eps2);
+    }
+}
+
+/* FUNCTION: translate_local
+ * --------------------------------------
+ * translates the local expansions of a sub-tree down to the leaves (L2L),
+ * and adds them to the accelerations of their bodies (L2P)
+ *
+ * fmm: fmm_task_t of the step
+ * index: index of the root of the sub-tree, its expansion complete
+ */
+static void translate_local(fmm_task_t *fmm, int index)
+{
+    oct_node_t *node = &fmm->tree->nodes[index];
+    const local_t *local = &fmm->forces->fmm.locals[index];
+    particles_t *particles = fmm->particles;
+    local_t *child;
+    float d[3];
+    float a[3];
+    float cd[3][3];
+
+    if (node->type == CHILD) {
+        for (int body = node->body; body < node->body + node->count; body += 1) {
+            d[X] = particles->x[body] - node->position[X];
+            d[Y] = particles->y[body] - node->position[Y];
+            d[Z] = particles->z[body] - node->position[Z];
+            for (int i = 0; i < 3; i += 1) {
+                a[i] = local->a[i];
+                for (int j = 0; j < 3; j += 1) {
+                    a[i] += local->b[PAIR_INDEX[i][j]] * d[j];
+                    for (int k = 0; k < 3; k += 1)
+                        a[i] += 0.5f * local->c[TRIPLET_INDEX[i][j][k]]
+                                * d[j] * d[k];
+                }
+            }
+            particles->ax[body] += a[X];
+            particles->ay[body] += a[Y];
+            particles->az[body] += a[Z];
+        }
+        return;
+    }
+    for (int c = 0; c < 8; c += 1) {
+        if (fmm->tree->nodes[node->child + c].type == EMPTY)
+            continue;
+        child = &fmm->forces->fmm.locals[node->child + c];
+        for (int axis = 0; axis < 3; axis += 1)
+            d[axis] = fmm->tree->nodes[node->child + c].position[axis]
+                      - node->position[axis];
+        // c d, then a += b d + c d d / 2 and b += c d
+        for (int i = 0; i < 3; i += 1)
+            for (int j = 0; j < 3; j += 1)
+                cd[i][j] = local->c[TRIPLET_INDEX[i][j][X]] * d[X]
+                           + local->c[TRIPLET_INDEX[i][j][Y]] * d[Y]
+                           + local->c[TRIPLET_INDEX[i][j][Z]] * d[Z];
+        for (int i = 0; i < 3; i += 1) {
+            child->a[i] += local->a[i];
+            for (int j = 0; j < 3; j += 1)
+                child->a[i] += (local->b[PAIR_INDEX[i][j]]
+                                + 0.5f * cd[i][j]) * d[j];
+            for (int j = i; j < 3; j += 1)
+                child->b[PAIR_INDEX[i][j]] += local->b[PAIR_INDEX[i][j]]
+                                              + cd[i][j];
+        }
+        for (int k = 0; k < 10; k += 1)
+            child->c[k] += local->c[k];
+        translate_local(fmm, node->child + c);
+    }
+}
+
+/* FUNCTION: fmm_task
+ * --------------------------------------
+ * computes the accelerations of the bodies of a sub-tree of sinks: walk of
+ * the pairs of its nodes with the whole tree, evaluation of its close
+ * pairs, then translation of its local expansions down to its bodies
+ *
+ * data: fmm_task_t of the step
+ * task: index of the sub-tree in fmm->sinks
+ * thread: index of the worker, selecting its pairs and lists
+ */
+static void fmm_task(void *data, int task, int thread)
+{
+    fmm_task_t *fmm = (fmm_task_t *)data;
+    walk_t *walk = &fmm->forces->walks[thread];
+    int sink = fmm->forces->fmm.sinks[task];
+    int count = 0;
+
+    clear_sinks(fmm, sink);
+    interact(fmm, walk, thread, &count, sink, 0);
+    run_pairs(fmm, &walk->masses, fmm->forces->fmm.pairs[thread], count);
+    translate_local(fmm, sink);
+    STAT(walk->counters.walks += 1);
+}
+
+/* FUNCTION: run_fmm
+ * --------------------------------------
+ * computes the acceleration of every body of the octree with the fast
+ * multipole engine, counting the translations and body pairs in
+ * forces->walks[thread].interactions and the pairs of nodes tested in
+ * forces->walks[thread].visited
+ *
+ * forces: force engine, with a walk for each thread of the pool
+ * tree: octree with its moments computed
+ * particles: store of all the bodies in the universe
+ * pool: threads running the tasks
+ */
+void run_fmm(forces_t *forces, octree_t *tree, particles_t *particles,
+             pool_t *pool)
+{
+    fmm_task_t task = {forces, tree, particles};
+
+    reserve_fmm(&forces->fmm, tree, pool);
+    run_pool(pool, (tree->count + NODES_PER_TASK - 1) / NODES_PER_TASK,
+             radius_task, &task);
+    forces->fmm.sink_count = 0;
+    collect_sinks(&forces->fmm, tree, 0, 0);
+    run_pool(pool, forces->fmm.sink_count, fmm_task, &task);
+}
+
+/* FUNCTION: free_fmm
+ * --------------------------------------
+ * releases the buffers of the fast multipole engine
+ *
+ * fmm: buffers to free
+ */
+void free_fmm(fmm_t *fmm)
+{
+    free(fmm->locals);
+    free(fmm->radii);
+    free(fmm->sinks);
+    for (int i = 0; i < fmm->threads; i += 1)
+        free(fmm->pairs[i]);
+    free(fmm->pairs);
+    free(fmm->pair_capacity);
+    memset(fmm, 0, sizeof(fmm_t));
+}
@@ -0,0 +1,803 @@
+#include "simulation.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+/* FUNCTION: reserve_interactions
+ * --------------------------------------
+ * makes room for more sources in an interaction list
+ *
+ * list: interaction list to grow
+ * count: number of sources that must fit in the list, padding included
+ */
+void reserve_interactions(interactions_t *list, int count)
+{
+    size_t size;
+    float **arrays[10] = {&list->x, &list->y, &list->z, &list->mass,
+                          &list->quadrupole[XX], &list->quadrupole[XY],
+                          &list->quadrupole[XZ], &list->quadrupole[YY],
+                          &list->quadrupole[YZ], &list->quadrupole[ZZ]};
+    float *array;
+
+    if (count <= list->capacity)
+        return;
+    while (list->capacity < count)
+        list->capacity = list->capacity ? 2 * list->capacity : 1024;
+    size = sizeof(float) * list->capacity;
+    for (int i = 0; i < 10; i += 1) {
+        array = (float *)aligned_alloc(64, size);
+        if (array == NULL)
+            exit(1);
+        if (*arrays[i] != NULL)
+            memcpy(array, *arrays[i], sizeof(float) * list->count);
+        free(*arrays[i]);
+        *arrays[i] = array;
+    }
+}
+
+/* FUNCTION: add_interaction
+ * --------------------------------------
+ * appends a point mass (a body or the gravity center of an accepted node) to
+ * an interaction list
+ *
+ * list: interaction list
+ * position: 3D position of the mass
+ * mass: mass of the source
+ */
+static void add_interaction(interactions_t *list, const float position[3],
+                            float mass)
+{
+    reserve_interactions(list, list->count + INTERACTIONS_ALIGNMENT);
+    list->x[list->count] = position[X];
+    list->y[list->count] = position[Y];
+    list->z[list->count] = position[Z];
+    list->mass[list->count] = mass;
+    list->count += 1;
+}
+
+/* FUNCTION: add_multipole
+ * --------------------------------------
+ * appends the gravity center of an accepted node and its quadrupole moment
+ * to an interaction list
+ *
+ * list: interaction list
+ * node: node of the walk stream
+ * quadrupole: quadrupole moment of the node
+ */
+static void add_multipole(interactions_t *list, const walk_node_t *node,
+                          const float quadrupole[6])
+{
+    reserve_interactions(list, list->count + INTERACTIONS_ALIGNMENT);
+    for (int k = 0; k < 6; k += 1)
+        list->quadrupole[k][list->count] = quadrupole[k];
+    add_interaction(list, node->position, node->weight);
+}
+
+/* FUNCTION: add_bodies
+ * --------------------------------------
+ * appends the bodies of a leaf to an interaction list
+ *
+ * list: interaction list
+ * particles: store of all the bodies
+ * leaf: leaf of the walk stream
+ */
+static void add_bodies(interactions_t *list, particles_t *particles,
+                       const walk_node_t *leaf)
+{
+    reserve_interactions(list, list->count + leaf->count + INTERACTIONS_ALIGNMENT);
+    for (int i = leaf->body; i < leaf->body + leaf->count; i += 1) {
+        list->x[list->count] = particles->x[i];
+        list->y[list->count] = particles->y[i];
+        list->z[list->count] = particles->z[i];
+        list->mass[list->count] = particles->mass[i];
+        list->count += 1;
+    }
+}
+
+/* FUNCTION: pad_interactions
+ * --------------------------------------
+ * pads an interaction list with massless sources up to a multiple of
+ * INTERACTIONS_ALIGNMENT
+ *
+ * list: interaction list
+ */
+void pad_interactions(interactions_t *list)
+{
+    while (list->count % INTERACTIONS_ALIGNMENT) {
+        list->x[list->count] = 0;
+        list->y[list->count] = 0;
+        list->z[list->count] = 0;
+        list->mass[list->count] = 0;
+        for (int k = 0; k < 6; k += 1)
+            list->quadrupole[k][list->count] = 0;
+        list->count += 1;
+    }
+}
+
+/* FUNCTION: get_box_distance
+ * --------------------------------------
+ * computes the squared distance between two boxes, 0 if they overlap
+ *
+ * a: first box, min then max
+ * b: second box, min then max
+ *
+ * returns: the squared distance between the closest points of the boxes
+ */
+static float get_box_distance(const float a[2][3], const float b[2][3])
+{
+    float d2 = 0;
+    float delta;
+
+    for (int axis = 0; axis < 3; axis += 1) {
+        if (b[1][axis] < a[0][axis])
+            delta = a[0][axis] - b[1][axis];
+        else if (b[0][axis] > a[1][axis])
+            delta = b[0][axis] - a[1][axis];
+        else
+            delta = 0;
+        d2 += delta * delta;
+    }
+    return d2;
+}
+
+/* FUNCTION: get_point_distance
+ * --------------------------------------
+ * computes the squared distance between a point and a box, 0 if inside
+ *
+ * box: box, min then max
+ * point: 3D position of the point
+ *
+ * returns: the squared distance between the point and the closest point of
+ * the box
+ */
+static float get_point_distance(const float box[2][3], const float point[3])
+{
+    float point_box[2][3] = {{point[X], point[Y], point[Z]},
+                             {point[X], point[Y], point[Z]}};
+
+    return get_box_distance(box, point_box);
+}
+
+/* FUNCTION: get_action_ratio
+ * --------------------------------------
+ * multipole acceptance criterion: tells if a node is far enough from a group
+ * of bodies to be used as a whole for every body of the group, s being the
+ * width of the node and d the distance from the group:
+ *      *  BH_MAC_BH: s / d < theta, d measured from the node's center of mass
+ *      *  BH_MAC_BOX: s / d < theta, d measured from the bounding box of the
+ *         bodies of the node, which stays safe when the center of mass is
+ *         far from the bodies closest to the group
+ *      *  BH_MAC_RELATIVE: G M / d^2 * (s / d)^2 < alpha |a|, the estimated
+ *         error of the node relative to the smallest acceleration of the
+ *         group at the last step, the group never being inside the node
+ *         (BH_MAC_BH on the first step, when no acceleration is known, and
+ *         for a group whose smallest acceleration was 0, which would open
+ *         every node)
+ * in every case d is measured to the closest point of the group bounding box
+ *
+ * the node spans its cell and the bounding box of its bodies, which may have
+ * left the cell after a refit (see update_octree), s being the largest side
+ * of this span
+ *
+ * forces: force engine holding the criterion and its parameters
+ * box: bounding box of the group, min then max
+ * acceleration: smallest acceleration of the group at the last step
+ * attractor: node of the walk stream to test
+ *
+ * returns: true if the node can be used as a whole for the group
+ */
+static bool get_action_ratio(const forces_t *forces, const float box[2][3],
+                             float acceleration, const walk_node_t *attractor)
+{
+    float s = attractor->size;
+    float d2;
+
+    switch (forces->mac) {
+    case BH_MAC_BOX:
+        d2 = get_box_distance(box, attractor->box);
+        return s * s < forces->theta * forces->theta * d2;
+    case BH_MAC_RELATIVE:
+        if (forces->steps > 0 && acceleration > 0) {
+            if (get_box_distance(box, attractor->box) == 0)
+                return false;
+            d2 = get_point_distance(box, attractor->position);
+            return GRAVITATIONAL_CONSTANT * attractor->weight * s * s
+                   < forces->alpha * acceleration * d2 * d2;
+        }
+        // fall through
+    default:
+        d2 = get_point_distance(box, attractor->position);
+        return s * s < forces->theta * forces->theta * d2;
+    }
+}
+
+/* FUNCTION: add_walk_nodes
+ * --------------------------------------
+ * appends the children of a node and their sub-trees to the walk stream of
+ * the octree, in depth first order
+ *
+ * forces: force engine, its criterion choosing the box of the nodes
+ * tree: octree with its moments computed, its stream large enough
+ * parent: index of a PARENT node
+ */
+static void add_walk_nodes(const forces_t *forces, octree_t *tree, int parent)
+{
+    oct_node_t *child;
+    walk_node_t *node;
+    int index;
+
+    for (int i = 0; i < 8; i += 1) {
+        child = &tree->nodes[tree->nodes[parent].child + i];
+        if (child->type == EMPTY)
+            continue;
+        index = tree->walk_count;
+        tree->walk_count += 1;
+        node = &tree->walk_nodes[index];
+        memcpy(node->position, child->position, sizeof(node->position));
+        node->weight = child->weight;
+        node->size = 0;
+        for (int axis = 0; axis < 3; axis += 1) {
+            node->box[0][axis] = fminf(child->min[axis], child->box[0][axis]);
+            node->box[1][axis] = fmaxf(child->max[axis], child->box[1][axis]);
+            node->size = fmaxf(node->size, node->box[1][axis]
+                                           - node->box[0][axis]);
+        }
+        if (forces->mac == BH_MAC_BOX)
+            memcpy(node->box, child->box, sizeof(node->box));
+        if (tree->expansion == BH_EXPANSION_QUADRUPOLE)
+            memcpy(tree->walk_quadrupoles[index], child->quadrupole,
+                   sizeof(child->quadrupole));
+        node->body = child->type == CHILD ? child->body : -1;
+        node->count = child->type == CHILD ? child->count : 0;
+        if (child->type == PARENT)
+            add_walk_nodes(forces, tree, tree->nodes[parent].child + i);
+        // the stream may have been moved by the children
+        tree->walk_nodes[index].next = tree->walk_count;
+    }
+}
+
+/* FUNCTION: build_walk_nodes
+ * --------------------------------------
+ * builds the walk stream of an octree (see walk_node_t) unless it is up to
+ * date with the moments of its nodes
+ *
+ * forces: force engine
+ * tree: octree with its moments computed
+ */
+static void build_walk_nodes(const forces_t *forces, octree_t *tree)
+{
+    if (tree->walk_count > 0 || tree->count == 0
+        || tree->nodes[0].type == EMPTY)
+        return;
+    if (tree->count > tree->walk_capacity) {
+        free(tree->walk_nodes);
+        free(tree->walk_quadrupoles);
+        tree->walk_capacity = tree->count;
+        tree->walk_nodes = (walk_node_t *)aligned_alloc(
+            _Alignof(walk_node_t), sizeof(walk_node_t) * tree->walk_capacity);
+        tree->walk_quadrupoles = (float (*)[6])malloc(
+            sizeof(float[6]) * tree->walk_capacity);
+        if (tree->walk_nodes == NULL || tree->walk_quadrupoles == NULL)
+            exit(1);
+    }
+    add_walk_nodes(forces, tree, 0);
+}
+
+/* FUNCTION: walk_octree
+ * --------------------------------------
+ * builds the interaction lists of a group of bodies by reading the walk
+ * stream of an octree: the nodes accepted by the opening criterion give
+ * their gravity center (and quadrupole with BH_EXPANSION_QUADRUPOLE), the other
+ * leaves give their bodies and the other parent nodes are opened, the walk
+ * going on with their first child instead of skipping their sub-tree
+ *
+ * forces: force engine
+ * tree: octree with its walk stream built
+ * particles: store of all the bodies
+ * walk: interaction lists to fill
+ * box: bounding box of the group, min then max
+ * acceleration: smallest acceleration of the group at the last step
+ *
+ * returns: the number of nodes tested by the opening criterion
+ */
+static int walk_octree(const forces_t *forces, const octree_t *tree,
+                       particles_t *particles, walk_t *walk,
+                       const float box[2][3], float acceleration)
+{
+    const walk_node_t *attractor;
+    int visited = 0;
+    int i = 0;
+
+    while (i < tree->walk_count) {
+        attractor = &tree->walk_nodes[i];
+        visited += 1;
+        STAT(walk->counters.tests += 1);
+        if (!get_action_ratio(forces, box, acceleration, attractor)) {
+            STAT(walk->counters.rejections += 1);
+            if (attractor->body >= 0) {
+                STAT(walk->counters.leaf_interactions += attractor->count);
+                add_bodies(&walk->masses, particles, attractor);
+            } else {
+                STAT(walk->counters.openings += 1);
+                i += 1;
+                continue;
+            }
+        } else if (forces->expansion == BH_EXPANSION_QUADRUPOLE) {
+            STAT(walk->counters.node_interactions += 1);
+            add_multipole(&walk->multipoles, attractor,
+                          tree->walk_quadrupoles[i]);
+        } else {
+            STAT(walk->counters.node_interactions += 1);
+            add_interaction(&walk->masses, attractor->position,
+                            attractor->weight);
+        }
+        i = attractor->next;
+    }
+    return visited;
+}
+
+/* FUNCTION: add_group
+ * --------------------------------------
+ * appends a leaf to the group list of the octree
+ *
+ * tree: octree owning the list
+ * leaf: index of the CHILD node
+ */
+static void add_group(octree_t *tree, int leaf)
+{
+    if (tree->group_count == tree->group_capacity) {
+        tree->group_capacity = tree->group_capacity ? 2 * tree->group_capacity : 64;
+        tree->groups = (int *)realloc(tree->groups,
+                                      sizeof(int) * tree->group_capacity);
+        if (tree->groups == NULL)
+            exit(1);
+    }
+    tree->groups[tree->group_count] = leaf;
+    tree->group_count += 1;
+}
+
+/* FUNCTION: collect_groups
+ * --------------------------------------
+ * lists the leaves of a sub-tree in depth first order, each leaf being a
+ * group of close bodies sharing the same walk
+ *
+ * tree: octree owning the node
+ * index: index of a PARENT node
+ */
+static void collect_groups(octree_t *tree, int index)
+{
+    int child;
+
+    for (int i = 0; i < 8; i += 1) {
+        child = tree->nodes[index].child + i;
+        if (tree->nodes[child].type == PARENT)
+            collect_groups(tree, child);
+        else if (tree->nodes[child].type == CHILD)
+            add_group(tree, child);
+    }
+}
+
+/* FUNCTION: select_groups
+ * --------------------------------------
+ * keeps the groups holding a body of level forces->active or above (the
+ * bodies ending their block time step), the others keeping the
+ * accelerations of their last computation; the bodies of a kept group all
+ * get their accelerations, which is harmless for the ones in the middle of
+ * their step as they get new ones before their closing kick
+ *
+ * forces: force engine
+ * tree: octree with its groups collected
+ * particles: store of all the bodies
+ *
+ * returns: the number of bodies in the kept groups
+ */
+static int select_groups(const forces_t *forces, octree_t *tree,
+                         particles_t *particles)
+{
+    oct_node_t *node;
+    int count = 0;
+    int bodies = 0;
+
+    for (int i = 0; i < tree->group_count; i += 1) {
+        node = &tree->nodes[tree->groups[i]];
+        for (int j = node->body; j < node->body + node->count; j += 1) {
+            if (forces->active == 0 || particles->level[j] >= forces->active) {
+                tree->groups[count] = tree->groups[i];
+                count += 1;
+                bodies += node->count;
+                break;
+            }
+        }
+    }
+    tree->group_count = count;
+    return bodies;
+}
+
+// a force task works on GROUPS_PER_TASK consecutive groups
+static const int GROUPS_PER_TASK = 16;
+
+typedef struct forces_task_s {
+    forces_t *forces;
+    octree_t *tree;
+    particles_t *particles;
+} forces_task_t;
+
+/* FUNCTION: run_group_forces
+ * --------------------------------------
+ * computes the accelerations of the bodies of a leaf: one walk from the
+ * root builds the interaction lists shared by the bodies, the opening
+ * criterion being tested against their bounding box, then the kernels
+ * evaluate them for every body
+ *
+ * task: forces_task_t of the batch
+ * walk: interaction lists of the thread
+ * leaf: index of the CHILD node
+ */
+static void run_group_forces(forces_task_t *task, walk_t *walk, int leaf)
+{
+    octree_t *tree = task->tree;
+    particles_t *particles = task->particles;
+    oct_node_t *node = &tree->nodes[leaf];
+    const kernel_t *kernel = task->forces->kernel;
+    float eps2 = task->forces->softening * task->forces->softening;
+    float acceleration = INFINITY;
+    int visited;
+
+    // the accelerations of the last step are only read here, before they
+    // are cleared for the kernels, for the bodies of the group
+    if (task->forces->mac == BH_MAC_RELATIVE) {
+        for (int i = node->body; i < node->body + node->count; i += 1)
+            acceleration = fminf(acceleration, sqrtf(
+                particles->ax[i] * particles->ax[i]
+                + particles->ay[i] * particles->ay[i]
+                + particles->az[i] * particles->az[i]));
+    }
+    for (int i = node->body; i < node->body + node->count; i += 1) {
+        particles->ax[i] = 0;
+        particles->ay[i] = 0;
+        particles->az[i] = 0;
+    }
+    walk->masses.count = 0;
+    walk->multipoles.count = 0;
+    visited = walk_octree(task->forces, tree, particles, walk, node->box,
+                          acceleration);
+    if (task->forces->remote != NULL)
+        visited += walk_octree(task->forces, task->forces->remote,
+                               task->forces->remote_bodies, walk, node->box,
+                               acceleration);
+    if (task->forces->costs != NULL)
+        for (int i = node->body; i < node->body + node->count; i += 1)
+            task->forces->costs[i] = walk->masses.count + walk->multipoles.count;
+    walk->visited += (uint64_t)visited * node->count;
+    walk->interactions += (uint64_t)(walk->masses.count
+                                     + walk->multipoles.count) * node->count;
+    STAT(walk->counters.walks += 1);
+    pad_interactions(&walk->masses);
+    kernel->run(&walk->masses, particles, node->body,
+                node->body + node->count, eps2);
+    if (walk->multipoles.count > 0) {
+        pad_interactions(&walk->multipoles);
+        kernel->run_quadrupole(&walk->multipoles, particles, node->body,
+                               node->body + node->count, eps2);
+    }
+}
+
+#ifdef STATS
+/* FUNCTION: get_time
+ * --------------------------------------
+ * returns: a monotonic time in milliseconds
+ */
+static double get_time(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec * 1e-6;
+}
+#endif
+
+/* FUNCTION: run_forces_task
+ * --------------------------------------
+ * computes the accelerations of the bodies of a chunk of consecutive groups
+ *
+ * the tree is only read and each group only writes the accelerations of its
+ * own bodies, so chunks can run concurrently
+ *
+ * data: forces_task_t of the batch
+ * task: index of the chunk
+ * thread: index of the worker running the chunk, selecting its lists
+ */
+static void run_forces_task(void *data, int task, int thread)
+{
+    forces_task_t *forces = (forces_task_t *)data;
+    octree_t *tree = forces->tree;
+    int first = task * GROUPS_PER_TASK;
+    int last = first + GROUPS_PER_TASK;
+    STAT(double start = get_time());
+
+    if (last > tree->group_count)
+        last = tree->group_count;
+    for (int i = first; i < last; i += 1)
+        run_group_forces(forces, &forces->forces->walks[thread],
+                         tree->groups[i]);
+    STAT(forces->forces->walks[thread].counters.busy += get_time() - start);
+}
+
+static const char *MAC_NAMES[] = {
+    [BH_MAC_BH] = "bh",
+    [BH_MAC_BOX] = "box",
+    [BH_MAC_RELATIVE] = "relative",
+};
+
+/* FUNCTION: find_mac
+ * --------------------------------------
+ * gets an opening criterion from its name
+ *
+ * name: name of the criterion
+ * mac: output, the criterion
+ *
+ * returns: false if no criterion has this name
+ */
+bool find_mac(const char *name, bh_mac_et *mac)
+{
+    for (size_t i = 0; i < sizeof(MAC_NAMES) / sizeof(MAC_NAMES[0]); i += 1) {
+        if (!strcmp(MAC_NAMES[i], name)) {
+            *mac = (bh_mac_et)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static const char *EXPANSION_NAMES[] = {
+    [BH_EXPANSION_MONOPOLE] = "monopole",
+    [BH_EXPANSION_QUADRUPOLE] = "quadrupole",
+};
+
+/* FUNCTION: find_expansion
+ * --------------------------------------
+ * gets a multipole expansion from its name
+ *
+ * name: name of the expansion
+ * expansion: output, the expansion
+ *
+ * returns: false if no expansion has this name
+ */
+bool find_expansion(const char *name, bh_expansion_et *expansion)
+{
+    for (size_t i = 0; i < sizeof(EXPANSION_NAMES) / sizeof(EXPANSION_NAMES[0]);
+         i += 1) {
+        if (!strcmp(EXPANSION_NAMES[i], name)) {
+            *expansion = (bh_expansion_et)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static const char *ENGINE_NAMES[] = {
+    [BH_ENGINE_TREE] = "tree",
+    [BH_ENGINE_FMM] = "fmm",
+};
+
+/* FUNCTION: find_engine
+ * --------------------------------------
+ * gets a force engine from its name
+ *
+ * name: name of the engine
+ * engine: output, the engine
+ *
+ * returns: false if no engine has this name
+ */
+bool find_engine(const char *name, bh_engine_et *engine)
+{
+    for (size_t i = 0; i < sizeof(ENGINE_NAMES) / sizeof(ENGINE_NAMES[0]); i += 1) {
+        if (!strcmp(ENGINE_NAMES[i], name)) {
+            *engine = (bh_engine_et)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* FUNCTION: init_forces
+ * --------------------------------------
+ * prepares the force engine
+ *
+ * forces: force engine to initialize
+ * config: parameters of the simulation
+ *
+ * returns: false if the processor cannot run the configured kernel
+ */
+bool init_forces(forces_t *forces, const config_t *config)
+{
+    memset(forces, 0, sizeof(forces_t));
+    forces->kernel = get_kernel(config->kernel);
+    forces->softening = config->softening;
+    forces->mac = config->mac;
+    // (r1 + r2) < theta * d only keeps the nodes of BH_ENGINE_FMM apart for
+    // theta <= 1, larger angles letting a sink accept a source holding it
+    forces->theta = config->engine == BH_ENGINE_FMM ? fminf(config->theta, 1)
+                                                  : config->theta;
+    forces->alpha = config->alpha;
+    forces->expansion = config->expansion;
+    forces->engine = config->engine;
+    return forces->kernel != NULL;
+}
+
+/* FUNCTION: free_interactions
+ * --------------------------------------
+ * releases the arrays of an interaction list
+ *
+ * list: interaction list to free
+ */
+static void free_interactions(interactions_t *list)
+{
+    free(list->x);
+    free(list->y);
+    free(list->z);
+    free(list->mass);
+    for (int k = 0; k < 6; k += 1)
+        free(list->quadrupole[k]);
+}
+
+/* FUNCTION: free_walk
+ * --------------------------------------
+ * releases the interaction lists of a walk
+ *
+ * walk: walk to free
+ */
+void free_walk(walk_t *walk)
+{
+    free_interactions(&walk->masses);
+    free_interactions(&walk->multipoles);
+    memset(walk, 0, sizeof(walk_t));
+}
+
+/* FUNCTION: free_forces
+ * --------------------------------------
+ * releases the interaction lists of the force engine
+ *
+ * forces: force engine to free
+ */
+void free_forces(forces_t *forces)
+{
+    for (int i = 0; i < forces->walk_count; i += 1)
+        free_walk(&forces->walks[i]);
+    free(forces->walks);
+    free_fmm(&forces->fmm);
+    memset(forces, 0, sizeof(forces_t));
+}
+
+/* FUNCTION: run_forces
+ * --------------------------------------
+ * computes the acceleration of every body of the octree, the velocities
+ * and positions are left to the integrator
+ *
+ * with BH_ENGINE_TREE, the groups are split in chunks of consecutive groups
+ * in Morton order, the chunks being spread on the threads of the pool;
+ * BH_ENGINE_FMM runs the fast multipole engine (see run_fmm) on the same
+ * octree and moments
+ *
+ * forces: force engine
+ * tree: octree with its moments computed
+ * particles: store of all the bodies in the universe
+ * pool: threads running the chunks
+ */
+void run_forces(forces_t *forces, octree_t *tree, particles_t *particles,
+                pool_t *pool)
+{
+    forces_task_t task = {forces, tree, particles};
+    walk_t *walks;
+
+    if (forces->walk_count < pool->threads) {
+        walks = (walk_t *)aligned_alloc(_Alignof(walk_t),
+                                        sizeof(walk_t) * pool->threads);
+        if (walks == NULL)
+            exit(1);
+        memset(walks, 0, sizeof(walk_t) * pool->threads);
+        if (forces->walk_count > 0)
+            memcpy(walks, forces->walks, sizeof(walk_t) * forces->walk_count);
+        free(forces->walks);
+        forces->walks = walks;
+        forces->walk_count = pool->threads;
+    }
+    for (int i = 0; i < forces->walk_count; i += 1) {
+        forces->walks[i].interactions = 0;
+        forces->walks[i].visited = 0;
+        memset(&forces->walks[i].counters, 0, sizeof(counters_t));
+    }
+    if (particles->count == 0) {
+        // an empty store has an EMPTY root and no acceleration to compute
+        forces->evaluated = 0;
+    } else if (forces->engine == BH_ENGINE_FMM) {
+        // every acceleration is computed, which is harmless for the bodies
+        // in the middle of their block time step (see select_groups)
+        run_fmm(forces, tree, particles, pool);
+        forces->evaluated = particles->count;
+    } else {
+        build_walk_nodes(forces, tree);
+        if (forces->remote != NULL)
+            build_walk_nodes(forces, forces->remote);
+        tree->group_count = 0;
+        collect_groups(tree, 0);
+        forces->evaluated = select_groups(forces, tree, particles);
+        run_pool(pool, (tree->group_count + GROUPS_PER_TASK - 1)
+                       / GROUPS_PER_TASK, run_forces_task, &task);
+    }
+    forces->interactions = 0;
+    forces->visited = 0;
+    for (int i = 0; i < forces->walk_count; i += 1) {
+        forces->interactions += forces->walks[i].interactions;
+        forces->visited += forces->walks[i].visited;
+    }
+    forces->steps += 1;
+}
+
+/* FUNCTION: get_essential_nodes
+ * --------------------------------------
+ * lists the part of an octree needed by the force walks of the bodies in a
+ * box, as the walk of a group of bodies with this box would: the nodes
+ * accepted for the whole box, and the bodies of the leaves too close to it
+ * (the locally essential tree of another process)
+ *
+ * a node accepted for the box is accepted for every group inside it, the
+ * opening criteria only getting looser as the group box shrinks
+ *
+ * forces: force engine
+ * tree: octree with its moments computed
+ * particles: store of the bodies of the octree
+ * box: bounding box of the bodies of the other process, min then max
+ * acceleration: smallest acceleration of these bodies (BH_MAC_RELATIVE)
+ * walk: output, the nodes and bodies in walk->masses and, with
+ * BH_EXPANSION_QUADRUPOLE, the accepted nodes in walk->multipoles
+ */
+void get_essential_nodes(const forces_t *forces, octree_t *tree,
+                         particles_t *particles, const float box[2][3],
+                         float acceleration, walk_t *walk)
+{
+    walk->masses.count = 0;
+    walk->multipoles.count = 0;
+    build_walk_nodes(forces, tree);
+    walk_octree(forces, tree, particles, walk, box, acceleration);
+}
+
+/* FUNCTION: get_stats
+ * --------------------------------------
+ * merges the counters of the threads for the last force phase and the
+ * depth histogram of the last build in a stats record, all zeros unless
+ * compiled with STATS
+ *
+ * forces: force engine, after run_forces
+ * tree: octree of the last force phase
+ * stats: output, statistics of the step
+ */
+void get_stats(const forces_t *forces, const octree_t *tree, stats_t *stats)
+{
+    const counters_t *counters;
+
+    memset(stats, 0, sizeof(stats_t));
+    stats->threads = forces->walk_count;
+    for (int i = 0; i < forces->walk_count; i += 1) {
+        counters = &forces->walks[i].counters;
+        stats->total.tests += counters->tests;
+        stats->total.openings += counters->openings;
+        stats->total.rejections += counters->rejections;
+        stats->total.leaf_interactions += counters->leaf_interactions;
+        stats->total.node_interactions += counters->node_interactions;
+        stats->total.walks += counters->walks;
+        stats->total.busy += counters->busy;
+        stats->busy_max = fmax(stats->busy_max, counters->busy);
+    }
+    if (forces->walk_count > 0)
+        stats->total.busy /= forces->walk_count;
+    if (stats->total.busy > 0)
+        stats->imbalance = stats->busy_max / stats->total.busy;
+    for (int depth = 0; depth < STATS_DEPTHS; depth += 1) {
+        stats->depths[depth] = tree->depths[depth];
+        if (tree->depths[depth] > 0)
+            stats->depth = depth;
+    }
+}
@@ -0,0 +1,323 @@
+#include "simulation.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/*
+ * an integrator moves the bodies in two passes around the force phase:
+ *      *  begin: before the forces, with the accelerations of the last step
+ *      *  end: after the forces, with the accelerations of the new positions
+ * both are plain loops over the arrays of the particle store, run by chunks
+ * on the thread pool
+ */
+
+// an integration task works on BODIES_PER_TASK consecutive bodies
+static const int BODIES_PER_TASK = 16384;
+
+/* FUNCTION: kick
+ * --------------------------------------
+ * updates the velocities of a range of bodies from their accelerations
+ *
+ * particles: store of all the bodies
+ * first: index of the first body of the range
+ * last: index following the last body of the range
+ * dt: duration of the kick
+ */
+static void kick(particles_t *particles, int first, int last, float dt)
+{
+    float *restrict vx = particles->vx;
+    float *restrict vy = particles->vy;
+    float *restrict vz = particles->vz;
+    const float *restrict ax = particles->ax;
+    const float *restrict ay = particles->ay;
+    const float *restrict az = particles->az;
+
+    for (int i = first; i < last; i += 1) {
+        vx[i] += ax[i] * dt;
+        vy[i] += ay[i] * dt;
+        vz[i] += az[i] * dt;
+    }
+}
+
+/* FUNCTION: drift
+ * --------------------------------------
+ * updates the positions of a range of bodies from their velocities
+ *
+ * particles: store of all the bodies
+ * first: index of the first body of the range
+ * last: index following the last body of the range
+ * dt: duration of the drift
+ */
+static void drift(particles_t *particles, int first, int last, float dt)
+{
+    float *restrict x = particles->x;
+    float *restrict y = particles->y;
+    float *restrict z = particles->z;
+    const float *restrict vx = particles->vx;
+    const float *restrict vy = particles->vy;
+    const float *restrict vz = particles->vz;
+
+    for (int i = first; i < last; i += 1) {
+        x[i] += vx[i] * dt;
+        y[i] += vy[i] * dt;
+        z[i] += vz[i] * dt;
+    }
+}
+
+// leapfrog, kick-drift-kick: v += a dt / 2, x += v dt | forces | v += a dt / 2
+static void leapfrog_begin(particles_t *particles, int first, int last, float dt)
+{
+    kick(particles, first, last, dt / 2);
+    drift(particles, first, last, dt);
+}
+
+static void leapfrog_end(particles_t *particles, int first, int last, float dt)
+{
+    kick(particles, first, last, dt / 2);
+}
+
+// velocity Verlet: x += v dt + a dt^2 / 2, v += a dt / 2 | forces |
+// v += a dt / 2, the velocity update being split around the force phase so
+// that the accelerations of the last step need not be kept
+static void verlet_begin(particles_t *particles, int first, int last, float dt)
+{
+    float *restrict x = particles->x;
+    float *restrict y = particles->y;
+    float *restrict z = particles->z;
+    float *restrict vx = particles->vx;
+    float *restrict vy = particles->vy;
+    float *restrict vz = particles->vz;
+    const float *restrict ax = particles->ax;
+    const float *restrict ay = particles->ay;
+    const float *restrict az = particles->az;
+
+    for (int i = first; i < last; i += 1) {
+        x[i] += vx[i] * dt + ax[i] * (dt * dt / 2);
+        y[i] += vy[i] * dt + ay[i] * (dt * dt / 2);
+        z[i] += vz[i] * dt + az[i] * (dt * dt / 2);
+        vx[i] += ax[i] * (dt / 2);
+        vy[i] += ay[i] * (dt / 2);
+        vz[i] += az[i] * (dt / 2);
+    }
+}
+
+static const integrator_t INTEGRATORS[] = {
+    [BH_INTEGRATOR_LEAPFROG] = {"leapfrog", leapfrog_begin, leapfrog_end},
+    [BH_INTEGRATOR_VERLET] = {"verlet", verlet_begin, leapfrog_end},
+};
+
+/* FUNCTION: get_integrator
+ * --------------------------------------
+ * returns: the integrator of the given kind, NULL for an unknown kind
+ */
+const integrator_t *get_integrator(bh_integrator_et kind)
+{
+    if ((int)kind < BH_INTEGRATOR_LEAPFROG
+        || (size_t)kind >= sizeof(INTEGRATORS) / sizeof(INTEGRATORS[0]))
+        return NULL;
+    return &INTEGRATORS[kind];
+}
+
+/* FUNCTION: find_integrator
+ * --------------------------------------
+ * gets an integrator kind from its name
+ *
+ * name: name of the integrator, as in integrator_t
+ * kind: output, kind of the integrator
+ *
+ * returns: false if no integrator has this name
+ */
+bool find_integrator(const char *name, bh_integrator_et *kind)
+{
+    for (size_t i = 0; i < sizeof(INTEGRATORS) / sizeof(INTEGRATORS[0]); i += 1) {
+        if (!strcmp(INTEGRATORS[i].name, name)) {
+            *kind = (bh_integrator_et)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+typedef struct integrate_task_s {
+    particles_t *particles;
+    integrate_ft pass;              // pass of the integrator to run
+    float dt;                       // time step
+} integrate_task_t;
+
+static void integrate_task(void *data, int task, int thread)
+{
+    integrate_task_t *integrate = (integrate_task_t *)data;
+    int first = task * BODIES_PER_TASK;
+    int last = first + BODIES_PER_TASK;
+
+    (void)thread;
+    if (last > integrate->particles->count)
+        last = integrate->particles->count;
+    integrate->pass(integrate->particles, first, last, integrate->dt);
+}
+
+/* FUNCTION: integrate
+ * --------------------------------------
+ * runs a pass of an integrator on every body
+ *
+ * particles: store of all the bodies
+ * pass: begin or end pass of an integrator_t
+ * dt: time step
+ * pool: threads running the pass
+ */
+void integrate(particles_t *particles, integrate_ft pass, float dt, pool_t *pool)
+{
+    integrate_task_t integrate = {particles, pass, dt};
+
+    run_pool(pool, (particles->count + BODIES_PER_TASK - 1) / BODIES_PER_TASK,
+             integrate_task, &integrate);
+}
+
+/* FUNCTION: drift_bodies
+ * --------------------------------------
+ * moves every body from its velocity, the drift of the block time steps
+ *
+ * particles: store of all the bodies
+ * dt: duration of the drift
+ * pool: threads running the drift
+ */
+void drift_bodies(particles_t *particles, float dt, pool_t *pool)
+{
+    integrate(particles, drift, dt, pool);
+}
+
+/*
+ * block time steps: a body of level l moves by steps of dt / 2^l, a step of
+ * dt being made of 2^(levels - 1) substeps of the finest level; a body
+ * starts and ends its steps on the substeps multiple of its own step, so the
+ * bodies ending their step on a substep are the ones of a level above a
+ * threshold (see get_active_level), all of them on the last substep
+ *
+ * each substep is a kick-drift-kick leapfrog: the bodies starting their step
+ * get the first half kick of their own step, every body drifts by the
+ * substep, and the bodies ending their step get their forces and the second
+ * half kick, then a new level
+ */
+
+typedef struct levels_task_s {
+    particles_t *particles;
+    const config_t *config;         // dt, levels and criterion (assign)
+    float dt;                       // step of level 0 (kick)
+    int active;                     // lowest level of the bodies to update
+} levels_task_t;
+
+static void kick_levels_task(void *data, int task, int thread)
+{
+    levels_task_t *kick = (levels_task_t *)data;
+    particles_t *particles = kick->particles;
+    int first = task * BODIES_PER_TASK;
+    int last = first + BODIES_PER_TASK;
+    float half;
+
+    (void)thread;
+    if (last > particles->count)
+        last = particles->count;
+    for (int i = first; i < last; i += 1) {
+        if (particles->level[i] < kick->active)
+            continue;
+        half = ldexpf(kick->dt, -particles->level[i]) / 2;
+        particles->vx[i] += particles->ax[i] * half;
+        particles->vy[i] += particles->ay[i] * half;
+        particles->vz[i] += particles->az[i] * half;
+    }
+}
+
+/* FUNCTION: kick_levels
+ * --------------------------------------
+ * gives a half kick of their own step to the bodies of a level above a
+ * threshold
+ *
+ * particles: store of all the bodies
+ * dt: step of level 0
+ * active: lowest level of the bodies to kick
+ * pool: threads running the kick
+ */
+void kick_levels(particles_t *particles, float dt, int active, pool_t *pool)
+{
+    levels_task_t kick = {particles, NULL, dt, active};
+
+    run_pool(pool, (particles->count + BODIES_PER_TASK - 1) / BODIES_PER_TASK,
+             kick_levels_task, &kick);
+}
+
+static void assign_levels_task(void *data, int task, int thread)
+{
+    levels_task_t *assign = (levels_task_t *)data;
+    particles_t *particles = assign->particles;
+    const config_t *config = assign->config;
+    int first = task * BODIES_PER_TASK;
+    int last = first + BODIES_PER_TASK;
+    float acceleration;
+    float ratio;
+    int level;
+
+    (void)thread;
+    if (last > particles->count)
+        last = particles->count;
+    for (int i = first; i < last; i += 1) {
+        if (particles->level[i] < assign->active)
+            continue;
+        acceleration = sqrtf(particles->ax[i] * particles->ax[i]
+                             + particles->ay[i] * particles->ay[i]
+                             + particles->az[i] * particles->az[i]);
+        // the smallest level whose step is below the criterion (the finest
+        // one for a null criterion, level 0 for a null acceleration)
+        ratio = ceilf(log2f(config->dt / (config->eta * sqrtf(
+            config->softening / acceleration))));
+        level = ratio > 0 ? (ratio < config->levels - 1 ? (int)ratio
+                                                         : config->levels - 1)
+                          : 0;
+        // a body only moves to a coarser level on a substep multiple of its
+        // new step
+        particles->level[i] = level > assign->active ? level : assign->active;
+    }
+}
+
+/* FUNCTION: assign_levels
+ * --------------------------------------
+ * gives a new time step level to the bodies ending their step, from the
+ * criterion eta * sqrt(softening / |a|) on their new acceleration (the
+ * finest level when the softening is 0)
+ *
+ * particles: store of all the bodies, with their new accelerations
+ * config: parameters of the simulation
+ * active: lowest level of the bodies ending their step, and lowest level
+ * they can get
+ * pool: threads running the assignment
+ */
+void assign_levels(particles_t *particles, const config_t *config, int active,
+                   pool_t *pool)
+{
+    levels_task_t assign = {particles, config, config->dt, active};
+
+    run_pool(pool, (particles->count + BODIES_PER_TASK - 1) / BODIES_PER_TASK,
+             assign_levels_task, &assign);
+}
+
+/* FUNCTION: get_active_level
+ * --------------------------------------
+ * gets the lowest level of the bodies ending their step at the end of a
+ * substep
+ *
+ * substep: number of substeps of the finest level done since the start of
+ * the step, 1 to 2^(levels - 1)
+ * levels: number of levels
+ *
+ * returns: the level, 0 at the end of the step
+ */
+int get_active_level(int substep, int levels)
+{
+    int level = levels - 1;
+
+    while (level > 0 && substep % 2 == 0) {
+        substep /= 2;
+        level -= 1;
+    }
+    return level;
+}
@@ -0,0 +1,438 @@
+#include "simulation.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <immintrin.h>
+
+/*
+ * a kernel adds to the acceleration of a range of target bodies the one due
+ * to all the sources of an interaction list:
+ *
+ *      a_i += G * sum_j m_j * d_ij / r_ij^3
+ *
+ * where d_ij is the vector from the target i to the source j, r_ij^2 =
+ * |d_ij|^2 + eps^2 and eps the softening length, sources at the exact
+ * position of the target (the target itself or a coincident body) being
+ * skipped
+ *
+ * the quadrupole kernels add the term of the traceless quadrupole moment Q_j
+ * of each source (a node) about its center of mass:
+ *
+ *      a_i += G * sum_j 5 / 2 * (d_ij . Q_j d_ij) * d_ij / r_ij^7
+ *                       - Q_j d_ij / r_ij^5
+ *
+ * the list is padded with massless sources up to a multiple of
+ * INTERACTIONS_ALIGNMENT, so the vector kernels have no remainder loop
+ */
+
+/* FUNCTION: kernel_scalar
+ * --------------------------------------
+ * portable kernel, one interaction at a time
+ */
+static void kernel_scalar(const interactions_t *list, particles_t *particles,
+                          int first, int last, float eps2)
+{
+    float dx;
+    float dy;
+    float dz;
+    float r2;
+    float inv_r;
+    float factor;
+    float acceleration[3];
+
+    for (int i = first; i < last; i += 1) {
+        acceleration[X] = 0;
+        acceleration[Y] = 0;
+        acceleration[Z] = 0;
+        for (int j = 0; j < list->count; j += 1) {
+            dx = list->x[j] - particles->x[i];
+            dy = list->y[j] - particles->y[i];
+            dz = list->z[j] - particles->z[i];
+            r2 = dx * dx + dy * dy + dz * dz;
+            if (r2 == 0)
+                continue;
+            inv_r = 1.0f / sqrtf(r2 + eps2);
+            factor = list->mass[j] * inv_r * inv_r * inv_r;
+            acceleration[X] += factor * dx;
+            acceleration[Y] += factor * dy;
+            acceleration[Z] += factor * dz;
+        }
+        particles->ax[i] += GRAVITATIONAL_CONSTANT * acceleration[X];
+        particles->ay[i] += GRAVITATIONAL_CONSTANT * acceleration[Y];
+        particles->az[i] += GRAVITATIONAL_CONSTANT * acceleration[Z];
+    }
+}
+
+/* FUNCTION: kernel_quadrupole_scalar
+ * --------------------------------------
+ * portable quadrupole kernel, one interaction at a time
+ */
+static void kernel_quadrupole_scalar(const interactions_t *list,
+                                     particles_t *particles, int first,
+                                     int last, float eps2)
+{
+    float * const *q = list->quadrupole;
+    float dx;
+    float dy;
+    float dz;
+    float r2;
+    float inv_r;
+    float inv_r2;
+    float inv_r5;
+    float qd[3];
+    float dqd;
+    float factor;
+    float acceleration[3];
+
+    for (int i = first; i < last; i += 1) {
+        acceleration[X] = 0;
+        acceleration[Y] = 0;
+        acceleration[Z] = 0;
+        for (int j = 0; j < list->count; j += 1) {
+            dx = list->x[j] - particles->x[i];
+            dy = list->y[j] - particles->y[i];
+            dz = list->z[j] - particles->z[i];
+            r2 = dx * dx + dy * dy + dz * dz;
+            if (r2 == 0)
+                continue;
+            inv_r = 1.0f / sqrtf(r2 + eps2);
+            inv_r2 = inv_r * inv_r;
+            inv_r5 = inv_r * inv_r2 * inv_r2;
+            qd[X] = q[XX][j] * dx + q[XY][j] * dy + q[XZ][j] * dz;
+            qd[Y] = q[XY][j] * dx + q[YY][j] * dy + q[YZ][j] * dz;
+            qd[Z] = q[XZ][j] * dx + q[YZ][j] * dy + q[ZZ][j] * dz;
+            dqd = dx * qd[X] + dy * qd[Y] + dz * qd[Z];
+            factor = list->mass[j] * inv_r * inv_r2 + 2.5f * dqd * inv_r5 * inv_r2;
+            acceleration[X] += factor * dx - inv_r5 * qd[X];
+            acceleration[Y] += factor * dy - inv_r5 * qd[Y];
+            acceleration[Z] += factor * dz - inv_r5 * qd[Z];
+        }
+        particles->ax[i] += GRAVITATIONAL_CONSTANT * acceleration[X];
+        particles->ay[i] += GRAVITATIONAL_CONSTANT * acceleration[Y];
+        particles->az[i] += GRAVITATIONAL_CONSTANT * acceleration[Z];
+    }
+}
+
+/* FUNCTION: kernel_avx2
+ * --------------------------------------
+ * AVX2 + FMA kernel, 8 interactions at a time, 1 / r from the approximate
+ * reciprocal square root refined with one Newton-Raphson step
+ */
+__attribute__((target("avx2,fma")))
+static void kernel_avx2(const interactions_t *list, particles_t *particles,
+                        int first, int last, float eps2)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 three_halves = _mm256_set1_ps(1.5f);
+    const __m256 softening = _mm256_set1_ps(eps2);
+    __m256 xi, yi, zi, ax, ay, az;
+    __m256 dx, dy, dz, r2, r2s, inv_r, factor, mask;
+    float sum[3][8];
+
+    for (int i = first; i < last; i += 1) {
+        xi = _mm256_set1_ps(particles->x[i]);
+        yi = _mm256_set1_ps(particles->y[i]);
+        zi = _mm256_set1_ps(particles->z[i]);
+        ax = zero;
+        ay = zero;
+        az = zero;
+        for (int j = 0; j < list->count; j += 8) {
+            dx = _mm256_sub_ps(_mm256_load_ps(&list->x[j]), xi);
+            dy = _mm256_sub_ps(_mm256_load_ps(&list->y[j]), yi);
+            dz = _mm256_sub_ps(_mm256_load_ps(&list->z[j]), zi);
+            r2 = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy,
+                                                         _mm256_mul_ps(dz, dz)));
+            mask = _mm256_cmp_ps(r2, zero, _CMP_GT_OQ);
+            r2s = _mm256_add_ps(r2, softening);
+            inv_r = _mm256_rsqrt_ps(r2s);
+            // Newton step: y = y * (3/2 - x / 2 * y * y)
+            inv_r = _mm256_mul_ps(inv_r, _mm256_fnmadd_ps(
+                        _mm256_mul_ps(half, r2s), _mm256_mul_ps(inv_r, inv_r),
+                        three_halves));
+            factor = _mm256_mul_ps(_mm256_load_ps(&list->mass[j]),
+                                   _mm256_mul_ps(inv_r, _mm256_mul_ps(inv_r, inv_r)));
+            factor = _mm256_and_ps(factor, mask);
+            ax = _mm256_fmadd_ps(factor, dx, ax);
+            ay = _mm256_fmadd_ps(factor, dy, ay);
+            az = _mm256_fmadd_ps(factor, dz, az);
+        }
+        _mm256_storeu_ps(sum[X], ax);
+        _mm256_storeu_ps(sum[Y], ay);
+        _mm256_storeu_ps(sum[Z], az);
+        for (int axis = 0; axis < 3; axis += 1)
+            for (int k = 1; k < 8; k += 1)
+                sum[axis][0] += sum[axis][k];
+        particles->ax[i] += GRAVITATIONAL_CONSTANT * sum[X][0];
+        particles->ay[i] += GRAVITATIONAL_CONSTANT * sum[Y][0];
+        particles->az[i] += GRAVITATIONAL_CONSTANT * sum[Z][0];
+    }
+}
+
+/* FUNCTION: kernel_quadrupole_avx2
+ * --------------------------------------
+ * AVX2 + FMA quadrupole kernel, 8 interactions at a time
+ */
+__attribute__((target("avx2,fma")))
+static void kernel_quadrupole_avx2(const interactions_t *list,
+                                   particles_t *particles, int first,
+                                   int last, float eps2)
+{
+    float * const *q = list->quadrupole;
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 three_halves = _mm256_set1_ps(1.5f);
+    const __m256 five_halves = _mm256_set1_ps(2.5f);
+    const __m256 softening = _mm256_set1_ps(eps2);
+    __m256 xi, yi, zi, ax, ay, az;
+    __m256 dx, dy, dz, r2, r2s, inv_r, inv_r2, inv_r5, factor, mask;
+    __m256 qx, qy, qz, qxy, qxz, qyz, dqd;
+    float sum[3][8];
+
+    for (int i = first; i < last; i += 1) {
+        xi = _mm256_set1_ps(particles->x[i]);
+        yi = _mm256_set1_ps(particles->y[i]);
+        zi = _mm256_set1_ps(particles->z[i]);
+        ax = zero;
+        ay = zero;
+        az = zero;
+        for (int j = 0; j < list->count; j += 8) {
+            dx = _mm256_sub_ps(_mm256_load_ps(&list->x[j]), xi);
+            dy = _mm256_sub_ps(_mm256_load_ps(&list->y[j]), yi);
+            dz = _mm256_sub_ps(_mm256_load_ps(&list->z[j]), zi);
+            r2 = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy,
+                                                         _mm256_mul_ps(dz, dz)));
+            mask = _mm256_cmp_ps(r2, zero, _CMP_GT_OQ);
+            r2s = _mm256_add_ps(r2, softening);
+            inv_r = _mm256_rsqrt_ps(r2s);
+            // Newton step: y = y * (3/2 - x / 2 * y * y)
+            inv_r = _mm256_mul_ps(inv_r, _mm256_fnmadd_ps(
+                        _mm256_mul_ps(half, r2s), _mm256_mul_ps(inv_r, inv_r),
+                        three_halves));
+            inv_r = _mm256_and_ps(inv_r, mask);
+            inv_r2 = _mm256_mul_ps(inv_r, inv_r);
+            inv_r5 = _mm256_mul_ps(inv_r, _mm256_mul_ps(inv_r2, inv_r2));
+            qxy = _mm256_load_ps(&q[XY][j]);
+            qxz = _mm256_load_ps(&q[XZ][j]);
+            qyz = _mm256_load_ps(&q[YZ][j]);
+            qx = _mm256_fmadd_ps(_mm256_load_ps(&q[XX][j]), dx,
+                                 _mm256_fmadd_ps(qxy, dy, _mm256_mul_ps(qxz, dz)));
+            qy = _mm256_fmadd_ps(qxy, dx, _mm256_fmadd_ps(
+                                     _mm256_load_ps(&q[YY][j]), dy,
+                                     _mm256_mul_ps(qyz, dz)));
+            qz = _mm256_fmadd_ps(qxz, dx, _mm256_fmadd_ps(
+                                     qyz, dy, _mm256_mul_ps(
+                                         _mm256_load_ps(&q[ZZ][j]), dz)));
+            dqd = _mm256_fmadd_ps(dx, qx, _mm256_fmadd_ps(dy, qy,
+                                                          _mm256_mul_ps(dz, qz)));
+            factor = _mm256_fmadd_ps(_mm256_load_ps(&list->mass[j]),
+                                     _mm256_mul_ps(inv_r, inv_r2),
+                                     _mm256_mul_ps(_mm256_mul_ps(five_halves, dqd),
+                                                   _mm256_mul_ps(inv_r5, inv_r2)));
+            ax = _mm256_fmadd_ps(factor, dx, _mm256_fnmadd_ps(inv_r5, qx, ax));
+            ay = _mm256_fmadd_ps(factor, dy, _mm256_fnmadd_ps(inv_r5, qy, ay));
+            az = _mm256_fmadd_ps(factor, dz, _mm256_fnmadd_ps(inv_r5, qz, az));
+        }
+        _mm256_storeu_ps(sum[X], ax);
+        _mm256_storeu_ps(sum[Y], ay);
+        _mm256_storeu_ps(sum[Z], az);
+        for (int axis = 0; axis < 3; axis += 1)
+            for (int k = 1; k < 8; k += 1)
+                sum[axis][0] += sum[axis][k];
+        particles->ax[i] += GRAVITATIONAL_CONSTANT * sum[X][0];
+        particles->ay[i] += GRAVITATIONAL_CONSTANT * sum[Y][0];
+        particles->az[i] += GRAVITATIONAL_CONSTANT * sum[Z][0];
+    }
+}
+
+/* FUNCTION: kernel_avx512
+ * --------------------------------------
+ * AVX-512 kernel, 16 interactions at a time, 1 / r from the approximate
+ * reciprocal square root refined with one Newton-Raphson step
+ */
+__attribute__((target("avx512f")))
+static void kernel_avx512(const interactions_t *list, particles_t *particles,
+                          int first, int last, float eps2)
+{
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 half = _mm512_set1_ps(0.5f);
+    const __m512 three_halves = _mm512_set1_ps(1.5f);
+    const __m512 softening = _mm512_set1_ps(eps2);
+    __m512 xi, yi, zi, ax, ay, az;
+    __m512 dx, dy, dz, r2, r2s, inv_r, factor;
+    __mmask16 mask;
+
+    for (int i = first; i < last; i += 1) {
+        xi = _mm512_set1_ps(particles->x[i]);
+        yi = _mm512_set1_ps(particles->y[i]);
+        zi = _mm512_set1_ps(particles->z[i]);
+        ax = zero;
+        ay = zero;
+        az = zero;
+        for (int j = 0; j < list->count; j += 16) {
+            dx = _mm512_sub_ps(_mm512_load_ps(&list->x[j]), xi);
+            dy = _mm512_sub_ps(_mm512_load_ps(&list->y[j]), yi);
+            dz = _mm512_sub_ps(_mm512_load_ps(&list->z[j]), zi);
+            r2 = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy,
+                                                         _mm512_mul_ps(dz, dz)));
+            mask = _mm512_cmp_ps_mask(r2, zero, _CMP_GT_OQ);
+            r2s = _mm512_add_ps(r2, softening);
+            inv_r = _mm512_rsqrt14_ps(r2s);
+            // Newton step: y = y * (3/2 - x / 2 * y * y)
+            inv_r = _mm512_mul_ps(inv_r, _mm512_fnmadd_ps(
+                        _mm512_mul_ps(half, r2s), _mm512_mul_ps(inv_r, inv_r),
+                        three_halves));
+            factor = _mm512_maskz_mul_ps(mask, _mm512_load_ps(&list->mass[j]),
+                                         _mm512_mul_ps(inv_r,
+                                                       _mm512_mul_ps(inv_r, inv_r)));
+            ax = _mm512_fmadd_ps(factor, dx, ax);
+            ay = _mm512_fmadd_ps(factor, dy, ay);
+            az = _mm512_fmadd_ps(factor, dz, az);
+        }
+        particles->ax[i] += GRAVITATIONAL_CONSTANT * _mm512_reduce_add_ps(ax);
+        particles->ay[i] += GRAVITATIONAL_CONSTANT * _mm512_reduce_add_ps(ay);
+        particles->az[i] += GRAVITATIONAL_CONSTANT * _mm512_reduce_add_ps(az);
+    }
+}
+
+/* FUNCTION: kernel_quadrupole_avx512
+ * --------------------------------------
+ * AVX-512 quadrupole kernel, 16 interactions at a time
+ */
+__attribute__((target("avx512f")))
+static void kernel_quadrupole_avx512(const interactions_t *list,
+                                     particles_t *particles, int first,
+                                     int last, float eps2)
+{
+    float * const *q = list->quadrupole;
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 half = _mm512_set1_ps(0.5f);
+    const __m512 three_halves = _mm512_set1_ps(1.5f);
+    const __m512 five_halves = _mm512_set1_ps(2.5f);
+    const __m512 softening = _mm512_set1_ps(eps2);
+    __m512 xi, yi, zi, ax, ay, az;
+    __m512 dx, dy, dz, r2, r2s, inv_r, inv_r2, inv_r5, factor;
+    __m512 qx, qy, qz, qxy, qxz, qyz, dqd;
+    __mmask16 mask;
+
+    for (int i = first; i < last; i += 1) {
+        xi = _mm512_set1_ps(particles->x[i]);
+        yi = _mm512_set1_ps(particles->y[i]);
+        zi = _mm512_set1_ps(particles->z[i]);
+        ax = zero;
+        ay = zero;
+        az = zero;
+        for (int j = 0; j < list->count; j += 16) {
+            dx = _mm512_sub_ps(_mm512_load_ps(&list->x[j]), xi);
+            dy = _mm512_sub_ps(_mm512_load_ps(&list->y[j]), yi);
+            dz = _mm512_sub_ps(_mm512_load_ps(&list->z[j]), zi);
+            r2 = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy,
+                                                         _mm512_mul_ps(dz, dz)));
+            mask = _mm512_cmp_ps_mask(r2, zero, _CMP_GT_OQ);
+            r2s = _mm512_add_ps(r2, softening);
+            inv_r = _mm512_rsqrt14_ps(r2s);
+            // Newton step: y = y * (3/2 - x / 2 * y * y)
+            inv_r = _mm512_maskz_mul_ps(mask, inv_r, _mm512_fnmadd_ps(
+                        _mm512_mul_ps(half, r2s), _mm512_mul_ps(inv_r, inv_r),
+                        three_halves));
+            inv_r2 = _mm512_mul_ps(inv_r, inv_r);
+            inv_r5 = _mm512_mul_ps(inv_r, _mm512_mul_ps(inv_r2, inv_r2));
+            qxy = _mm512_load_ps(&q[XY][j]);
+            qxz = _mm512_load_ps(&q[XZ][j]);
+            qyz = _mm512_load_ps(&q[YZ][j]);
+            qx = _mm512_fmadd_ps(_mm512_load_ps(&q[XX][j]), dx,
+                                 _mm512_fmadd_ps(qxy, dy, _mm512_mul_ps(qxz, dz)));
+            qy = _mm512_fmadd_ps(qxy, dx, _mm512_fmadd_ps(
+                                     _mm512_load_ps(&q[YY][j]), dy,
+                                     _mm512_mul_ps(qyz, dz)));
+            qz = _mm512_fmadd_ps(qxz, dx, _mm512_fmadd_ps(
+                                     qyz, dy, _mm512_mul_ps(
+                                         _mm512_load_ps(&q[ZZ][j]), dz)));
+            dqd = _mm512_fmadd_ps(dx, qx, _mm512_fmadd_ps(dy, qy,
+                                                          _mm512_mul_ps(dz, qz)));
+            factor = _mm512_fmadd_ps(_mm512_load_ps(&list->mass[j]),
+                                     _mm512_mul_ps(inv_r, inv_r2),
+                                     _mm512_mul_ps(_mm512_mul_ps(five_halves, dqd),
+                                                   _mm512_mul_ps(inv_r5, inv_r2)));
+            ax = _mm512_fmadd_ps(factor, dx, _mm512_fnmadd_ps(inv_r5, qx, ax));
+            ay = _mm512_fmadd_ps(factor, dy, _mm512_fnmadd_ps(inv_r5, qy, ay));
+            az = _mm512_fmadd_ps(factor, dz, _mm512_fnmadd_ps(inv_r5, qz, az));
+        }
+        particles->ax[i] += GRAVITATIONAL_CONSTANT * _mm512_reduce_add_ps(ax);
+        particles->ay[i] += GRAVITATIONAL_CONSTANT * _mm512_reduce_add_ps(ay);
+        particles->az[i] += GRAVITATIONAL_CONSTANT * _mm512_reduce_add_ps(az);
+    }
+}
+
+static const kernel_t KERNELS[] = {
+    [BH_KERNEL_SCALAR] = {"scalar", kernel_scalar, kernel_quadrupole_scalar},
+    [BH_KERNEL_AVX2] = {"avx2", kernel_avx2, kernel_quadrupole_avx2},
+    [BH_KERNEL_AVX512] = {"avx512", kernel_avx512, kernel_quadrupole_avx512},
+};
+
+/* FUNCTION: kernel_supported
+ * --------------------------------------
+ * checks with CPUID if the processor can run a kernel
+ *
+ * kind: kernel to check
+ *
+ * returns: true if the kernel can run, false for an unknown kind
+ */
+static bool kernel_supported(bh_kernel_et kind)
+{
+    if ((int)kind < BH_KERNEL_SCALAR
+        || (size_t)kind >= sizeof(KERNELS) / sizeof(KERNELS[0]))
+        return false;
+    __builtin_cpu_init();
+    if (kind == BH_KERNEL_AVX512)
+        return __builtin_cpu_supports("avx512f");
+    if (kind == BH_KERNEL_AVX2)
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return true;
+}
+
+/* FUNCTION: get_kernel
+ * --------------------------------------
+ * gets a kernel, BH_KERNEL_AUTO picking the widest one the processor supports
+ *
+ * kind: kernel to get
+ *
+ * returns: the kernel, NULL if the processor cannot run it or if the kind
+ * is unknown
+ */
+const kernel_t *get_kernel(bh_kernel_et kind)
+{
+    if (kind == BH_KERNEL_AUTO) {
+        for (kind = BH_KERNEL_AVX512; kind > BH_KERNEL_SCALAR; kind -= 1)
+            if (kernel_supported(kind))
+                break;
+    }
+    if (!kernel_supported(kind))
+        return NULL;
+    return &KERNELS[kind];
+}
+
+/* FUNCTION: find_kernel
+ * --------------------------------------
+ * gets a kernel kind from its name, "auto" giving BH_KERNEL_AUTO
+ *
+ * name: name of the kernel, as in kernel_t
+ * kind: output, kind of the kernel
+ *
+ * returns: false if no kernel has this name
+ */
+bool find_kernel(const char *name, bh_kernel_et *kind)
+{
+    if (!strcmp(name, "auto")) {
+        *kind = BH_KERNEL_AUTO;
+        return true;
+    }
+    for (size_t i = 0; i < sizeof(KERNELS) / sizeof(KERNELS[0]); i += 1) {
+        if (!strcmp(KERNELS[i].name, name)) {
+            *kind = (bh_kernel_et)i;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,263 @@
+#include "simulation.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// number of bits of each radix sort pass
+static const int RADIX_BITS = 8;
+static const int RADIX_SIZE = 1 << 8;
+
+/* FUNCTION: spread_bits
+ * --------------------------------------
+ * inserts two zero bits between each of the 21 low bits of a value
+ *
+ * value: value to spread
+ *
+ * returns: the spread value, bit k of value being bit 3k of the result
+ */
+static uint64_t spread_bits(uint64_t value)
+{
+    value &= 0x1fffff;
+    value = (value | value << 32) & 0x1f00000000ffffULL;
+    value = (value | value << 16) & 0x1f0000ff0000ffULL;
+    value = (value | value << 8) & 0x100f00f00f00f00fULL;
+    value = (value | value << 4) & 0x10c30c30c30c30c3ULL;
+    value = (value | value << 2) & 0x1249249249249249ULL;
+    return value;
+}
+
+/* FUNCTION: get_cell
+ * --------------------------------------
+ * gets the coordinate of a position on the grid of the deepest octree level
+ *
+ * position: coordinate of the body on one axis
+ * min: minimum of the root cube on this axis
+ * scale: number of deepest cells per unit of length
+ *
+ * returns: the cell coordinate, clamped to the root cube
+ */
+static uint64_t get_cell(float position, float min, float scale)
+{
+    float cell = (position - min) * scale;
+
+    if (!(cell > 0))
+        return 0;
+    if (cell >= (float)(1 << MORTON_LEVELS))
+        return (1 << MORTON_LEVELS) - 1;
+    return (uint64_t)cell;
+}
+
+/* FUNCTION: compute_morton_keys
+ * --------------------------------------
+ * computes the 63-bit Morton key (Z-order) of a range of bodies
+ *
+ * the bits of the key read 3 by 3 from the top give the sub-cube of the body
+ * at each level of the octree (see get_body_interval for the sub-cube order)
+ *
+ * particles: store of all the bodies
+ * min: minimum of the root cube
+ * size: width of the root cube
+ * keys: output, one key per body
+ * first: index of the first body of the range
+ * last: index following the last body of the range
+ */
+void compute_morton_keys(particles_t *particles, const float min[3],
+                         float size, uint64_t *keys, int first, int last)
+{
+    float scale = (float)(1 << MORTON_LEVELS) / size;
+
+    for (int i = first; i < last; i += 1) {
+        keys[i] = spread_bits(get_cell(particles->x[i], min[X], scale))
+                | spread_bits(get_cell(particles->y[i], min[Y], scale)) << 1
+                | spread_bits(get_cell(particles->z[i], min[Z], scale)) << 2;
+    }
+}
+
+/* FUNCTION: sort_morton_keys
+ * --------------------------------------
+ * sorts keys on their low bits with a least significant digit radix sort,
+ * moving the body indexes along with them
+ *
+ * keys: keys to sort, sorted in place
+ * order: body index of each key, moved in place along with the keys
+ * keys_tmp: scratch buffer of n keys
+ * order_tmp: scratch buffer of n indexes
+ * n: number of keys
+ * bits: number of low bits to sort on, the higher bits must be equal
+ */
+void sort_morton_keys(uint64_t *keys, int *order, uint64_t *keys_tmp,
+                      int *order_tmp, int n, int bits)
+{
+    int passes = (bits + RADIX_BITS - 1) / RADIX_BITS;
+    int histogram[passes > 0 ? passes : 1][RADIX_SIZE];
+    uint64_t *src_keys = keys;
+    int *src_order = order;
+    uint64_t *swap_keys;
+    int *swap_order;
+    int offset;
+    int digit;
+
+    memset(histogram, 0, sizeof(histogram));
+    // all the histograms are gathered in a single pass over the keys
+    for (int i = 0; i < n; i += 1)
+        for (int pass = 0; pass < passes; pass += 1)
+            histogram[pass][(keys[i] >> (pass * RADIX_BITS)) & (RADIX_SIZE - 1)] += 1;
+    for (int pass = 0; pass < passes; pass += 1) {
+        // a pass where every key has the same digit would not move anything
+        if (n == 0 || histogram[pass][(src_keys[0] >> (pass * RADIX_BITS))
+                                      & (RADIX_SIZE - 1)] == n)
+            continue;
+        offset = 0;
+        for (int i = 0; i < RADIX_SIZE; i += 1) {
+            digit = histogram[pass][i];
+            histogram[pass][i] = offset;
+            offset += digit;
+        }
+        for (int i = 0; i < n; i += 1) {
+            digit = (src_keys[i] >> (pass * RADIX_BITS)) & (RADIX_SIZE - 1);
+            keys_tmp[histogram[pass][digit]] = src_keys[i];
+            order_tmp[histogram[pass][digit]] = src_order[i];
+            histogram[pass][digit] += 1;
+        }
+        swap_keys = src_keys;
+        src_keys = keys_tmp;
+        keys_tmp = swap_keys;
+        swap_order = src_order;
+        src_order = order_tmp;
+        order_tmp = swap_order;
+    }
+    if (src_keys != keys) {
+        memcpy(keys, src_keys, sizeof(uint64_t) * n);
+        memcpy(order, src_order, sizeof(int) * n);
+    }
+}
+
+/*
+ * parallel sort of the bodies, in 4 batches of tasks:
+ *      *  keys: computes the keys of a chunk of bodies
+ *      *  histogram: counts the keys of a chunk in each bucket, a bucket
+ *         being a sub-tree at depth SPLIT_LEVEL (the top bits of the key)
+ *      *  scatter: moves the keys of a chunk to their bucket
+ *      *  bucket: radix sorts a bucket on the bits left
+ */
+
+// a chunk task works on BODIES_PER_TASK consecutive bodies
+static const int BODIES_PER_TASK = 16384;
+
+typedef struct sort_task_s {
+    octree_t *tree;
+    particles_t *particles;
+    int *counts;                    // bucket counts of each chunk, then
+                                    // the next free slot of each chunk
+    int n;                          // number of bodies
+} sort_task_t;
+
+static int get_bucket(uint64_t key)
+{
+    return (int)(key >> (3 * (MORTON_LEVELS - SPLIT_LEVEL)));
+}
+
+static void keys_task(void *data, int task, int thread)
+{
+    sort_task_t *sort = (sort_task_t *)data;
+    oct_node_t *root = &sort->tree->nodes[0];
+    int first = task * BODIES_PER_TASK;
+    int last = first + BODIES_PER_TASK < sort->n ? first + BODIES_PER_TASK : sort->n;
+
+    (void)thread;
+    compute_morton_keys(sort->particles, root->min, root->max[X] - root->min[X],
+                        sort->tree->keys, first, last);
+}
+
+static void histogram_task(void *data, int task, int thread)
+{
+    sort_task_t *sort = (sort_task_t *)data;
+    int *count = &sort->counts[task * SPLIT_BUCKETS];
+    int first = task * BODIES_PER_TASK;
+    int last = first + BODIES_PER_TASK < sort->n ? first + BODIES_PER_TASK : sort->n;
+
+    (void)thread;
+    for (int i = first; i < last; i += 1)
+        count[get_bucket(sort->tree->keys[i])] += 1;
+}
+
+static void scatter_task(void *data, int task, int thread)
+{
+    sort_task_t *sort = (sort_task_t *)data;
+    octree_t *tree = sort->tree;
+    int *next = &sort->counts[task * SPLIT_BUCKETS];
+    int first = task * BODIES_PER_TASK;
+    int last = first + BODIES_PER_TASK < sort->n ? first + BODIES_PER_TASK : sort->n;
+    int bucket;
+
+    (void)thread;
+    for (int i = first; i < last; i += 1) {
+        bucket = get_bucket(tree->keys[i]);
+        tree->keys_tmp[next[bucket]] = tree->keys[i];
+        tree->order_tmp[next[bucket]] = i;
+        next[bucket] += 1;
+    }
+}
+
+static void bucket_task(void *data, int task, int thread)
+{
+    sort_task_t *sort = (sort_task_t *)data;
+    octree_t *tree = sort->tree;
+    int first = tree->buckets[task];
+    int n = tree->buckets[task + 1] - first;
+
+    (void)thread;
+    sort_morton_keys(tree->keys + first, tree->order + first,
+                     tree->keys_tmp + first, tree->order_tmp + first, n,
+                     3 * (MORTON_LEVELS - SPLIT_LEVEL));
+}
+
+/* FUNCTION: sort_bodies
+ * --------------------------------------
+ * sorts the bodies along the Z-order curve on the threads of the pool
+ *
+ * on return tree->keys holds the sorted keys, tree->order the permutation
+ * that sorts the bodies, tree->buckets the first body of each sub-tree at
+ * depth SPLIT_LEVEL, and the bodies of the store are reordered
+ *
+ * tree: octree with an initialized root cube and large enough key buffers
+ * particles: store of all the bodies in the universe
+ * pool: threads running the tasks
+ */
+void sort_bodies(octree_t *tree, particles_t *particles, pool_t *pool)
+{
+    int chunks = (particles->count + BODIES_PER_TASK - 1) / BODIES_PER_TASK;
+    sort_task_t sort = {tree, particles, NULL, particles->count};
+    uint64_t *swap_keys;
+    int *swap_order;
+    int offset = 0;
+    int count;
+
+    sort.counts = (int *)calloc((size_t)(chunks > 0 ? chunks : 1) * SPLIT_BUCKETS,
+                                sizeof(int));
+    if (sort.counts == NULL)
+        exit(1);
+    run_pool(pool, chunks, keys_task, &sort);
+    run_pool(pool, chunks, histogram_task, &sort);
+    // bucket by bucket, each chunk scatters after the previous chunks
+    for (int bucket = 0; bucket < SPLIT_BUCKETS; bucket += 1) {
+        tree->buckets[bucket] = offset;
+        for (int chunk = 0; chunk < chunks; chunk += 1) {
+            count = sort.counts[chunk * SPLIT_BUCKETS + bucket];
+            sort.counts[chunk * SPLIT_BUCKETS + bucket] = offset;
+            offset += count;
+        }
+    }
+    tree->buckets[SPLIT_BUCKETS] = offset;
+    run_pool(pool, chunks, scatter_task, &sort);
+    swap_keys = tree->keys;
+    tree->keys = tree->keys_tmp;
+    tree->keys_tmp = swap_keys;
+    swap_order = tree->order;
+    tree->order = tree->order_tmp;
+    tree->order_tmp = swap_order;
+    run_pool(pool, SPLIT_BUCKETS, bucket_task, &sort);
+    free(sort.counts);
+    permute_particles(particles, tree->order, pool);
+}
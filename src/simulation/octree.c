@@ -1,29 +1,32 @@
 #include "simulation.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <math.h>
+#include <float.h>
 
 
 /* FUNCTION: body_in_range
  * --------------------------------
  * checks if the given body is in the 3D range min -> max
  *
- * body: body to check if in range
+ * body: 3D position of the body to check if in range
  * min: minimum of the 3D interval
  * max: maximum of the 3D interval
  *
  * returns: true if body is in range
  */
-static bool body_in_range(body_t *body, float min_x, float max_x,
-                                        float min_y, float max_y,
-                                        float min_z, float max_z)
+static bool body_in_range(const float body[3], float min_x, float max_x,
+                                               float min_y, float max_y,
+                                               float min_z, float max_z)
 {
     bool res;
 
-    res = body->x >= min_x && body->x <= max_x;
-    res = res && body->y >= min_y && body->y <= max_y;
-    res = res && body->z >= min_z && body->z <= max_z;
+    res = body[X] >= min_x && body[X] <= max_x;
+    res = res && body[Y] >= min_y && body[Y] <= max_y;
+    res = res && body[Z] >= min_z && body[Z] <= max_z;
     return res;
 }
 
@@ -41,13 +44,13 @@ static bool body_in_range(body_t *body, float min_x, float max_x,
  *      * TNW : Top-North-West
  *      * TNE : Top-North-East
  *
- * body: body to check if in range
+ * body: 3D position of the body to check if in range
  * min: minimum of the 3D interval
  * max: maximum of the 3D interval
  *
  * returns: the position of the body in the current 3D-cube
  */
-static int get_body_interval(body_t *body, float min[3], float max[3])
+static int get_body_interval(const float body[3], float min[3], float max[3])
 {
     if (body_in_range(body, min[X], min[X] + (max[X] - min[X]) / 2,
                             min[Y], min[Y] + (max[Y] - min[Y]) / 2,
@@ -85,281 +88,910 @@ static int get_body_interval(body_t *body, float min[3], float max[3])
     return -1;
 }
 
-/* FUNCTION: move_to_parent_node
+/* FUNCTION: alloc_key_buffers
+ * --------------------------------------
+ * (re)allocates the buffers of the builds, sized from the number of bodies
+ *
+ * tree: octree owning the buffers
+ * n: number of bodies the buffers must hold
+ */
+static void alloc_key_buffers(octree_t *tree, int n)
+{
+    size_t size = n > 0 ? n : 1;
+
+    free(tree->keys);
+    free(tree->keys_tmp);
+    free(tree->order);
+    free(tree->order_tmp);
+    free(tree->links);
+    tree->keys = (uint64_t *)malloc(sizeof(uint64_t) * size);
+    tree->keys_tmp = (uint64_t *)malloc(sizeof(uint64_t) * size);
+    tree->order = (int *)malloc(sizeof(int) * size);
+    tree->order_tmp = (int *)malloc(sizeof(int) * size);
+    tree->links = (int *)malloc(sizeof(int) * size);
+    if (!tree->keys || !tree->keys_tmp || !tree->order || !tree->order_tmp
+        || !tree->links)
+        exit(1);
+    tree->key_capacity = n;
+}
+
+/* FUNCTION: init_octree
+ * --------------------------------------
+ * allocates the node arena of an octree once for the whole simulation
+ *
+ * the arena is sized from the number of bodies so that it rarely has to grow,
+ * nodes are addressed by their index so growing it never breaks the tree
+ *
+ * the octree is built with BH_BUILD_MORTON unless tree->build is changed
+ *
+ * tree: octree to initialize
+ * n: number of bodies that will be inserted in the octree
+ * bucket_size: maximum number of bodies in a leaf (except at the deepest
+ * level, where bodies that cannot be split any further share a leaf)
+ */
+void init_octree(octree_t *tree, int n, int bucket_size)
+{
+    memset(tree, 0, sizeof(octree_t));
+    tree->capacity = 8 * (n / (bucket_size > 0 ? bucket_size : 1) + 1) + 1;
+    tree->nodes = (oct_node_t *)malloc(sizeof(oct_node_t) * tree->capacity);
+    if (tree->nodes == NULL)
+        exit(1);
+    tree->build = BH_BUILD_MORTON;
+    tree->bucket_size = bucket_size > 0 ? bucket_size : 1;
+    alloc_key_buffers(tree, n);
+}
+
+/* FUNCTION: reset_octree
+ * --------------------------------------
+ * empties the octree in O(1) so that its arena can be reused by the next step
+ *
+ * tree: octree to reset
+ */
+void reset_octree(octree_t *tree)
+{
+    tree->count = 0;
+    tree->walk_count = 0;
+}
+
+/* FUNCTION: free_octree
+ * --------------------------------------
+ * releases the node arena of an octree
+ *
+ * tree: octree to free
+ */
+void free_octree(octree_t *tree)
+{
+    free(tree->nodes);
+    free(tree->keys);
+    free(tree->keys_tmp);
+    free(tree->order);
+    free(tree->order_tmp);
+    free(tree->links);
+    free(tree->groups);
+    free(tree->walk_nodes);
+    free(tree->walk_quadrupoles);
+    for (int i = 0; i < tree->arena_count; i += 1)
+        free(tree->arenas[i].nodes);
+    free(tree->arenas);
+    memset(tree, 0, sizeof(octree_t));
+}
+
+/* FUNCTION: alloc_children
  * --------------------------------------
- * creates a parent node in tree->child[position] and
- * copies the initial content (type CHILD) to one of
- * the new parent children in the good sub-cube
+ * takes 8 contiguous EMPTY nodes from the arena and gives them to a parent,
+ * the i-th node being the sub-cube i of the parent (see get_body_interval)
  *
- * tree: parent node where tree->child[position] will
- * be moved to parent-type node
+ * the arena may be moved by this call, so pointers on its nodes must be
+ * fetched again afterwards
  *
- * position: position of the child to transform to parent node
+ * tree: octree owning the arena
+ * parent: index of the node receiving the children
+ *
+ * returns: the index of the first child
  */
-static void move_to_parent_node(oct_node_t *tree, int position)
+static int alloc_children(octree_t *tree, int parent)
 {
-    oct_node_t *save = tree->child[position];
-    int new_pos;
-
-    tree->child[position] = NULL;
-    tree->child[position] = (oct_node_t *)calloc(sizeof(oct_node_t), 1);
-    tree->child[position]->type = PARENT;
-    switch (position) {
-        case BSW:
-            tree->child[position]->min[X] = tree->min[X];
-            tree->child[position]->min[Y] = tree->min[Y];
-            tree->child[position]->min[Z] = tree->min[Z];
-            tree->child[position]->max[X] = tree->min[X] + (tree->max[X] - tree->min[X]) / 2;
-            tree->child[position]->max[Y] = tree->min[Y] + (tree->max[Y] - tree->min[Y]) / 2;
-            tree->child[position]->max[Z] = tree->min[Z] + (tree->max[Z] - tree->min[Z]) / 2;
-            break;
-        case BSE:
-            tree->child[position]->min[X] = tree->min[X] + (tree->max[X] - tree->min[X]) / 2;
-            tree->child[position]->min[Y] = tree->min[Y];
-            tree->child[position]->min[Z] = tree->min[Z];
-            tree->child[position]->max[X] = tree->max[X];
-            tree->child[position]->max[Y] = tree->min[Y] + (tree->max[Y] - tree->min[Y]) / 2;
-            tree->child[position]->max[Z] = tree->min[Z] + (tree->max[Z] - tree->min[Z]) / 2;
-            break;
-        case BNW:
-            tree->child[position]->min[X] = tree->min[X];
-            tree->child[position]->min[Y] = tree->min[Y] + (tree->max[Y] - tree->min[Y]) / 2;
-            tree->child[position]->min[Z] = tree->min[Z];
-            tree->child[position]->max[X] = tree->min[X] + (tree->max[X] - tree->min[X]) / 2;
-            tree->child[position]->max[Y] = tree->max[Y];
-            tree->child[position]->max[Z] = tree->min[Z] + (tree->max[Z] - tree->min[Z]) / 2;
-            break;
-        case BNE:
-            tree->child[position]->min[X] = tree->min[X] + (tree->max[X] - tree->min[X]) / 2;
-            tree->child[position]->min[Y] = tree->min[Y] + (tree->max[Y] - tree->min[Y]) / 2;
-            tree->child[position]->min[Z] = tree->min[Z];
-            tree->child[position]->max[X] = tree->max[X];
-            tree->child[position]->max[Y] = tree->max[Y];
-            tree->child[position]->max[Z] = tree->min[Z] + (tree->max[Z] - tree->min[Z]) / 2;
-            break;
-        case TSW:
-            tree->child[position]->min[X] = tree->min[X];
-            tree->child[position]->min[Y] = tree->min[Y];
-            tree->child[position]->min[Z] = tree->min[Z] + (tree->max[Z] - tree->min[Z]) / 2;
-            tree->child[position]->max[X] = tree->min[X] + (tree->max[X] - tree->min[X]) / 2;
-            tree->child[position]->max[Y] = tree->min[Y] + (tree->max[Y] - tree->min[Y]) / 2;
-            tree->child[position]->max[Z] = tree->max[Z];
-            break;
-        case TSE:
-            tree->child[position]->min[X] = tree->min[X] + (tree->max[X] - tree->min[X]) / 2;
-            tree->child[position]->min[Y] = tree->min[Y];
-            tree->child[position]->min[Z] = tree->min[Z] + (tree->max[Z] - tree->min[Z]) / 2;
-            tree->child[position]->max[X] = tree->max[X];
-            tree->child[position]->max[Y] = tree->min[Y] + (tree->max[Y] - tree->min[Y]) / 2;
-            tree->child[position]->max[Z] = tree->max[Z];
-            break;
-        case TNW:
-            tree->child[position]->min[X] = tree->min[X];
-            tree->child[position]->min[Y] = tree->min[Y] + (tree->max[Y] - tree->min[Y]) / 2;
-            tree->child[position]->min[Z] = tree->min[Z] + (tree->max[Z] - tree->min[Z]) / 2;
-            tree->child[position]->max[X] = tree->min[X] + (tree->max[X] - tree->min[X]) / 2;
-            tree->child[position]->max[Y] = tree->max[Y];
-            tree->child[position]->max[Z] = tree->max[Z];
-            break;
-        case TNE:
-            tree->child[position]->min[X] = tree->min[X] + (tree->max[X] - tree->min[X]) / 2;
-            tree->child[position]->min[Y] = tree->min[Y] + (tree->max[Y] - tree->min[Y]) / 2;
-            tree->child[position]->min[Z] = tree->min[Z] + (tree->max[Z] - tree->min[Z]) / 2;
-            tree->child[position]->max[X] = tree->max[X];
-            tree->child[position]->max[Y] = tree->max[Y];
-            tree->child[position]->max[Z] = tree->max[Z];
-            break;
+    int base = tree->count;
+    oct_node_t *node;
+    float half[3];
+
+    if (tree->count + 8 > tree->capacity) {
+        tree->capacity *= 2;
+        tree->nodes = (oct_node_t *)realloc(tree->nodes,
+                                            sizeof(oct_node_t) * tree->capacity);
+        if (tree->nodes == NULL)
+            exit(1);
+    }
+    tree->count += 8;
+    node = &tree->nodes[parent];
+    node->child = base;
+    for (int axis = 0; axis < 3; axis += 1)
+        half[axis] = node->min[axis] + (node->max[axis] - node->min[axis]) / 2;
+    for (int i = 0; i < 8; i += 1) {
+        memset(&tree->nodes[base + i], 0, sizeof(oct_node_t));
+        tree->nodes[base + i].type = EMPTY;
+        tree->nodes[base + i].child = -1;
+        tree->nodes[base + i].body = -1;
+        // bit 0 of the sub-cube index is East, bit 1 North and bit 2 Top
+        for (int axis = 0; axis < 3; axis += 1) {
+            if (i & (1 << axis)) {
+                tree->nodes[base + i].min[axis] = half[axis];
+                tree->nodes[base + i].max[axis] = node->max[axis];
+            } else {
+                tree->nodes[base + i].min[axis] = node->min[axis];
+                tree->nodes[base + i].max[axis] = half[axis];
+            }
+        }
+    }
+    return base;
+}
+
+/* FUNCTION: add_quadrupole
+ * --------------------------------------
+ * adds the traceless quadrupole moment of a point mass to a moment:
+ *
+ *      Q_ij += m * (3 * d_i * d_j - |d|^2 * delta_ij)
+ *
+ * quadrupole: moment to update, see XX to ZZ
+ * mass: mass of the point
+ * d: 3D position of the point relative to the center of the moment
+ */
+static void add_quadrupole(float quadrupole[6], float mass, const float d[3])
+{
+    float d2 = d[X] * d[X] + d[Y] * d[Y] + d[Z] * d[Z];
+
+    quadrupole[XX] += mass * (3 * d[X] * d[X] - d2);
+    quadrupole[XY] += mass * 3 * d[X] * d[Y];
+    quadrupole[XZ] += mass * 3 * d[X] * d[Z];
+    quadrupole[YY] += mass * (3 * d[Y] * d[Y] - d2);
+    quadrupole[YZ] += mass * 3 * d[Y] * d[Z];
+    quadrupole[ZZ] += mass * (3 * d[Z] * d[Z] - d2);
+}
+
+/* FUNCTION: set_child_node
+ * --------------------------------------
+ * turns a node into a CHILD node holding the given bodies, computing their
+ * gravity center and bounding box, and their quadrupole moment with
+ * BH_EXPANSION_QUADRUPOLE
+ *
+ * tree: octree owning the node
+ * node: node to fill
+ * particles: store of all the bodies
+ * body: index of the first body held by the node
+ * count: number of bodies held by the node, they must be contiguous
+ */
+static void set_child_node(const octree_t *tree, oct_node_t *node,
+                           particles_t *particles, int body, int count)
+{
+    float d[3];
+
+    node->body = body;
+    node->count = count;
+    node->type = CHILD;
+    // copy data to current node so that when we will calculate the forces
+    // they will be calculated based on the position of bodies before
+    // the force are applied on bodies
+    node->weight = 0;
+    node->position[X] = 0;
+    node->position[Y] = 0;
+    node->position[Z] = 0;
+    for (int axis = 0; axis < 3; axis += 1) {
+        node->box[0][axis] = INFINITY;
+        node->box[1][axis] = -INFINITY;
+    }
+    for (int i = body; i < body + count; i += 1) {
+        node->weight += particles->mass[i];
+        node->position[X] += particles->mass[i] * particles->x[i];
+        node->position[Y] += particles->mass[i] * particles->y[i];
+        node->position[Z] += particles->mass[i] * particles->z[i];
+        node->box[0][X] = fminf(node->box[0][X], particles->x[i]);
+        node->box[0][Y] = fminf(node->box[0][Y], particles->y[i]);
+        node->box[0][Z] = fminf(node->box[0][Z], particles->z[i]);
+        node->box[1][X] = fmaxf(node->box[1][X], particles->x[i]);
+        node->box[1][Y] = fmaxf(node->box[1][Y], particles->y[i]);
+        node->box[1][Z] = fmaxf(node->box[1][Z], particles->z[i]);
+    }
+    node->position[X] /= node->weight;
+    node->position[Y] /= node->weight;
+    node->position[Z] /= node->weight;
+    if (tree->expansion != BH_EXPANSION_QUADRUPOLE)
+        return;
+    memset(node->quadrupole, 0, sizeof(node->quadrupole));
+    for (int i = body; i < body + count; i += 1) {
+        d[X] = particles->x[i] - node->position[X];
+        d[Y] = particles->y[i] - node->position[Y];
+        d[Z] = particles->z[i] - node->position[Z];
+        add_quadrupole(node->quadrupole, particles->mass[i], d);
+    }
+}
+
+/*
+ * while bodies are inserted (BH_BUILD_INSERT), the bodies of a leaf are kept in
+ * a linked list: node->body is the first body of the list, tree->links[i]
+ * the body following the body i, and node->count the length of the list,
+ * the leaves get their contiguous range of bodies in order_leaves
+ */
+
+static void insert_node(octree_t *tree, particles_t *particles, int index,
+                        int body, int level);
+
+/* FUNCTION: move_to_parent_node
+ * --------------------------------------
+ * transforms the full CHILD node at the given index into a PARENT node and
+ * moves its bodies to its new children in the good sub-cubes
+ *
+ * tree: octree owning the node
+ * particles: store of all the bodies
+ * index: index of the child to transform to parent node
+ * level: depth of the node (0 for the root)
+ */
+static void move_to_parent_node(octree_t *tree, particles_t *particles,
+                                int index, int level)
+{
+    int body = tree->nodes[index].body;
+    int next;
+
+    STAT(tree->depths[level] -= tree->nodes[index].count);
+    alloc_children(tree, index);
+    tree->nodes[index].type = PARENT;
+    tree->nodes[index].body = -1;
+    tree->nodes[index].count = 0;
+    while (body >= 0) {
+        next = tree->links[body];
+        insert_node(tree, particles, index, body, level);
+        body = next;
     }
-    new_pos = get_body_interval(save->body,
-                                tree->child[position]->min,
-                                tree->child[position]->max);
-    tree->child[position]->child[new_pos] = save;
 }
 
 /* FUNCTION: insert_node
  * --------------------------------------
- * insert a body in the octree recursively
+ * insert a body in the octree recursively, a leaf being split when it
+ * already holds tree->bucket_size bodies, except at depth MORTON_LEVELS
+ * (the deepest level of BH_BUILD_MORTON too) where the bodies that could not
+ * be split any further, like coincident bodies, share the leaf
  *
- * tree: root of the octree (the root must have a type PARENT)
- * body: body to insert in the octree
+ * tree: octree owning the node
+ * particles: store of all the bodies
+ * index: index of the node to insert in (the node must have a type PARENT)
+ * body: index of the body to insert in the octree
+ * level: depth of the node (0 for the root)
  */
-static void insert_node(oct_node_t *tree, body_t *body)
+static void insert_node(octree_t *tree, particles_t *particles, int index,
+                        int body, int level)
 {
-    int position = get_body_interval(body, tree->min, tree->max);
+    oct_node_t *node = &tree->nodes[index];
+    float position[3] = {particles->x[body], particles->y[body], particles->z[body]};
+    int octant = get_body_interval(position, node->min, node->max);
+    int child = node->child + octant;
 
-    if (tree->child[position]) {
-        if (tree->child[position]->type == CHILD)
-            move_to_parent_node(tree, position);
-        insert_node(tree->child[position], body);
-    } else {
-        tree->child[position] = (oct_node_t *)calloc(sizeof(oct_node_t), 1);
-        tree->child[position]->body = body;
-        tree->child[position]->type = CHILD;
-        // copy data to current node so that when we will calculate the forces
-        // they will be calculated based on the position of bodies before
-        // the force are applied on bodies
-        tree->child[position]->weight = tree->child[position]->body->weight;
-        tree->child[position]->position[X] = tree->child[position]->body->x;
-        tree->child[position]->position[Y] = tree->child[position]->body->y;
-        tree->child[position]->position[Z] = tree->child[position]->body->z;
+    // the root cube holds every body, only a NaN position is out of it
+    if (octant < 0)
+        exit(1);
+    node = &tree->nodes[child];
+    if (node->type == EMPTY) {
+        node->type = CHILD;
+        node->body = -1;
+        node->count = 0;
+    }
+    if (node->type == CHILD && (node->count < tree->bucket_size
+                                || level + 1 == MORTON_LEVELS)) {
+        tree->links[body] = node->body;
+        node->body = body;
+        node->count += 1;
+        STAT(tree->depths[level + 1] += 1);
+        return;
     }
+    if (node->type == CHILD)
+        move_to_parent_node(tree, particles, child, level + 1);
+    insert_node(tree, particles, child, body, level + 1);
 }
 
-/* FUNCTION: clean_tree
+/* FUNCTION: order_leaves
  * --------------------------------------
- * cleans an octree recursively
+ * lists the bodies of the leaves in depth first order, so that the bodies
+ * of each leaf get contiguous once the particles are permuted, each node
+ * getting the range of its bodies like with BH_BUILD_MORTON
  *
- * tree: root of the octree (the root must have a type PARENT)
+ * tree: octree owning the node
+ * index: index of a PARENT node
+ * count: number of bodies already listed in tree->order
+ *
+ * returns: the number of bodies listed in tree->order
  */
-void clean_tree(oct_node_t *tree)
+static int order_leaves(octree_t *tree, int index, int count)
 {
-    for (int i = 0; i < 8; i += 1)
-        if (tree->child[i] == NULL)
-            continue;
-        else if (tree->child[i]->type == CHILD)
-            free(tree->child[i]);
+    int first = count;
+    oct_node_t *node;
+
+    for (int i = 0; i < 8; i += 1) {
+        node = &tree->nodes[tree->nodes[index].child + i];
+        if (node->type == PARENT) {
+            count = order_leaves(tree, tree->nodes[index].child + i, count);
+        } else if (node->type == CHILD) {
+            for (int body = node->body; body >= 0; body = tree->links[body]) {
+                tree->order[count] = body;
+                count += 1;
+            }
+            node->body = count - node->count;
+        }
+    }
+    tree->nodes[index].body = first;
+    tree->nodes[index].count = count - first;
+    return count;
+}
+
+/* FUNCTION: create_insert_octree
+ * --------------------------------------
+ * builds the octree by inserting the bodies one by one (BH_BUILD_INSERT), then
+ * reorders them so that each leaf holds a contiguous range of bodies
+ *
+ * tree: octree with an initialized root
+ * particles: store of all the bodies in the universe, reordered by this call
+ * pool: threads running the reordering
+ */
+static void create_insert_octree(octree_t *tree, particles_t *particles,
+                                 pool_t *pool)
+{
+    alloc_children(tree, 0);
+    FOREACH_PARTICLE(particles, i)
+        insert_node(tree, particles, 0, i, 0);
+    order_leaves(tree, 0, 0);
+    permute_particles(particles, tree->order, pool);
+    for (int i = 0; i < tree->count; i += 1)
+        if (tree->nodes[i].type == CHILD)
+            set_child_node(tree, &tree->nodes[i], particles,
+                           tree->nodes[i].body, tree->nodes[i].count);
+}
+
+/* FUNCTION: find_octant_end
+ * --------------------------------------
+ * finds the end of the bodies of a sub-cube in a sorted range of bodies
+ *
+ * keys: sorted Morton keys
+ * first: index of the first body of the range
+ * last: index following the last body of the range
+ * level: depth of the node owning the range
+ * octant: sub-cube of the node
+ *
+ * returns: the index following the last body in the sub-cube octant or below
+ */
+static int find_octant_end(const uint64_t *keys, int first, int last,
+                           int level, int octant)
+{
+    int middle;
+
+    while (first < last) {
+        middle = first + (last - first) / 2;
+        if (morton_octant(keys[middle], level) <= octant)
+            first = middle + 1;
         else
-            clean_tree(tree->child[i]);
-    free(tree);
+            last = middle;
+    }
+    return first;
 }
 
-/* FUNCTION: create_octree
+/* FUNCTION: build_morton_node
  * --------------------------------------
- * initiates the octree in which all the calculus are going to be made
+ * builds the sub-tree of a node from the bodies sorted by Morton key
+ *
+ * the bodies of each sub-cube are a contiguous range of the sorted bodies,
+ * so the children are found with a binary search in the node range
  *
- * bodies: list of all the bodies in the universe
+ * the nodes at depth split are not built but recorded as sub-trees, to be
+ * built later by build_subtree_task
  *
- * returns: the pointer of the octree root
+ * tree: octree owning the arena of the node
+ * keys: sorted Morton keys
+ * particles: store of all the bodies, sorted like keys
+ * index: index of the node (the node must have a type PARENT)
+ * first: index of the first body in the node
+ * last: index following the last body in the node
+ * level: depth of the node (0 for the root)
+ * split: depth of the recorded sub-trees, -1 to build the whole sub-tree
  */
-oct_node_t *create_octree(bodies_t *bodies)
+static void build_morton_node(octree_t *tree, const uint64_t *keys,
+                              particles_t *particles, int index, int first,
+                              int last, int level, int split)
 {
-    oct_node_t *tree = (oct_node_t *)calloc(sizeof(oct_node_t), 1);
-
-    tree->min[X] = 0;
-    tree->min[Y] = 0;
-    tree->min[Z] = 0;
-    tree->max[X] = GALAXY_SIZE;
-    tree->max[Y] = GALAXY_SIZE;
-    tree->max[Z] = GALAXY_SIZE;
-    tree->type = PARENT;
-    while (bodies) {
-        insert_node(tree, bodies->body);
-        bodies = bodies->next;
+    int base = alloc_children(tree, index);
+    int begin = first;
+    int end;
+
+    tree->nodes[index].body = first;
+    tree->nodes[index].count = last - first;
+    for (int i = 0; i < 8; i += 1) {
+        end = find_octant_end(keys, begin, last, level, i);
+        if (end == begin)
+            continue;
+        // a leaf holds up to bucket_size bodies, more only at the deepest
+        // level where they cannot be split any further
+        if (end - begin <= tree->bucket_size || level + 1 == MORTON_LEVELS) {
+            set_child_node(tree, &tree->nodes[base + i], particles, begin,
+                           end - begin);
+            STAT(tree->depths[level + 1] += end - begin);
+        } else if (level + 1 == split) {
+            tree->nodes[base + i].type = PARENT;
+            tree->subtrees[tree->subtree_count].node = base + i;
+            tree->subtrees[tree->subtree_count].first = begin;
+            tree->subtrees[tree->subtree_count].last = end;
+            tree->subtree_count += 1;
+        } else {
+            tree->nodes[base + i].type = PARENT;
+            build_morton_node(tree, keys, particles, base + i, begin, end,
+                              level + 1, split);
+        }
+        begin = end;
     }
-    return tree;
 }
 
-/* FUNCTION: calculate_node_gravity_center
+typedef struct build_task_s {
+    octree_t *tree;
+    particles_t *particles;
+} build_task_t;
+
+/* FUNCTION: build_subtree_task
+ * --------------------------------------
+ * builds a sub-tree in the arena of the thread, its root being a copy of
+ * the node it will replace under the top levels
+ *
+ * data: build_task_t of the batch
+ * task: index of the sub-tree
+ * thread: index of the worker, selecting its arena
+ */
+static void build_subtree_task(void *data, int task, int thread)
+{
+    build_task_t *build = (build_task_t *)data;
+    octree_t *tree = build->tree;
+    subtree_t *subtree = &tree->subtrees[task];
+    octree_t *arena = &tree->arenas[thread];
+
+    if (arena->count == arena->capacity) {
+        arena->capacity = arena->capacity ? 2 * arena->capacity : 1024;
+        arena->nodes = (oct_node_t *)realloc(arena->nodes,
+                                             sizeof(oct_node_t) * arena->capacity);
+        if (arena->nodes == NULL)
+            exit(1);
+    }
+    subtree->thread = thread;
+    subtree->root = arena->count;
+    arena->nodes[arena->count] = tree->nodes[subtree->node];
+    arena->count += 1;
+    arena->bucket_size = tree->bucket_size;
+    arena->expansion = tree->expansion;
+    build_morton_node(arena, tree->keys, build->particles, subtree->root,
+                      subtree->first, subtree->last, SPLIT_LEVEL, -1);
+    subtree->size = arena->count - subtree->root;
+}
+
+/* FUNCTION: stitch_subtree_task
+ * --------------------------------------
+ * copies a sub-tree from the arena of its thread to the octree, its root
+ * replacing the node at SPLIT_LEVEL and the nodes below going to
+ * subtree->dest, relocating the child indexes
+ *
+ * data: build_task_t of the batch
+ * task: index of the sub-tree
+ * thread: index of the worker (unused)
+ */
+static void stitch_subtree_task(void *data, int task, int thread)
+{
+    build_task_t *build = (build_task_t *)data;
+    octree_t *tree = build->tree;
+    subtree_t *subtree = &tree->subtrees[task];
+    oct_node_t *src = &tree->arenas[subtree->thread].nodes[subtree->root];
+    oct_node_t *dst = &tree->nodes[subtree->dest];
+    int shift = subtree->dest - (subtree->root + 1);
+
+    (void)thread;
+    tree->nodes[subtree->node] = src[0];
+    tree->nodes[subtree->node].child += shift;
+    for (int i = 1; i < subtree->size; i += 1) {
+        dst[i - 1] = src[i];
+        if (dst[i - 1].child >= 0)
+            dst[i - 1].child += shift;
+    }
+}
+
+/* FUNCTION: create_morton_octree
+ * --------------------------------------
+ * builds the octree in bulk (BH_BUILD_MORTON) on the threads of the pool
+ *      *  sorts the bodies along the Z-order curve (see sort_bodies)
+ *      *  builds the levels above SPLIT_LEVEL from the sorted key ranges
+ *      *  builds each sub-tree at SPLIT_LEVEL in the arena of a thread
+ *      *  copies the sub-trees under the top levels
+ *
+ * tree: octree with an initialized root
+ * particles: store of all the bodies in the universe, reordered by this call
+ * pool: threads running the tasks
+ */
+static void create_morton_octree(octree_t *tree, particles_t *particles,
+                                 pool_t *pool)
+{
+    build_task_t build = {tree, particles};
+
+    if (tree->arena_count < pool->threads) {
+        tree->arenas = (octree_t *)realloc(tree->arenas,
+                                           sizeof(octree_t) * pool->threads);
+        if (tree->arenas == NULL)
+            exit(1);
+        memset(&tree->arenas[tree->arena_count], 0,
+               sizeof(octree_t) * (pool->threads - tree->arena_count));
+        tree->arena_count = pool->threads;
+    }
+    for (int i = 0; i < tree->arena_count; i += 1) {
+        reset_octree(&tree->arenas[i]);
+        STAT(memset(tree->arenas[i].depths, 0, sizeof(tree->depths)));
+    }
+    tree->subtree_count = 0;
+    sort_bodies(tree, particles, pool);
+    if (particles->count == 0) {
+        alloc_children(tree, 0);
+        return;
+    }
+    build_morton_node(tree, tree->keys, particles, 0, 0, particles->count, 0,
+                      SPLIT_LEVEL);
+    run_pool(pool, tree->subtree_count, build_subtree_task, &build);
+    STAT(for (int i = 0; i < tree->arena_count; i += 1)
+             for (int depth = 0; depth < STATS_DEPTHS; depth += 1)
+                 tree->depths[depth] += tree->arenas[i].depths[depth]);
+    // place the sub-trees one after the other at the end of the arena
+    for (int i = 0; i < tree->subtree_count; i += 1) {
+        tree->subtrees[i].dest = tree->count;
+        tree->count += tree->subtrees[i].size - 1;
+    }
+    if (tree->count > tree->capacity) {
+        while (tree->count > tree->capacity)
+            tree->capacity *= 2;
+        tree->nodes = (oct_node_t *)realloc(tree->nodes,
+                                            sizeof(oct_node_t) * tree->capacity);
+        if (tree->nodes == NULL)
+            exit(1);
+    }
+    run_pool(pool, tree->subtree_count, stitch_subtree_task, &build);
+}
+
+/* FUNCTION: create_octree
  * --------------------------------------
+ * builds the octree in which all the calculus are going to be made
+ *
+ * the previous content of the octree is dropped, its arena is reused
  *
- * calculates the gravity cented of each parent node of the octree
+ * the root is the smallest cube holding every body, found with a parallel
+ * reduction, so that bodies escaping the initial galaxy or gathering in a
+ * small region keep a tree of the right size
+ *
+ * tree: octree initialized with init_octree
+ * particles: store of all the bodies in the universe, reordered along the
+ * Z-order curve with BH_BUILD_MORTON
+ * pool: threads running the BH_BUILD_MORTON build (the insertions of
+ * BH_BUILD_INSERT are serial)
+ */
+void create_octree(octree_t *tree, particles_t *particles, pool_t *pool)
+{
+    oct_node_t *root;
+    float min[3];
+    float max[3];
+    float size = 0;
+    float magnitude = 0;
+
+    get_particles_bounds(particles, pool, min, max);
+    for (int axis = 0; axis < 3; axis += 1) {
+        size = fmaxf(size, max[axis] - min[axis]);
+        magnitude = fmaxf(magnitude, fmaxf(fabsf(min[axis]), fabsf(max[axis])));
+    }
+    if (particles->count == 0) {
+        for (int axis = 0; axis < 3; axis += 1) {
+            min[axis] = 0;
+            max[axis] = GALAXY_SIZE;
+        }
+        size = GALAXY_SIZE;
+    } else if (!isfinite(size)) {
+        exit(1);
+    } else {
+        // a margin of a few float steps of the coordinates keeps the bodies
+        // on the faces inside the cube despite rounding, coincident bodies
+        // at the origin getting a cube of width 1
+        size = size * (1 + 1e-5f) + 4 * FLT_EPSILON * magnitude;
+        if (size == 0)
+            size = 1;
+    }
+    reset_octree(tree);
+    STAT(memset(tree->depths, 0, sizeof(tree->depths)));
+    tree->count = 1;
+    root = &tree->nodes[0];
+    memset(root, 0, sizeof(oct_node_t));
+    for (int axis = 0; axis < 3; axis += 1) {
+        root->min[axis] = (min[axis] + max[axis]) / 2 - size / 2;
+        root->max[axis] = root->min[axis] + size;
+    }
+    root->type = PARENT;
+    root->body = -1;
+    // an empty store gives an EMPTY root, skipped by the moment and force
+    // passes
+    if (particles->count == 0) {
+        root->type = EMPTY;
+        return;
+    }
+    if (particles->count > tree->key_capacity)
+        alloc_key_buffers(tree, particles->capacity);
+    if (tree->build == BH_BUILD_MORTON)
+        create_morton_octree(tree, particles, pool);
+    else
+        create_insert_octree(tree, particles, pool);
+}
+
+/* FUNCTION: gather_children
+ * --------------------------------------
+ * sets the gravity center and bounding box of a parent node from the ones
+ * of its children
  *
  * sets node->weight as the sum of all children masses
  * sets node->postion as the weighted average of the 3D position (weighted
  * with the weight of each child body)
+ * sets node->box as the union of the children boxes
+ * sets node->quadrupole with BH_EXPANSION_QUADRUPOLE as the sum of the children
+ * moments, shifted from their gravity center to the one of the node
  *
- * tree: parent node of an octree
- *
+ * tree: octree owning the node
+ * index: index of a parent node whose children are up to date
  */
-void calculate_nodes_gravity_center(oct_node_t *tree)
+static void gather_children(octree_t *tree, int index)
 {
+    oct_node_t *node = &tree->nodes[index];
+    oct_node_t *child;
+    float d[3];
+
+    node->weight = 0;
+    for (int axis = 0; axis < 3; axis += 1) {
+        node->position[axis] = 0;
+        node->box[0][axis] = INFINITY;
+        node->box[1][axis] = -INFINITY;
+    }
     for (int i = 0; i < 8; i += 1) {
-        if (tree->child[i] == NULL)
+        child = &tree->nodes[node->child + i];
+        if (child->type == EMPTY)
             continue;
-        if (tree->child[i]->type == PARENT)
-            calculate_nodes_gravity_center(tree->child[i]);
-        tree->weight += tree->child[i]->weight;
-        tree->position[X] += tree->child[i]->weight * tree->child[i]->position[X];
-        tree->position[Y] += tree->child[i]->weight * tree->child[i]->position[Y];
-        tree->position[Z] += tree->child[i]->weight * tree->child[i]->position[Z];
+        node->weight += child->weight;
+        for (int axis = 0; axis < 3; axis += 1) {
+            node->position[axis] += child->weight * child->position[axis];
+            node->box[0][axis] = fminf(node->box[0][axis], child->box[0][axis]);
+            node->box[1][axis] = fmaxf(node->box[1][axis], child->box[1][axis]);
+        }
     }
-    if (tree->weight == 0)
+    if (node->weight == 0)
         exit(1);
-    tree->position[X] /= tree->weight;
-    tree->position[Y] /= tree->weight;
-    tree->position[Z] /= tree->weight;
+    node->position[X] /= node->weight;
+    node->position[Y] /= node->weight;
+    node->position[Z] /= node->weight;
+    if (tree->expansion != BH_EXPANSION_QUADRUPOLE)
+        return;
+    memset(node->quadrupole, 0, sizeof(node->quadrupole));
+    for (int i = 0; i < 8; i += 1) {
+        child = &tree->nodes[node->child + i];
+        if (child->type == EMPTY)
+            continue;
+        for (int k = 0; k < 6; k += 1)
+            node->quadrupole[k] += child->quadrupole[k];
+        for (int axis = 0; axis < 3; axis += 1)
+            d[axis] = child->position[axis] - node->position[axis];
+        add_quadrupole(node->quadrupole, child->weight, d);
+    }
 }
 
-static float compute_gravitational_force(float m1, float m2, float r)
+/* FUNCTION: calculate_node_gravity_center
+ * --------------------------------------
+ *
+ * calculates the gravity cented of each parent node of a sub-tree, bottom-up
+ *
+ * tree: octree owning the node
+ * index: index of a parent node of the octree
+ *
+ */
+static void calculate_node_gravity_center(octree_t *tree, int index)
 {
-    float grav_const = 6.67428 * pow(10, -11);
+    int child;
 
-    if (r == 0.0)
-        return 0.0;
-    return grav_const * m1 * m2 / (r * r);
+    for (int i = 0; i < 8; i += 1) {
+        child = tree->nodes[index].child + i;
+        if (tree->nodes[child].type == PARENT)
+            calculate_node_gravity_center(tree, child);
+    }
+    gather_children(tree, index);
 }
 
-static void apply_forces_on_node(oct_node_t *mover, oct_node_t *attractor)
+/* FUNCTION: calculate_top_gravity_center
+ * --------------------------------------
+ * calculates the gravity center of the parent nodes above SPLIT_LEVEL, the
+ * parent nodes at SPLIT_LEVEL being already done
+ *
+ * tree: octree owning the node
+ * index: index of a parent node above SPLIT_LEVEL
+ * level: depth of the node (0 for the root)
+ */
+static void calculate_top_gravity_center(octree_t *tree, int index, int level)
 {
-    // 3D vector representing the gravitational
-    // force between mover and attractor
-    float force[3] = {0.0, 0.0, 0.0};
-    // 3D acceleration vector of mover object
-    float acceleration[3] = {0.0};
-
-    for (int index = 0; index < 3; index += 1) {
-        force[index] = compute_gravitational_force(mover->weight,
-                                                   attractor->weight,
-                                                   attractor->position[index]
-                                                   - mover->position[index]);
-        if (mover->weight == 0)
-            exit(1);
-        acceleration[index] = force[index] / mover->weight;
-        mover->body->velocity[index] += acceleration[index];
+    int child;
+
+    for (int i = 0; i < 8; i += 1) {
+        child = tree->nodes[index].child + i;
+        if (tree->nodes[child].type == PARENT && level + 1 < SPLIT_LEVEL)
+            calculate_top_gravity_center(tree, child, level + 1);
     }
-    mover->body->x += mover->body->velocity[X];
-    mover->body->y += mover->body->velocity[Y];
-    mover->body->z += mover->body->velocity[Z];
+    gather_children(tree, index);
 }
 
-/*
- * calculates the value of  s / d, where s is the width of the region
- * represented by the internal node, and d is the distance between the body
- * and the node's center of mass.
+/* FUNCTION: collect_subtrees
+ * --------------------------------------
+ * lists the parent nodes at SPLIT_LEVEL in tree->subtrees
+ *
+ * tree: octree owning the node
+ * index: index of a parent node above SPLIT_LEVEL
+ * level: depth of the node (0 for the root)
  */
-static float get_action_ratio(oct_node_t *mover, oct_node_t *attractor)
+static void collect_subtrees(octree_t *tree, int index, int level)
+{
+    int child;
+
+    for (int i = 0; i < 8; i += 1) {
+        child = tree->nodes[index].child + i;
+        if (tree->nodes[child].type != PARENT)
+            continue;
+        if (level + 1 < SPLIT_LEVEL) {
+            collect_subtrees(tree, child, level + 1);
+        } else {
+            tree->subtrees[tree->subtree_count].node = child;
+            tree->subtree_count += 1;
+        }
+    }
+}
+
+static void gravity_center_task(void *data, int task, int thread)
 {
-    // width of the region (as each parent region is a cube, we will get its
-    // value from the absolute value of the difference between min[X] and max[X])
-    // if attractor is CHILD, s = 1.0
-    float s = 1.0;
-    // distance between mover and attractor, 3d distance formula is
-    // 	√((x2 - x1)² + (y2 - y1)² + (z2 - z1)²)
-    float d;
-
-    if (attractor->type == PARENT)
-        s = fabs(attractor->max[X] - attractor->min[X]);
-    d = (float)pow((double)(attractor->position[X] - mover->position[X]), 2) +
-        (float)pow((double)(attractor->position[Y] - mover->position[Y]), 2) +
-        (float)pow((double)(attractor->position[Z] - mover->position[Z]), 2);
-    d = sqrtf(d);
-    return s / d;
+    octree_t *tree = (octree_t *)data;
+
+    (void)thread;
+    calculate_node_gravity_center(tree, tree->subtrees[task].node);
 }
 
-// node must be CHILD and parent must be PARENT type
-static void get_forces_on_node(oct_node_t *node, oct_node_t *parent)
+/* FUNCTION: calculate_nodes_gravity_center
+ * --------------------------------------
+ * calculates the gravity center of every parent node, bottom-up, the
+ * sub-trees at SPLIT_LEVEL running on the threads of the pool before the
+ * levels above them, along with the quadrupole moments when
+ * tree->expansion is BH_EXPANSION_QUADRUPOLE, the EMPTY root of an empty store
+ * being left as it is
+ *
+ * tree: octree to update
+ * pool: threads running the sub-trees
+ */
+void calculate_nodes_gravity_center(octree_t *tree, pool_t *pool)
 {
-    float action_ratio;
+    tree->walk_count = 0;
+    if (tree->nodes[0].type == EMPTY)
+        return;
+    tree->subtree_count = 0;
+    collect_subtrees(tree, 0, 0);
+    run_pool(pool, tree->subtree_count, gravity_center_task, tree);
+    calculate_top_gravity_center(tree, 0, 0);
+}
+
+/* FUNCTION: refit_leaves
+ * --------------------------------------
+ * refits the leaves of a sub-tree to the current position of their bodies:
+ * the leaves keep their bodies and their cell, only their gravity center,
+ * bounding box and moments are updated
+ *
+ * tree: octree owning the node
+ * particles: store of all the bodies, in the order of the last build
+ * index: index of a PARENT node
+ * level: depth of the node (0 for the root)
+ * split: depth of the sub-trees refitted by other calls, -1 to refit the
+ * whole sub-tree
+ *
+ * returns: the number of bodies out of the cell of their leaf
+ */
+static int refit_leaves(octree_t *tree, particles_t *particles, int index,
+                        int level, int split)
+{
+    oct_node_t *leaf;
+    float body[3];
+    int escaped = 0;
+    int child;
 
     for (int i = 0; i < 8; i += 1) {
-        if (parent->child[i] == NULL || parent->child[i] == node)
+        child = tree->nodes[index].child + i;
+        leaf = &tree->nodes[child];
+        if (leaf->type == PARENT && level + 1 != split)
+            escaped += refit_leaves(tree, particles, child, level + 1, split);
+        if (leaf->type != CHILD)
             continue;
-        action_ratio = get_action_ratio(node, parent->child[i]);
-        if (action_ratio < THETA)
-            apply_forces_on_node(node, parent->child[i]);
-        else if (parent->child[i]->type == PARENT)
-            get_forces_on_node(node, parent->child[i]);
+        set_child_node(tree, leaf, particles, leaf->body, leaf->count);
+        for (int j = leaf->body; j < leaf->body + leaf->count; j += 1) {
+            body[X] = particles->x[j];
+            body[Y] = particles->y[j];
+            body[Z] = particles->z[j];
+            if (!body_in_range(body, leaf->min[X], leaf->max[X],
+                               leaf->min[Y], leaf->max[Y],
+                               leaf->min[Z], leaf->max[Z]))
+                escaped += 1;
+        }
     }
+    return escaped;
 }
 
-void run_forces(oct_node_t *tree)
+typedef struct refit_task_s {
+    octree_t *tree;
+    particles_t *particles;
+    _Atomic int escaped;            // bodies out of the cell of their leaf
+} refit_task_t;
+
+static void refit_task(void *data, int task, int thread)
 {
-    for (int i = 0; i < 8; i += 1) {
-        if (tree->child[i] == NULL)
-            continue;
-        if (tree->child[i]->type == PARENT)
-            run_forces(tree->child[i]);
-        else
-            get_forces_on_node(tree->child[i], tree);
+    refit_task_t *refit = (refit_task_t *)data;
+    octree_t *tree = refit->tree;
+
+    (void)thread;
+    atomic_fetch_add(&refit->escaped,
+                     refit_leaves(tree, refit->particles,
+                                  tree->subtrees[task].node, SPLIT_LEVEL, -1));
+}
+
+/* FUNCTION: update_octree
+ * --------------------------------------
+ * updates the octree to the current position of the bodies, refitting the
+ * octree of the last step instead of building a new one while the bodies
+ * stay close to their leaf
+ *
+ * a refit keeps the nodes and the order of the bodies: the leaves get the
+ * new gravity center and bounding box of their bodies, which may have left
+ * their cell, and calculate_nodes_gravity_center updates the parent nodes
+ * from them; the octree is rebuilt with create_octree when there is no
+ * octree yet, when tree->refit is 0 or when more than tree->refit of the
+ * bodies are out of the cell of their leaf, the tree getting too loose
+ *
+ * tree: octree initialized with init_octree
+ * particles: store of all the bodies, the same bodies as the last build
+ * pool: threads running the refit or the build
+ *
+ * returns: true if the octree was rebuilt, false if it was refitted
+ */
+bool update_octree(octree_t *tree, particles_t *particles, pool_t *pool)
+{
+    refit_task_t refit = {tree, particles, 0};
+
+    if (tree->count > 0 && tree->nodes[0].type == PARENT && tree->refit > 0) {
+        tree->subtree_count = 0;
+        collect_subtrees(tree, 0, 0);
+        run_pool(pool, tree->subtree_count, refit_task, &refit);
+        refit.escaped += refit_leaves(tree, particles, 0, 0, SPLIT_LEVEL);
+        if (refit.escaped <= tree->refit * particles->count)
+            return false;
+    }
+    create_octree(tree, particles, pool);
+    return true;
+}
+
+static const char *BUILD_NAMES[] = {
+    [BH_BUILD_INSERT] = "insert",
+    [BH_BUILD_MORTON] = "morton",
+};
+
+/* FUNCTION: find_build
+ * --------------------------------------
+ * gets a construction of the octree from its name
+ *
+ * name: name of the construction
+ * build: output, the construction
+ *
+ * returns: false if no construction has this name
+ */
+bool find_build(const char *name, bh_build_et *build)
+{
+    for (size_t i = 0; i < sizeof(BUILD_NAMES) / sizeof(BUILD_NAMES[0]); i += 1) {
+        if (!strcmp(BUILD_NAMES[i], name)) {
+            *build = (bh_build_et)i;
+            return true;
+        }
     }
+    return false;
 }
@@ -0,0 +1,403 @@
+#include "simulation.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/mman.h>
+
+// alignment of every particle array, a cache line so that each array can be
+// streamed and loaded with aligned vector instructions
+static const size_t PARTICLES_ALIGNMENT = 64;
+
+/* FUNCTION: alloc_array
+ * --------------------------------------
+ * allocates an aligned array of floats
+ *
+ * capacity: number of floats in the array
+ *
+ * returns: the allocated array
+ */
+static float *alloc_array(int capacity)
+{
+    size_t size = sizeof(float) * (capacity > 0 ? capacity : 1);
+    float *array;
+
+    // aligned_alloc requires a size multiple of the alignment
+    size = (size + PARTICLES_ALIGNMENT - 1) & ~(PARTICLES_ALIGNMENT - 1);
+    array = (float *)aligned_alloc(PARTICLES_ALIGNMENT, size);
+    if (array == NULL)
+        exit(1);
+    return array;
+}
+
+/* FUNCTION: release_array
+ * --------------------------------------
+ * frees an array of a particle store, unless it lives in the memory mapping
+ * of the store (see attach_particles), which is only unmapped as a whole
+ *
+ * particles: store owning the array
+ * array: array to release
+ */
+static void release_array(particles_t *particles, void *array)
+{
+    char *mapping = (char *)particles->mapping;
+
+    if (mapping != NULL && (char *)array >= mapping
+        && (char *)array < mapping + particles->mapping_size)
+        return;
+    free(array);
+}
+
+/* FUNCTION: resize_array
+ * --------------------------------------
+ * moves an aligned array of 32-bit values to a new aligned array of another
+ * capacity
+ *
+ * particles: store owning the array
+ * array: array to resize (released by this function)
+ * count: number of values to keep from the old array
+ * capacity: number of values in the new array
+ *
+ * returns: the new array
+ */
+static void *resize_array(particles_t *particles, void *array, int count,
+                          int capacity)
+{
+    float *res = alloc_array(capacity);
+
+    memcpy(res, array, sizeof(float) * (count < capacity ? count : capacity));
+    release_array(particles, array);
+    return res;
+}
+
+/* FUNCTION: init_particles
+ * --------------------------------------
+ * creates an empty particle store
+ *
+ * particles: store to initialize
+ * capacity: number of bodies the store can hold before being resized
+ */
+void init_particles(particles_t *particles, int capacity)
+{
+    particles->count = 0;
+    particles->capacity = capacity;
+    particles->mapping = NULL;
+    particles->mapping_size = 0;
+    particles->id = (int *)alloc_array(capacity);
+    particles->x = alloc_array(capacity);
+    particles->y = alloc_array(capacity);
+    particles->z = alloc_array(capacity);
+    particles->mass = alloc_array(capacity);
+    particles->vx = alloc_array(capacity);
+    particles->vy = alloc_array(capacity);
+    particles->vz = alloc_array(capacity);
+    particles->ax = alloc_array(capacity);
+    particles->ay = alloc_array(capacity);
+    particles->az = alloc_array(capacity);
+    particles->level = (int *)alloc_array(capacity);
+    particles->scratch = alloc_array(capacity);
+}
+
+/* FUNCTION: resize_particles
+ * --------------------------------------
+ * changes the capacity of a particle store, the bodies beyond the new
+ * capacity are dropped
+ *
+ * particles: store to resize
+ * capacity: new number of bodies the store can hold
+ */
+void resize_particles(particles_t *particles, int capacity)
+{
+    int count = particles->count;
+
+    particles->id = resize_array(particles, particles->id, count, capacity);
+    particles->x = resize_array(particles, particles->x, count, capacity);
+    particles->y = resize_array(particles, particles->y, count, capacity);
+    particles->z = resize_array(particles, particles->z, count, capacity);
+    particles->mass = resize_array(particles, particles->mass, count, capacity);
+    particles->vx = resize_array(particles, particles->vx, count, capacity);
+    particles->vy = resize_array(particles, particles->vy, count, capacity);
+    particles->vz = resize_array(particles, particles->vz, count, capacity);
+    particles->ax = resize_array(particles, particles->ax, count, capacity);
+    particles->ay = resize_array(particles, particles->ay, count, capacity);
+    particles->az = resize_array(particles, particles->az, count, capacity);
+    particles->level = resize_array(particles, particles->level, count, capacity);
+    release_array(particles, particles->scratch);
+    particles->scratch = alloc_array(capacity);
+    particles->capacity = capacity;
+    if (particles->count > capacity)
+        particles->count = capacity;
+}
+
+/* FUNCTION: add_particle
+ * --------------------------------------
+ * appends a body at rest to a particle store, growing it when full, its
+ * identity being its index
+ *
+ * particles: store to append to
+ * x, y, z: position of the body
+ * mass: mass of the body
+ *
+ * returns: the index of the new body
+ */
+int add_particle(particles_t *particles, float x, float y, float z, float mass)
+{
+    int index = particles->count;
+
+    if (index == particles->capacity)
+        resize_particles(particles, particles->capacity ? 2 * particles->capacity : 1);
+    particles->id[index] = index;
+    particles->x[index] = x;
+    particles->y[index] = y;
+    particles->z[index] = z;
+    particles->mass[index] = mass;
+    particles->vx[index] = 0;
+    particles->vy[index] = 0;
+    particles->vz[index] = 0;
+    particles->ax[index] = 0;
+    particles->ay[index] = 0;
+    particles->az[index] = 0;
+    particles->level[index] = 0;
+    particles->count += 1;
+    return index;
+}
+
+// a permutation or bounds task works on BODIES_PER_TASK consecutive bodies
+static const int BODIES_PER_TASK = 16384;
+
+typedef struct permute_task_s {
+    particles_t *particles;
+    const float *src;               // array to permute, 32-bit values
+                                    // (floats or body identities) only
+                                    // copied with memcpy
+    const int *order;               // order[i] is the index to move at i
+} permute_task_t;
+
+static void permute_task(void *data, int task, int thread)
+{
+    permute_task_t *permute = (permute_task_t *)data;
+    float *res = permute->particles->scratch;
+    int first = task * BODIES_PER_TASK;
+    int last = first + BODIES_PER_TASK;
+
+    (void)thread;
+    if (last > permute->particles->count)
+        last = permute->particles->count;
+    for (int i = first; i < last; i += 1)
+        memcpy(&res[i], &permute->src[permute->order[i]], sizeof(float));
+}
+
+/* FUNCTION: permute_array
+ * --------------------------------------
+ * gathers an array of the store in the given order, using the scratch array
+ * of the store as destination and keeping the old array as the new scratch
+ *
+ * particles: store owning the array
+ * array: array to permute, of 32-bit values
+ * order: order[i] is the index of the value to move at index i
+ * pool: threads running the gather
+ *
+ * returns: the permuted array, which replaces array in the store
+ */
+static void *permute_array(particles_t *particles, void *array,
+                           const int *order, pool_t *pool)
+{
+    permute_task_t permute = {particles, (const float *)array, order};
+    float *res = particles->scratch;
+
+    run_pool(pool, (particles->count + BODIES_PER_TASK - 1) / BODIES_PER_TASK,
+             permute_task, &permute);
+    particles->scratch = (float *)array;
+    return res;
+}
+
+/* FUNCTION: permute_particles
+ * --------------------------------------
+ * reorders all the bodies of a particle store
+ *
+ * particles: store to reorder
+ * order: order[i] is the index of the body to move at index i
+ * pool: threads running the gathers
+ */
+void permute_particles(particles_t *particles, const int *order, pool_t *pool)
+{
+    particles->id = permute_array(particles, particles->id, order, pool);
+    particles->x = permute_array(particles, particles->x, order, pool);
+    particles->y = permute_array(particles, particles->y, order, pool);
+    particles->z = permute_array(particles, particles->z, order, pool);
+    particles->mass = permute_array(particles, particles->mass, order, pool);
+    particles->vx = permute_array(particles, particles->vx, order, pool);
+    particles->vy = permute_array(particles, particles->vy, order, pool);
+    particles->vz = permute_array(particles, particles->vz, order, pool);
+    particles->ax = permute_array(particles, particles->ax, order, pool);
+    particles->ay = permute_array(particles, particles->ay, order, pool);
+    particles->az = permute_array(particles, particles->az, order, pool);
+    particles->level = permute_array(particles, particles->level, order, pool);
+}
+
+typedef struct bounds_task_s {
+    particles_t *particles;
+    float (*bounds)[2][3];          // min then max of the bodies seen by
+                                    // each thread
+} bounds_task_t;
+
+static void bounds_task(void *data, int task, int thread)
+{
+    bounds_task_t *reduce = (bounds_task_t *)data;
+    particles_t *particles = reduce->particles;
+    float (*bounds)[3] = reduce->bounds[thread];
+    int first = task * BODIES_PER_TASK;
+    int last = first + BODIES_PER_TASK;
+
+    if (last > particles->count)
+        last = particles->count;
+    for (int i = first; i < last; i += 1) {
+        bounds[0][X] = fminf(bounds[0][X], particles->x[i]);
+        bounds[0][Y] = fminf(bounds[0][Y], particles->y[i]);
+        bounds[0][Z] = fminf(bounds[0][Z], particles->z[i]);
+        bounds[1][X] = fmaxf(bounds[1][X], particles->x[i]);
+        bounds[1][Y] = fmaxf(bounds[1][Y], particles->y[i]);
+        bounds[1][Z] = fmaxf(bounds[1][Z], particles->z[i]);
+    }
+}
+
+/* FUNCTION: get_particles_bounds
+ * --------------------------------------
+ * computes the bounding box of all the bodies with a parallel min / max
+ * reduction, each thread reducing its chunks before the threads are merged
+ *
+ * particles: store of the bodies
+ * pool: threads running the reduction
+ * min: output, minimum position of the bodies, INFINITY if there is none
+ * max: output, maximum position of the bodies, -INFINITY if there is none
+ */
+void get_particles_bounds(particles_t *particles, pool_t *pool, float min[3],
+                          float max[3])
+{
+    bounds_task_t reduce = {particles, NULL};
+
+    reduce.bounds = (float (*)[2][3])malloc(sizeof(float[2][3]) * pool->threads);
+    if (reduce.bounds == NULL)
+        exit(1);
+    for (int i = 0; i < pool->threads; i += 1) {
+        for (int axis = 0; axis < 3; axis += 1) {
+            reduce.bounds[i][0][axis] = INFINITY;
+            reduce.bounds[i][1][axis] = -INFINITY;
+        }
+    }
+    run_pool(pool, (particles->count + BODIES_PER_TASK - 1) / BODIES_PER_TASK,
+             bounds_task, &reduce);
+    for (int axis = 0; axis < 3; axis += 1) {
+        min[axis] = INFINITY;
+        max[axis] = -INFINITY;
+        for (int i = 0; i < pool->threads; i += 1) {
+            min[axis] = fminf(min[axis], reduce.bounds[i][0][axis]);
+            max[axis] = fmaxf(max[axis], reduce.bounds[i][1][axis]);
+        }
+    }
+    free(reduce.bounds);
+}
+
+/* FUNCTION: attach_particles
+ * --------------------------------------
+ * creates a particle store over the arrays of a memory mapping, without
+ * copying them: the pages are only read when the bodies are first used, and
+ * the arrays stay in the mapping until a resize moves them to the heap
+ *
+ * the mapping must be private and writable, the store writing its arrays,
+ * and 64-byte aligned arrays keep the aligned vector loads valid
+ *
+ * particles: store to initialize, it owns the mapping afterwards
+ * mapping: mapping holding the arrays, unmapped by free_particles
+ * size: size of the mapping in bytes
+ * count: number of bodies in the arrays
+ * arrays: identity, x, y, z, mass, vx, vy and vz arrays, in the mapping
+ */
+void attach_particles(particles_t *particles, void *mapping, size_t size,
+                      int count, void *arrays[8])
+{
+    particles->count = count;
+    particles->capacity = count;
+    particles->mapping = mapping;
+    particles->mapping_size = size;
+    particles->id = (int *)arrays[0];
+    particles->x = (float *)arrays[1];
+    particles->y = (float *)arrays[2];
+    particles->z = (float *)arrays[3];
+    particles->mass = (float *)arrays[4];
+    particles->vx = (float *)arrays[5];
+    particles->vy = (float *)arrays[6];
+    particles->vz = (float *)arrays[7];
+    particles->ax = alloc_array(count);
+    particles->ay = alloc_array(count);
+    particles->az = alloc_array(count);
+    particles->level = (int *)alloc_array(count);
+    particles->scratch = alloc_array(count);
+    memset(particles->ax, 0, sizeof(float) * count);
+    memset(particles->ay, 0, sizeof(float) * count);
+    memset(particles->az, 0, sizeof(float) * count);
+    memset(particles->level, 0, sizeof(int) * count);
+}
+
+/* FUNCTION: free_particles
+ * --------------------------------------
+ * releases all the arrays of a particle store, and its mapping if any
+ *
+ * particles: store to free
+ */
+void free_particles(particles_t *particles)
+{
+    release_array(particles, particles->id);
+    release_array(particles, particles->x);
+    release_array(particles, particles->y);
+    release_array(particles, particles->z);
+    release_array(particles, particles->mass);
+    release_array(particles, particles->vx);
+    release_array(particles, particles->vy);
+    release_array(particles, particles->vz);
+    release_array(particles, particles->ax);
+    release_array(particles, particles->ay);
+    release_array(particles, particles->az);
+    release_array(particles, particles->level);
+    release_array(particles, particles->scratch);
+    if (particles->mapping != NULL)
+        munmap(particles->mapping, particles->mapping_size);
+    memset(particles, 0, sizeof(particles_t));
+}
+
+/* FUNCTION: check_particles
+ * --------------------------------------
+ * checks that the octree can be built on the bodies of a store: every
+ * coordinate and velocity is finite, every mass positive and finite, and
+ * the bounding box of the bodies has a finite size
+ *
+ * particles: store of the bodies
+ *
+ * returns: false if a body is invalid
+ */
+bool check_particles(const particles_t *particles)
+{
+    float min[3] = {INFINITY, INFINITY, INFINITY};
+    float max[3] = {-INFINITY, -INFINITY, -INFINITY};
+    float position[3];
+
+    FOREACH_PARTICLE(particles, i) {
+        position[X] = particles->x[i];
+        position[Y] = particles->y[i];
+        position[Z] = particles->z[i];
+        if (!(particles->mass[i] > 0) || !isfinite(particles->mass[i])
+            || !isfinite(particles->vx[i]) || !isfinite(particles->vy[i])
+            || !isfinite(particles->vz[i]))
+            return false;
+        for (int axis = 0; axis < 3; axis += 1) {
+            if (!isfinite(position[axis]))
+                return false;
+            min[axis] = fminf(min[axis], position[axis]);
+            max[axis] = fmaxf(max[axis], position[axis]);
+        }
+    }
+    for (int axis = 0; particles->count > 0 && axis < 3; axis += 1)
+        if (!isfinite(max[axis] - min[axis]))
+            return false;
+    return true;
+}
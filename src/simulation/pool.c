@@ -0,0 +1,212 @@
+#include "simulation.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * each worker owns a range of tasks packed in a single atomic word, the
+ * beginning of the range in the high 32 bits and its end in the low 32 bits,
+ * so that the owner (taking tasks from the front) and the thieves (taking
+ * half of the remaining tasks from the back) can update it with a single CAS
+ */
+
+static uint64_t pack_range(uint32_t begin, uint32_t end)
+{
+    return (uint64_t)begin << 32 | end;
+}
+
+/* FUNCTION: pop_task
+ * --------------------------------------
+ * takes the next task at the front of the range of a worker
+ *
+ * worker: worker owning the range
+ *
+ * returns: the task index, -1 if the range is empty
+ */
+static int pop_task(worker_t *worker)
+{
+    uint64_t range = atomic_load(&worker->range);
+    uint32_t begin;
+    uint32_t end;
+
+    do {
+        begin = range >> 32;
+        end = (uint32_t)range;
+        if (begin >= end)
+            return -1;
+    } while (!atomic_compare_exchange_weak(&worker->range, &range,
+                                           pack_range(begin + 1, end)));
+    return (int)begin;
+}
+
+/* FUNCTION: steal_tasks
+ * --------------------------------------
+ * takes the back half of the remaining tasks of another worker and makes
+ * them the range of the thief
+ *
+ * victim: worker to steal from
+ * thief: worker receiving the tasks
+ *
+ * returns: true if some tasks have been stolen
+ */
+static bool steal_tasks(worker_t *victim, worker_t *thief)
+{
+    uint64_t range = atomic_load(&victim->range);
+    uint32_t begin;
+    uint32_t end;
+    uint32_t middle;
+
+    do {
+        begin = range >> 32;
+        end = (uint32_t)range;
+        if (begin >= end)
+            return false;
+        middle = begin + (end - begin) / 2;
+    } while (!atomic_compare_exchange_weak(&victim->range, &range,
+                                           pack_range(begin, middle)));
+    atomic_store(&thief->range, pack_range(middle, end));
+    return true;
+}
+
+/* FUNCTION: work
+ * --------------------------------------
+ * runs tasks until no worker has any left, starting with the own range of
+ * the worker and then stealing from the others
+ *
+ * pool: pool running the tasks
+ * thread: index of the worker
+ */
+static void work(pool_t *pool, int thread)
+{
+    worker_t *self = &pool->workers[thread];
+    int task;
+    bool stolen = true;
+
+    while (stolen) {
+        while ((task = pop_task(self)) >= 0)
+            pool->task(pool->data, task, thread);
+        stolen = false;
+        for (int i = 1; i < pool->threads && !stolen; i += 1)
+            stolen = steal_tasks(&pool->workers[(thread + i) % pool->threads],
+                                 self);
+    }
+}
+
+/* FUNCTION: worker_main
+ * --------------------------------------
+ * main loop of the threads of the pool, waiting for a new batch of tasks,
+ * working on it and reporting its completion
+ *
+ * arg: worker_t of the thread
+ *
+ * returns: NULL
+ */
+static void *worker_main(void *arg)
+{
+    worker_t *worker = (worker_t *)arg;
+    pool_t *pool = worker->pool;
+    int thread = worker - pool->workers;
+    int generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->stop && pool->generation == generation)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->stop)
+            break;
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+        work(pool, thread);
+        pthread_mutex_lock(&pool->lock);
+        pool->running -= 1;
+        if (pool->running == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* FUNCTION: init_pool
+ * --------------------------------------
+ * starts the threads of a pool, the calling thread being the worker 0
+ *
+ * pool: pool to initialize
+ * threads: number of workers (at least 1)
+ */
+void init_pool(pool_t *pool, int threads)
+{
+    memset(pool, 0, sizeof(pool_t));
+    pool->threads = threads > 0 ? threads : 1;
+    pool->workers = (worker_t *)aligned_alloc(sizeof(worker_t),
+                                              sizeof(worker_t) * pool->threads);
+    if (pool->workers == NULL)
+        exit(1);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (int i = 0; i < pool->threads; i += 1) {
+        pool->workers[i].pool = pool;
+        atomic_init(&pool->workers[i].range, 0);
+        if (i > 0 && pthread_create(&pool->workers[i].thread, NULL,
+                                    worker_main, &pool->workers[i]))
+            exit(1);
+    }
+}
+
+/* FUNCTION: run_pool
+ * --------------------------------------
+ * runs a batch of tasks on all the workers of the pool and waits for them
+ *
+ * the tasks are first split in contiguous ranges, one per worker, so that
+ * neighbouring tasks (e.g. bodies close in Morton order) run on the same
+ * thread, idle workers then steal from the busy ones
+ *
+ * pool: pool running the tasks
+ * tasks: number of tasks
+ * task: function called once per task index with the index of the worker
+ * data: parameter given to every call of task
+ */
+void run_pool(pool_t *pool, int tasks, task_ft task, void *data)
+{
+    long long begin;
+    long long end;
+
+    pool->task = task;
+    pool->data = data;
+    for (int i = 0; i < pool->threads; i += 1) {
+        begin = (long long)tasks * i / pool->threads;
+        end = (long long)tasks * (i + 1) / pool->threads;
+        atomic_store(&pool->workers[i].range, pack_range(begin, end));
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->running = pool->threads - 1;
+    pool->generation += 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    work(pool, 0);
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* FUNCTION: free_pool
+ * --------------------------------------
+ * stops and joins the threads of a pool
+ *
+ * pool: pool to free
+ */
+void free_pool(pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->threads; i += 1)
+        pthread_join(pool->workers[i].thread, NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool->workers);
+    memset(pool, 0, sizeof(pool_t));
+}
@@ -1,109 +1,288 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <math.h>
+#include <string.h>
+#include <time.h>
 
 #include "simulation.h"
 
 #include <stdio.h>
 
+/* FUNCTION: next_random
+ * --------------------------------------
+ * draws a number from a splitmix64 generator
+ *
+ * state: state of the generator, advanced by this call
+ *
+ * returns: a uniform 64-bit number
+ */
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
 /* FUNCTION: init_bodies
- * --------------------------------
- * initiates all the bodies in the universe
+ * --------------------------------------
+ * initiates all the bodies in the universe, from a generator of their own
+ * so that simulations started in the same process do not share a state
  *
+ * particles: store receiving the bodies
  * n: number of bodies to include (at random position with random mass) in the
  * universe
+ * seed: seed of the generator, the same seed giving the same bodies
+ */
+void init_bodies(particles_t *particles, int n, uint64_t seed)
+{
+    init_particles(particles, n);
+    for (int i = 0; i < n; i += 1) {
+        float mass = next_random(&seed) % 1000 + 100;
+        float x = (float)(next_random(&seed) % GALAXY_SIZE);
+        float y = (float)(next_random(&seed) % GALAXY_SIZE);
+        float z = (float)(next_random(&seed) % GALAXY_SIZE);
+
+        add_particle(particles, x, y, z, mass);
+    }
+}
+
+/* FUNCTION: get_time
+ * --------------------------------------
+ * returns: a monotonic time in milliseconds
+ */
+static double get_time(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec * 1e-6;
+}
+
+/* FUNCTION: report_levels
+ * --------------------------------------
+ * displays the number of bodies at each time step level and the number of
+ * accelerations computed by the substeps of a step
  *
- * returns: a simple linked list of bodies_t containing all the created bodies
+ * particles: store of all the bodies, with their levels
+ * levels: number of levels
+ * evaluated: number of accelerations computed by the substeps
  */
-static bodies_t *init_bodies(int n)
+static void report_levels(particles_t *particles, int levels,
+                          uint64_t evaluated)
 {
-    bodies_t *head = (bodies_t *)calloc(sizeof(bodies_t), 1);
-    bodies_t *tail = head;
-
-    do {
-        tail->body = (body_t *)calloc(sizeof(body_t), 1);
-        tail->body->weight = rand() % 1000 + 100;
-        tail->body->x = (float)(rand() % GALAXY_SIZE);
-        tail->body->y = (float)(rand() % GALAXY_SIZE);
-        tail->body->z = (float)(rand() % GALAXY_SIZE);
-        if (n) {
-            tail->next = (bodies_t *)calloc(sizeof(bodies_t), 1);
-            tail = tail->next;
-        }
-    } while (n--);
-    return head;
+    int *counts = (int *)calloc(levels, sizeof(int));
+
+    if (counts == NULL)
+        exit(1);
+    FOREACH_PARTICLE(particles, i)
+        counts[particles->level[i]] += 1;
+    printf("\tlevels:");
+    for (int level = 0; level < levels; level += 1)
+        if (counts[level] > 0)
+            printf(" %d:%d", level, counts[level]);
+    printf(", %lu accelerations (%.2f per body, %d with a shared step)\n",
+           (unsigned long)evaluated,
+           particles->count ? (double)evaluated / particles->count : 0,
+           1 << (levels - 1));
+    free(counts);
 }
 
-/* FUNCTION: clean_bodies
+/* FUNCTION: report_accuracy
  * --------------------------------------
- * cleans all bodies in bodies_t linked list
+ * checks the accelerations of the sampled bodies against a direct summation
+ * and displays the errors, the energy and momentum drifts and the time of the
+ * check
  *
- * bodies: list of bodies to cleanup
+ * validation: validation with its sample drawn
+ * particles: store of all the bodies, with synchronized velocities
+ * pool: threads of the simulation
+ * step: number of steps done
  */
-static void clean_bodies(bodies_t *body)
+static void report_accuracy(validation_t *validation, particles_t *particles,
+                            pool_t *pool, int step)
 {
-    if (body->next)
-        clean_bodies(body->next);
-    free(body->body);
-    free(body);
+    accuracy_t accuracy;
+    double start = get_time();
+
+    validate_forces(validation, particles, pool, &accuracy);
+    printf("validation at step %d (%d bodies, %.3f ms): force error median "
+           "%.2e, p90 %.2e, p99 %.2e, max %.2e, energy drift %.2e, momentum "
+           "drift %.2e\n", step, validation->sample_count, get_time() - start,
+           accuracy.error[0], accuracy.error[1], accuracy.error[2],
+           accuracy.error[3], accuracy.energy_drift, accuracy.momentum_drift);
 }
 
-/* FUNCTION: log
+#ifdef STATS
+/* FUNCTION: report_stats
  * --------------------------------------
- * display the octree with the following format :
- *      * P for a parent node
- *      * C for a child node
- *      * . for an empty child
- * displays line per line and then indent for each
- * parent node
+ * displays the counters of the tree walk of the last step, the depth
+ * histogram of the bodies and the load imbalance of the threads
  *
- * bodies: list of bodies to cleanup
+ * forces: force engine, after run_forces
+ * tree: octree of the last force phase
  */
-static void log_tree(oct_node_t *tree, int n)
+static void report_stats(const forces_t *forces, const octree_t *tree)
 {
-    for (int i = 0; i < n; i += 1)
-        printf("\t");
-    for (int i = 0; i < 8; i += 1) {
-        if (tree->child[i] == NULL)
-            printf(" . ");
-        else if (tree->child[i]->type == PARENT)
-            printf(" P ");
-        else
-            printf(" C ");
-    }
-        printf("\n");
-    for (int i = 0; i < 8; i += 1) {
-        if (tree->child[i] && tree->child[i]->type == PARENT) {
-            log_tree(tree->child[i], n + 1);
-        }
-    }
+    stats_t stats;
+
+    get_stats(forces, tree, &stats);
+    printf("\tstats: %lu tests, %lu openings, %lu rejections, %lu leaf "
+           "interactions, %lu node interactions, %.1f tests per walk\n",
+           (unsigned long)stats.total.tests, (unsigned long)stats.total.openings,
+           (unsigned long)stats.total.rejections,
+           (unsigned long)stats.total.leaf_interactions,
+           (unsigned long)stats.total.node_interactions,
+           stats.total.walks ? (double)stats.total.tests / stats.total.walks : 0);
+    printf("\tthreads: %d, busy %.3f ms mean, %.3f ms max, imbalance %.2f\n",
+           stats.threads, stats.total.busy, stats.busy_max, stats.imbalance);
+    printf("\tdepths (max %d):", stats.depth);
+    for (int depth = 0; depth <= stats.depth; depth += 1)
+        if (stats.depths[depth] > 0)
+            printf(" %d:%lu", depth, (unsigned long)stats.depths[depth]);
+    printf("\n");
 }
+#endif
 
 /* FUNCTION: run_simulation
  * --------------------------------------
  * rules all the step of the simulation
- *      *  initialization of bodies
- *      *  main loop :
- *          *  create octree
- *          *  make the calculation and update the bodies
- *          *  display
- *          *  clean the octree
+ *      *  initialization of bodies, or loading of a snapshot
+ *      *  set up of the simulation (see init_simulation)
+ *      *  main loop, up to config->steps:
+ *          *  move the bodies by a step (see bh_step_simulation)
+ *          *  display the time spent in each phase, and the counters of
+ *             the step when compiled with STATS
+ *          *  write a checkpoint every config->checkpoint_every steps
+ *          *  queue a trajectory frame every config->trajectory_every
+ *             steps, written in the background
+ *          *  check the accelerations against a direct summation every
+ *             config->validate_every steps (config->validate > 0)
  *      *  clean all
  *
- * n: number of bodies to include (at random position
- * with random weight) in the universe
+ * a run loading a checkpoint resumes from the step it was written at
+ *
+ * config: parameters of the simulation, config->n bodies are included (at
+ * random position with random weight) in the universe unless a snapshot is
+ * loaded
+ */
+void run_simulation(const config_t *config)
+{
+    particles_t particles;
+    snapshot_header_t header = {0};
+    writer_t writer;
+    validation_t validation;
+    simulation_t simulation;
+    step_stats_t *stats = &simulation.stats;
+    bool validating = config->validate > 0;
+
+    if (config->load == NULL) {
+        init_bodies(&particles, config->n, 0);
+    } else if (!load_snapshot(&particles, config->load, &header)) {
+        fprintf(stderr, "%s is not a valid snapshot\n", config->load);
+        return;
+    } else {
+        printf("loaded %d bodies at step %lu\n", particles.count,
+               (unsigned long)header.step);
+    }
+    if (!init_simulation(&simulation, config, &particles)) {
+        fprintf(stderr, "the force kernel is not supported by this CPU\n");
+        free_particles(&particles);
+        return;
+    }
+    printf("force kernel: %s\n", simulation.forces.kernel->name);
+    if (config->trajectory != NULL
+        && !init_writer(&writer, config->trajectory, config->encoding)) {
+        fprintf(stderr, "cannot create %s\n", config->trajectory);
+        free_simulation(&simulation);
+        return;
+    }
+    stats->step = header.step;
+    stats->time = header.time;
+    if (validating
+        && !init_validation(&validation, config, &simulation.particles)) {
+        fprintf(stderr, "cannot validate the accelerations of these bodies\n");
+        validating = false;
+    }
+    if (validating)
+        report_accuracy(&validation, &simulation.particles, &simulation.pool,
+                        (int)header.step);
+    for (int i = (int)header.step; i < config->steps; i += 1) {
+        bh_step_simulation(&simulation, config->dt);
+        printf("step %d: %s %.3f ms, gravity center %.3f ms, "
+               "forces %.3f ms, integration %.3f ms\n", i,
+               stats->rebuilt ? "build" : "refit", stats->times[0],
+               stats->times[1], stats->times[2], stats->times[3]);
+        if (config->levels > 1)
+            report_levels(&simulation.particles, config->levels,
+                          stats->evaluated);
+        STAT(report_stats(&simulation.forces, &simulation.tree));
+        if (config->checkpoint != NULL
+            && (i + 1) % config->checkpoint_every == 0
+            && !save_snapshot(&simulation.particles, config->checkpoint,
+                              stats->step, stats->time))
+            fprintf(stderr, "cannot write %s\n", config->checkpoint);
+        if (config->trajectory != NULL
+            && (i + 1) % config->trajectory_every == 0)
+            push_frame(&writer, &simulation.particles, stats->step,
+                       stats->time);
+        if (validating && (i + 1) % config->validate_every == 0)
+            report_accuracy(&validation, &simulation.particles,
+                            &simulation.pool, i + 1);
+    }
+    if (validating)
+        free_validation(&validation);
+    if (config->trajectory != NULL && !free_writer(&writer))
+        fprintf(stderr, "cannot write %s\n", config->trajectory);
+    free_simulation(&simulation);
+}
+
+/* FUNCTION: run_benchmark
+ * --------------------------------------
+ * runs config->steps steps on config->n random bodies without any output,
+ * measuring each phase of the steps (the initial accelerations, which warm
+ * up the arenas and the threads, are not measured), and the error of the
+ * accelerations of the last step against a direct summation on
+ * config->validate bodies
+ *
+ * config: parameters of the simulation
+ * bench: output, mean measures of a step
  */
-void run_simulation(int n)
+void run_benchmark(const config_t *config, bench_t *bench)
 {
-    bodies_t *bodies = init_bodies(n);
-    oct_node_t *tree;
-
-    for (int i = 0; i < 10; i += 1) {
-        tree = create_octree(bodies);
-        calculate_nodes_gravity_center(tree);
-        run_forces(oct_node_t *tree);
-        clean_tree(tree);
+    particles_t particles;
+    simulation_t simulation;
+    validation_t validation;
+    accuracy_t accuracy;
+
+    memset(bench, 0, sizeof(bench_t));
+    init_bodies(&particles, config->n, 0);
+    if (!init_simulation(&simulation, config, &particles)) {
+        free_particles(&particles);
+        return;
+    }
+    for (int i = 0; i < config->steps; i += 1) {
+        bh_step_simulation(&simulation, config->dt);
+        for (int phase = 0; phase < 4; phase += 1)
+            bench->times[phase] += simulation.stats.times[phase];
+        bench->interactions += simulation.stats.interactions;
+        bench->visited += (double)simulation.stats.visited
+                          / simulation.particles.count;
+    }
+    if (config->steps > 0) {
+        for (int phase = 0; phase < 4; phase += 1)
+            bench->times[phase] /= config->steps;
+        bench->interactions /= config->steps;
+        bench->visited /= config->steps;
+    }
+    if (config->validate > 0
+        && init_validation(&validation, config, &simulation.particles)) {
+        validate_forces(&validation, &simulation.particles, &simulation.pool,
+                        &accuracy);
+        for (int k = 0; k < 4; k += 1)
+            bench->error[k] = accuracy.error[k];
+        free_validation(&validation);
     }
-    clean_bodies(bodies);
-    bodies = NULL;
+    free_simulation(&simulation);
 }
@@ -0,0 +1,204 @@
+#include "simulation.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char SNAPSHOT_MAGIC[8] = "BHSNAP";
+
+_Static_assert(sizeof(snapshot_header_t) == SNAPSHOT_ALIGNMENT,
+               "the snapshot header must keep the arrays aligned");
+
+// number of arrays following the header, see snapshot_header_t
+#define SNAPSHOT_ARRAYS 8
+
+/* FUNCTION: get_array_size
+ * --------------------------------------
+ * gets the size of an array of a snapshot, padding included
+ *
+ * count: number of bodies in the snapshot
+ *
+ * returns: the size in bytes
+ */
+static size_t get_array_size(uint64_t count)
+{
+    size_t size = sizeof(float) * count;
+
+    return (size + SNAPSHOT_ALIGNMENT - 1) & ~(size_t)(SNAPSHOT_ALIGNMENT - 1);
+}
+
+/* FUNCTION: check_identities
+ * --------------------------------------
+ * checks that the identities of a snapshot are a permutation of 0 to
+ * count - 1, as the validation indexes its arrays by identity
+ *
+ * id: identities of the bodies
+ * count: number of bodies
+ *
+ * returns: false if an identity is out of range or repeated
+ */
+static bool check_identities(const int *id, int count)
+{
+    bool *seen = (bool *)calloc(count + 1, sizeof(bool));
+    bool ok = true;
+
+    if (seen == NULL)
+        exit(1);
+    for (int i = 0; ok && i < count; i += 1) {
+        ok = id[i] >= 0 && id[i] < count && !seen[id[i]];
+        if (ok)
+            seen[id[i]] = true;
+    }
+    free(seen);
+    return ok;
+}
+
+/* FUNCTION: load_snapshot
+ * --------------------------------------
+ * loads the bodies of a snapshot file in a particle store without parsing
+ * or copying them: the file is mapped privately and the store uses the
+ * arrays of the mapping (see attach_particles), the kernel reading the
+ * pages ahead as the bodies are first used
+ *
+ * particles: store to initialize with the bodies of the snapshot
+ * path: path of the snapshot file
+ * header: output, header of the snapshot
+ *
+ * returns: false if the file cannot be read or is not a valid snapshot, its
+ * sizes not fitting the file, its identities not being a permutation or
+ * its bodies being invalid (see check_particles)
+ */
+bool load_snapshot(particles_t *particles, const char *path,
+                   snapshot_header_t *header)
+{
+    void *arrays[SNAPSHOT_ARRAYS];
+    struct stat info;
+    size_t array_size;
+    char *mapping;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(snapshot_header_t)) {
+        close(fd);
+        return false;
+    }
+    mapping = (char *)mmap(NULL, info.st_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+    memcpy(header, mapping, sizeof(snapshot_header_t));
+    array_size = get_array_size(header->count);
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC))
+        || header->version != SNAPSHOT_VERSION
+        || header->header_size < sizeof(snapshot_header_t)
+        || header->header_size % SNAPSHOT_ALIGNMENT
+        || header->count > INT_MAX
+        || header->header_size > (size_t)info.st_size
+        || ((size_t)info.st_size - header->header_size) / SNAPSHOT_ARRAYS
+           < array_size) {
+        munmap(mapping, info.st_size);
+        return false;
+    }
+    madvise(mapping, info.st_size, MADV_WILLNEED);
+    for (int i = 0; i < SNAPSHOT_ARRAYS; i += 1)
+        arrays[i] = mapping + header->header_size + i * array_size;
+    if (!check_identities((const int *)arrays[0], (int)header->count)) {
+        munmap(mapping, info.st_size);
+        return false;
+    }
+    attach_particles(particles, mapping, info.st_size, (int)header->count,
+                     arrays);
+    if (!check_particles(particles)) {
+        free_particles(particles);
+        return false;
+    }
+    return true;
+}
+
+/* FUNCTION: write_all
+ * --------------------------------------
+ * writes a buffer to a file, retrying partial writes (shared with the
+ * trajectory writer)
+ *
+ * fd: file descriptor
+ * buffer: bytes to write
+ * size: number of bytes
+ *
+ * returns: false on error
+ */
+bool write_all(int fd, const void *buffer, size_t size)
+{
+    const char *bytes = (const char *)buffer;
+    ssize_t written;
+
+    while (size > 0) {
+        written = write(fd, bytes, size);
+        if (written < 0)
+            return false;
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+/* FUNCTION: save_snapshot
+ * --------------------------------------
+ * writes the bodies of a particle store to a snapshot file atomically: the
+ * snapshot is written and synced to path.tmp, then renamed over path, so
+ * path always holds a complete snapshot even if the run is killed
+ *
+ * particles: store of the bodies
+ * path: path of the snapshot file
+ * step: number of steps done
+ * time: simulated time
+ *
+ * returns: false if the file cannot be written
+ */
+bool save_snapshot(particles_t *particles, const char *path, uint64_t step,
+                   double time)
+{
+    const void *arrays[SNAPSHOT_ARRAYS] = {
+        particles->id, particles->x, particles->y, particles->z,
+        particles->mass, particles->vx, particles->vy, particles->vz,
+    };
+    static const char padding[SNAPSHOT_ALIGNMENT];
+    size_t size = sizeof(float) * particles->count;
+    snapshot_header_t header;
+    char *tmp;
+    bool ok;
+    int fd;
+
+    memset(&header, 0, sizeof(snapshot_header_t));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.header_size = sizeof(snapshot_header_t);
+    header.count = particles->count;
+    header.step = step;
+    header.time = time;
+    tmp = (char *)malloc(strlen(path) + 5);
+    if (tmp == NULL)
+        exit(1);
+    sprintf(tmp, "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok = fd >= 0 && write_all(fd, &header, sizeof(snapshot_header_t));
+    for (int i = 0; ok && i < SNAPSHOT_ARRAYS; i += 1) {
+        ok = write_all(fd, arrays[i], size)
+             && write_all(fd, padding, get_array_size(particles->count) - size);
+    }
+    ok = ok && fsync(fd) == 0;
+    if (fd >= 0)
+        ok = close(fd) == 0 && ok;
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok)
+        unlink(tmp);
+    free(tmp);
+    return ok;
+}
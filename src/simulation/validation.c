@@ -0,0 +1,288 @@
+#include "simulation.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/*
+ * the validation computes the exact accelerations of a sample of the bodies
+ * by direct summation over all of them, and compares them to the ones left
+ * by run_forces in the particle store
+ *
+ * the summation is blocked: a task takes TARGETS_PER_TASK sampled bodies and
+ * runs the force kernel on SOURCES_PER_BLOCK bodies at a time, which stay in
+ * cache while the targets of the task go through them; the potential of the
+ * targets is summed on the same block, the energy being estimated from the
+ * sampled bodies (and exact when all of them are sampled)
+ *
+ * the identities of the bodies are expected to be a permutation of 0 to
+ * count - 1, as given by add_particle and checked by load_snapshot, and
+ * init_validation refuses a store with an identity out of that range
+ */
+
+// a validation task works on TARGETS_PER_TASK sampled bodies
+static const int TARGETS_PER_TASK = 64;
+
+// sources going through the kernel at once, a multiple of
+// INTERACTIONS_ALIGNMENT (64 KiB of positions and masses)
+static const int SOURCES_PER_BLOCK = 4096;
+
+/* FUNCTION: init_validation
+ * --------------------------------------
+ * draws the sampled bodies and allocates the buffers of the direct summation
+ *
+ * validation: validation to initialize
+ * config: parameters of the simulation, config->validate bodies are
+ * sampled (all of them if there are fewer)
+ * particles: store of all the bodies
+ *
+ * returns: false if the processor cannot run the configured kernel or if
+ * an identity of the bodies is out of 0 to count - 1
+ */
+bool init_validation(validation_t *validation, const config_t *config,
+                     particles_t *particles)
+{
+    int padded = (particles->count + INTERACTIONS_ALIGNMENT - 1)
+                 / INTERACTIONS_ALIGNMENT * INTERACTIONS_ALIGNMENT;
+    float **arrays[4] = {&validation->sources.x, &validation->sources.y,
+                         &validation->sources.z, &validation->sources.mass};
+    uint64_t state = 0x9e3779b97f4a7c15;
+    int *order;
+    int swap;
+    int j;
+
+    memset(validation, 0, sizeof(validation_t));
+    validation->kernel = get_kernel(config->kernel);
+    if (validation->kernel == NULL)
+        return false;
+    FOREACH_PARTICLE(particles, i)
+        if (particles->id[i] < 0 || particles->id[i] >= particles->count)
+            return false;
+    validation->softening = config->softening;
+    validation->sample_count = config->validate < particles->count
+                               ? config->validate : particles->count;
+    // partial Fisher-Yates shuffle, with its own fixed seed so that every
+    // run checks the same sample of bodies
+    order = (int *)malloc(sizeof(int) * (particles->count + 1));
+    validation->sample = (int *)malloc(sizeof(int) * (validation->sample_count + 1));
+    validation->index = (int *)malloc(sizeof(int) * (particles->count + 1));
+    validation->potential = (double *)malloc(sizeof(double)
+                                             * (validation->sample_count + 1));
+    validation->error = (float *)malloc(sizeof(float)
+                                        * (validation->sample_count + 1));
+    if (order == NULL || validation->sample == NULL || validation->index == NULL
+        || validation->potential == NULL || validation->error == NULL)
+        exit(1);
+    FOREACH_PARTICLE(particles, i)
+        order[i] = i;
+    for (int i = 0; i < validation->sample_count; i += 1) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        j = i + (int)(state % (uint64_t)(particles->count - i));
+        swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+        validation->sample[i] = particles->id[order[i]];
+    }
+    free(order);
+    for (int i = 0; i < 4; i += 1) {
+        *arrays[i] = (float *)aligned_alloc(64, sizeof(float)
+                                            * (padded + INTERACTIONS_ALIGNMENT));
+        if (*arrays[i] == NULL)
+            exit(1);
+    }
+    validation->sources.count = padded;
+    validation->sources.capacity = padded;
+    init_particles(&validation->targets, validation->sample_count);
+    validation->targets.count = validation->sample_count;
+    return true;
+}
+
+/* FUNCTION: direct_task
+ * --------------------------------------
+ * computes the accelerations and potentials of TARGETS_PER_TASK sampled
+ * bodies from all the bodies, one block of sources at a time
+ *
+ * data: validation
+ * task: index of the first target divided by TARGETS_PER_TASK
+ * thread: unused, each task only writes its own targets
+ */
+static void direct_task(void *data, int task, int thread)
+{
+    validation_t *validation = (validation_t *)data;
+    const interactions_t *sources = &validation->sources;
+    particles_t *targets = &validation->targets;
+    float eps2 = validation->softening * validation->softening;
+    interactions_t block = {0};
+    int first = task * TARGETS_PER_TASK;
+    int last = first + TARGETS_PER_TASK;
+    float potential;
+    float dx;
+    float dy;
+    float dz;
+    float r2;
+
+    (void)thread;
+    if (last > targets->count)
+        last = targets->count;
+    for (int i = first; i < last; i += 1) {
+        targets->ax[i] = 0;
+        targets->ay[i] = 0;
+        targets->az[i] = 0;
+        validation->potential[i] = 0;
+    }
+    for (int start = 0; start < sources->count; start += SOURCES_PER_BLOCK) {
+        block.x = sources->x + start;
+        block.y = sources->y + start;
+        block.z = sources->z + start;
+        block.mass = sources->mass + start;
+        block.count = sources->count - start < SOURCES_PER_BLOCK
+                      ? sources->count - start : SOURCES_PER_BLOCK;
+        validation->kernel->run(&block, targets, first, last, eps2);
+        for (int i = first; i < last; i += 1) {
+            potential = 0;
+            for (int j = 0; j < block.count; j += 1) {
+                dx = block.x[j] - targets->x[i];
+                dy = block.y[j] - targets->y[i];
+                dz = block.z[j] - targets->z[i];
+                r2 = dx * dx + dy * dy + dz * dz;
+                // the target itself and coincident bodies are skipped, as
+                // by the kernels
+                potential += r2 > 0 ? block.mass[j] / sqrtf(r2 + eps2) : 0;
+            }
+            validation->potential[i] += potential;
+        }
+    }
+}
+
+/* FUNCTION: compare_errors
+ * --------------------------------------
+ * orders two relative errors for qsort
+ */
+static int compare_errors(const void *a, const void *b)
+{
+    float error_a = *(const float *)a;
+    float error_b = *(const float *)b;
+
+    return (error_a > error_b) - (error_a < error_b);
+}
+
+/* FUNCTION: validate_forces
+ * --------------------------------------
+ * compares the accelerations computed by run_forces with a direct summation
+ * on the sampled bodies, and measures the drift of the energy and momentum
+ * since the first call
+ *
+ * validation: validation with its sample drawn
+ * particles: store of all the bodies, with synchronized velocities and the
+ * accelerations of the current positions
+ * pool: threads running the direct summation
+ * accuracy: output, errors and drifts
+ */
+void validate_forces(validation_t *validation, particles_t *particles,
+                     pool_t *pool, accuracy_t *accuracy)
+{
+    particles_t *targets = &validation->targets;
+    interactions_t *sources = &validation->sources;
+    double potential = 0;
+    double kinetic = 0;
+    double momentum[3] = {0, 0, 0};
+    double scale = 0;
+    double speed2;
+    float exact;
+    float dx;
+    float dy;
+    float dz;
+    int body;
+
+    FOREACH_PARTICLE(particles, i) {
+        validation->index[particles->id[i]] = i;
+        sources->x[i] = particles->x[i];
+        sources->y[i] = particles->y[i];
+        sources->z[i] = particles->z[i];
+        sources->mass[i] = particles->mass[i];
+        speed2 = (double)particles->vx[i] * particles->vx[i]
+                 + (double)particles->vy[i] * particles->vy[i]
+                 + (double)particles->vz[i] * particles->vz[i];
+        kinetic += 0.5 * particles->mass[i] * speed2;
+        momentum[X] += (double)particles->mass[i] * particles->vx[i];
+        momentum[Y] += (double)particles->mass[i] * particles->vy[i];
+        momentum[Z] += (double)particles->mass[i] * particles->vz[i];
+        scale += particles->mass[i] * sqrt(speed2);
+    }
+    for (int i = particles->count; i < sources->count; i += 1) {
+        sources->x[i] = 0;
+        sources->y[i] = 0;
+        sources->z[i] = 0;
+        sources->mass[i] = 0;
+    }
+    for (int i = 0; i < targets->count; i += 1) {
+        body = validation->index[validation->sample[i]];
+        targets->x[i] = particles->x[body];
+        targets->y[i] = particles->y[body];
+        targets->z[i] = particles->z[body];
+        targets->mass[i] = particles->mass[body];
+    }
+    run_pool(pool, (targets->count + TARGETS_PER_TASK - 1) / TARGETS_PER_TASK,
+             direct_task, validation);
+    for (int i = 0; i < targets->count; i += 1) {
+        body = validation->index[validation->sample[i]];
+        dx = particles->ax[body] - targets->ax[i];
+        dy = particles->ay[body] - targets->ay[i];
+        dz = particles->az[body] - targets->az[i];
+        exact = sqrtf(targets->ax[i] * targets->ax[i] + targets->ay[i]
+                      * targets->ay[i] + targets->az[i] * targets->az[i]);
+        validation->error[i] = exact > 0 ? sqrtf(dx * dx + dy * dy + dz * dz)
+                                           / exact : 0;
+        potential += (double)targets->mass[i] * validation->potential[i];
+    }
+    // each pair is counted twice over all the bodies, and the sample stands
+    // for count / sample_count times as many bodies
+    if (targets->count > 0)
+        potential *= -0.5 * GRAVITATIONAL_CONSTANT * particles->count
+                     / targets->count;
+    qsort(validation->error, targets->count, sizeof(float), compare_errors);
+    memset(accuracy, 0, sizeof(accuracy_t));
+    if (targets->count > 0) {
+        accuracy->error[0] = validation->error[(targets->count - 1) / 2];
+        accuracy->error[1] = validation->error[(targets->count - 1) * 90 / 100];
+        accuracy->error[2] = validation->error[(targets->count - 1) * 99 / 100];
+        accuracy->error[3] = validation->error[targets->count - 1];
+    }
+    accuracy->energy = kinetic + potential;
+    if (!validation->started) {
+        validation->started = true;
+        validation->energy = accuracy->energy;
+        memcpy(validation->momentum, momentum, sizeof(momentum));
+    }
+    if (validation->energy != 0)
+        accuracy->energy_drift = (accuracy->energy - validation->energy)
+                                 / fabs(validation->energy);
+    if (scale > 0)
+        accuracy->momentum_drift = sqrt(
+            (momentum[X] - validation->momentum[X]) * (momentum[X] - validation->momentum[X])
+            + (momentum[Y] - validation->momentum[Y]) * (momentum[Y] - validation->momentum[Y])
+            + (momentum[Z] - validation->momentum[Z]) * (momentum[Z] - validation->momentum[Z]))
+            / scale;
+}
+
+/* FUNCTION: free_validation
+ * --------------------------------------
+ * releases the buffers of a validation
+ *
+ * validation: validation to free
+ */
+void free_validation(validation_t *validation)
+{
+    free(validation->sample);
+    free(validation->index);
+    free(validation->potential);
+    free(validation->error);
+    free(validation->sources.x);
+    free(validation->sources.y);
+    free(validation->sources.z);
+    free(validation->sources.mass);
+    free_particles(&validation->targets);
+    memset(validation, 0, sizeof(validation_t));
+}
@@ -0,0 +1,321 @@
+#include "simulation.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * the trajectory is written by a background I/O thread: at the end of a step
+ * the simulation copies the positions into a staging frame and queues it,
+ * the I/O thread encodes and writes it while the simulation goes on with the
+ * next steps in the other frame; the simulation only waits when the frame
+ * it queued last is still queued, the I/O thread being a whole frame behind
+ */
+
+static const char FRAME_MAGIC[8] = "BHFRAME";
+
+_Static_assert(sizeof(frame_header_t) == SNAPSHOT_ALIGNMENT,
+               "the frame header must keep the arrays aligned");
+
+static const char *ENCODING_NAMES[] = {
+    [BH_ENCODING_FLOAT32] = "float32",
+    [BH_ENCODING_FLOAT16] = "float16",
+    [BH_ENCODING_QUANTIZED] = "quantized",
+};
+
+/* FUNCTION: find_encoding
+ * --------------------------------------
+ * gets a position encoding from its name
+ *
+ * name: name of the encoding
+ * encoding: output, the encoding
+ *
+ * returns: false if no encoding has this name
+ */
+bool find_encoding(const char *name, bh_encoding_et *encoding)
+{
+    for (size_t i = 0; i < sizeof(ENCODING_NAMES) / sizeof(ENCODING_NAMES[0]);
+         i += 1) {
+        if (!strcmp(ENCODING_NAMES[i], name)) {
+            *encoding = (bh_encoding_et)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* FUNCTION: float_to_half
+ * --------------------------------------
+ * converts a float to an IEEE 754 half float, rounding to the nearest even
+ *
+ * value: float to convert
+ *
+ * returns: the bits of the half float
+ */
+static uint16_t float_to_half(float value)
+{
+    uint32_t bits;
+    uint32_t sign;
+    uint32_t mantissa;
+    uint32_t remainder;
+    uint32_t halfway;
+    uint32_t half;
+    int exponent;
+    int shift;
+
+    memcpy(&bits, &value, sizeof(float));
+    sign = (bits >> 16) & 0x8000;
+    mantissa = bits & 0x7fffff;
+    if (((bits >> 23) & 0xff) == 0xff)
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+    if (exponent >= 31)
+        return sign | 0x7c00;
+    if (exponent <= 0) {
+        // subnormal half, the hidden bit becomes explicit
+        if (exponent < -10)
+            return sign;
+        mantissa |= 0x800000;
+        shift = 14 - exponent;
+        half = mantissa >> shift;
+        remainder = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    } else {
+        half = (uint32_t)exponent << 10 | mantissa >> 13;
+        remainder = mantissa & 0x1fff;
+        halfway = 0x1000;
+    }
+    // a carry out of the mantissa correctly increments the exponent
+    if (remainder > halfway || (remainder == halfway && (half & 1)))
+        half += 1;
+    return sign | half;
+}
+
+/* FUNCTION: write_array
+ * --------------------------------------
+ * writes an array of a frame followed by its padding
+ *
+ * fd: file descriptor
+ * array: values to write
+ * size: size of the values in bytes
+ *
+ * returns: false on error
+ */
+static bool write_array(int fd, const void *array, size_t size)
+{
+    static const char padding[SNAPSHOT_ALIGNMENT];
+
+    return write_all(fd, array, size)
+           && write_all(fd, padding, (SNAPSHOT_ALIGNMENT - size % SNAPSHOT_ALIGNMENT)
+                                     % SNAPSHOT_ALIGNMENT);
+}
+
+/* FUNCTION: write_frame
+ * --------------------------------------
+ * encodes a staged frame and appends it to the trajectory, on the I/O thread
+ *
+ * writer: writer owning the frame
+ * frame: frame to write
+ *
+ * returns: false on error
+ */
+static bool write_frame(writer_t *writer, const frame_t *frame)
+{
+    frame_header_t header;
+    float max[3];
+    float scale;
+    bool ok;
+
+    memset(&header, 0, sizeof(frame_header_t));
+    memcpy(header.magic, FRAME_MAGIC, sizeof(FRAME_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.encoding = writer->encoding;
+    header.count = frame->count;
+    header.step = frame->step;
+    header.time = frame->time;
+    if (writer->encoding == BH_ENCODING_QUANTIZED) {
+        for (int axis = 0; axis < 3; axis += 1) {
+            header.min[axis] = INFINITY;
+            max[axis] = -INFINITY;
+            for (int i = 0; i < frame->count; i += 1) {
+                header.min[axis] = fminf(header.min[axis], frame->position[axis][i]);
+                max[axis] = fmaxf(max[axis], frame->position[axis][i]);
+            }
+            header.size = fmaxf(header.size, max[axis] - header.min[axis]);
+        }
+    }
+    ok = write_all(writer->fd, &header, sizeof(frame_header_t))
+         && write_array(writer->fd, frame->id, sizeof(int) * frame->count);
+    for (int axis = 0; ok && axis < 3; axis += 1) {
+        if (writer->encoding == BH_ENCODING_FLOAT32) {
+            ok = write_array(writer->fd, frame->position[axis],
+                             sizeof(float) * frame->count);
+            continue;
+        }
+        scale = header.size > 0 ? 65535 / header.size : 0;
+        for (int i = 0; i < frame->count; i += 1) {
+            if (writer->encoding == BH_ENCODING_FLOAT16)
+                frame->encoded[i] = float_to_half(frame->position[axis][i]);
+            else
+                frame->encoded[i] = (uint16_t)fminf(lrintf(
+                    (frame->position[axis][i] - header.min[axis]) * scale), 65535);
+        }
+        ok = write_array(writer->fd, frame->encoded,
+                         sizeof(uint16_t) * frame->count);
+    }
+    return ok;
+}
+
+/* FUNCTION: writer_main
+ * --------------------------------------
+ * loop of the I/O thread: takes the queued frames and writes them until the
+ * writer is stopped, the last queued frame being written before exiting
+ *
+ * data: writer
+ *
+ * returns: NULL
+ */
+static void *writer_main(void *data)
+{
+    writer_t *writer = (writer_t *)data;
+    bool ok;
+
+    pthread_mutex_lock(&writer->lock);
+    while (true) {
+        while (writer->queued < 0 && !writer->stop)
+            pthread_cond_wait(&writer->changed, &writer->lock);
+        if (writer->queued < 0)
+            break;
+        writer->writing = writer->queued;
+        writer->queued = -1;
+        pthread_cond_broadcast(&writer->changed);
+        pthread_mutex_unlock(&writer->lock);
+        ok = write_frame(writer, &writer->frames[writer->writing]);
+        pthread_mutex_lock(&writer->lock);
+        writer->failed = writer->failed || !ok;
+        writer->writing = -1;
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+/* FUNCTION: init_writer
+ * --------------------------------------
+ * creates the trajectory file and starts the I/O thread writing it
+ *
+ * writer: writer to initialize
+ * path: path of the trajectory file, truncated
+ * encoding: encoding of the positions
+ *
+ * returns: false if the file cannot be created
+ */
+bool init_writer(writer_t *writer, const char *path, bh_encoding_et encoding)
+{
+    memset(writer, 0, sizeof(writer_t));
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer->fd < 0)
+        return false;
+    writer->encoding = encoding;
+    writer->queued = -1;
+    writer->writing = -1;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->changed, NULL);
+    if (pthread_create(&writer->thread, NULL, writer_main, writer))
+        exit(1);
+    return true;
+}
+
+/* FUNCTION: stage_frame
+ * --------------------------------------
+ * copies the bodies of a particle store to a staging frame
+ *
+ * frame: frame to fill, not used by the I/O thread
+ * particles: store of the bodies
+ * step: number of steps done
+ * time: simulated time
+ */
+static void stage_frame(frame_t *frame, particles_t *particles, uint64_t step,
+                        double time)
+{
+    if (particles->count > frame->capacity) {
+        frame->capacity = particles->count;
+        frame->id = (int *)realloc(frame->id, sizeof(int) * frame->capacity);
+        frame->encoded = (uint16_t *)realloc(frame->encoded, sizeof(uint16_t)
+                                             * frame->capacity);
+        for (int axis = 0; axis < 3; axis += 1) {
+            frame->position[axis] = (float *)realloc(frame->position[axis],
+                                                     sizeof(float) * frame->capacity);
+            if (frame->position[axis] == NULL)
+                exit(1);
+        }
+        if (frame->id == NULL || frame->encoded == NULL)
+            exit(1);
+    }
+    frame->count = particles->count;
+    frame->step = step;
+    frame->time = time;
+    memcpy(frame->id, particles->id, sizeof(int) * particles->count);
+    memcpy(frame->position[X], particles->x, sizeof(float) * particles->count);
+    memcpy(frame->position[Y], particles->y, sizeof(float) * particles->count);
+    memcpy(frame->position[Z], particles->z, sizeof(float) * particles->count);
+}
+
+/* FUNCTION: push_frame
+ * --------------------------------------
+ * queues the current positions of the bodies for the I/O thread, waiting
+ * only if the frame queued before has not been taken yet
+ *
+ * writer: writer of the trajectory
+ * particles: store of the bodies
+ * step: number of steps done
+ * time: simulated time
+ */
+void push_frame(writer_t *writer, particles_t *particles, uint64_t step,
+                double time)
+{
+    int frame;
+
+    pthread_mutex_lock(&writer->lock);
+    while (writer->queued >= 0)
+        pthread_cond_wait(&writer->changed, &writer->lock);
+    frame = writer->writing == 0 ? 1 : 0;
+    pthread_mutex_unlock(&writer->lock);
+    stage_frame(&writer->frames[frame], particles, step, time);
+    pthread_mutex_lock(&writer->lock);
+    writer->queued = frame;
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+/* FUNCTION: free_writer
+ * --------------------------------------
+ * waits for the queued frames to be written, stops the I/O thread and
+ * closes the trajectory
+ *
+ * writer: writer to free
+ *
+ * returns: false if a frame could not be written
+ */
+bool free_writer(writer_t *writer)
+{
+    bool ok;
+
+    pthread_mutex_lock(&writer->lock);
+    writer->stop = true;
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+    ok = close(writer->fd) == 0 && !writer->failed;
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->changed);
+    for (int i = 0; i < 2; i += 1) {
+        free(writer->frames[i].id);
+        free(writer->frames[i].encoded);
+        for (int axis = 0; axis < 3; axis += 1)
+            free(writer->frames[i].position[axis]);
+    }
+    memset(writer, 0, sizeof(writer_t));
+    return ok;
+}
@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "barnes_hut.h"
+
+#include <GL/glut.h>
+
+// side of the cube holding the initial bodies, and of the view
+static const int VIEW_SIZE = 2000;
+
+// GLUT callbacks take no argument, the viewer shows this single simulation
+static bh_simulation_t *simulation;
+
+// time step of the viewed simulation
+static float dt;
+
+static void print_help(void)
+{
+    printf("USAGE:\n\t./barnes_hut_viewer n [options]\n\nPARAMETERS:\n\tn\t"
+           "number of bodies in the galaxy\n\nOPTIONS:\n"
+           "\t-t, --threads n\t\tnumber of threads (default: number of "
+           "online processors)\n"
+           "\t--dt dt\t\t\ttime step (default: 1)\n"
+           "\t--theta theta\t\topening angle, at most 1 with fmm "
+           "(default: 1)\n"
+           "\t--engine name\t\tforce engine: tree (default) or fmm\n\n"
+           "the bodies are projected on the xy plane, q or escape quits\n");
+}
+
+/* FUNCTION: parse_args
+ * --------------------------------------
+ * fills the configuration of the viewed simulation from the command line
+ *
+ * config: configuration to fill
+ * argc: number of arguments
+ * argv: arguments
+ *
+ * returns: false if the command line is invalid or asks for help
+ */
+static bool parse_args(bh_config_t *config, int argc, char **argv)
+{
+    bh_init_config(config);
+    config->n = -1;
+    for (int i = 1; i < argc; i += 1) {
+        if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help"))
+            return false;
+        if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--threads")) {
+            if (++i == argc || atoi(argv[i]) < 1)
+                return false;
+            config->threads = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "--dt")) {
+            if (++i == argc || atof(argv[i]) <= 0)
+                return false;
+            config->dt = atof(argv[i]);
+        } else if (!strcmp(argv[i], "--theta")) {
+            if (++i == argc || atof(argv[i]) <= 0)
+                return false;
+            config->theta = atof(argv[i]);
+        } else if (!strcmp(argv[i], "--engine")) {
+            if (++i == argc || (strcmp(argv[i], "tree")
+                                && strcmp(argv[i], "fmm")))
+                return false;
+            config->engine = strcmp(argv[i], "fmm") ? BH_ENGINE_TREE
+                                                    : BH_ENGINE_FMM;
+        } else if (config->n < 0) {
+            config->n = atoi(argv[i]);
+        } else {
+            return false;
+        }
+    }
+    return config->n >= 0
+           && (config->engine != BH_ENGINE_FMM || config->theta <= 1);
+}
+
+/* FUNCTION: display
+ * --------------------------------------
+ * draws the bodies of the simulation as points on the xy plane
+ */
+static void display(void)
+{
+    const bh_particles_t *particles = bh_get_particles(simulation);
+
+    glClear(GL_COLOR_BUFFER_BIT);
+    glBegin(GL_POINTS);
+    for (int i = 0; i < particles->count; i += 1)
+        glVertex2f(particles->x[i], particles->y[i]);
+    glEnd();
+    glutSwapBuffers();
+}
+
+/* FUNCTION: idle
+ * --------------------------------------
+ * moves the bodies by a step and shows the measures of the step in the
+ * title of the window
+ */
+static void idle(void)
+{
+    const bh_step_stats_t *stats = bh_get_stats(simulation);
+    char title[128];
+
+    bh_step_simulation(simulation, dt);
+    snprintf(title, sizeof(title), "barnes_hut: step %lu, %.1f ms",
+             (unsigned long)stats->step, stats->times[0] + stats->times[1]
+             + stats->times[2] + stats->times[3]);
+    glutSetWindowTitle(title);
+    glutPostRedisplay();
+}
+
+/* FUNCTION: keyboard
+ * --------------------------------------
+ * quits on q or escape
+ *
+ * key: pressed key
+ * x: unused
+ * y: unused
+ */
+static void keyboard(unsigned char key, int x, int y)
+{
+    (void)x;
+    (void)y;
+    if (key == 'q' || key == 27) {
+        bh_free_simulation(simulation);
+        exit(0);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    bh_config_t config;
+    float *positions;
+    float *masses;
+
+    glutInit(&argc, argv);
+    if (!parse_args(&config, argc, argv)) {
+        print_help();
+        return 0;
+    }
+    positions = (float *)malloc(sizeof(float) * 3 * (config.n + 1));
+    masses = (float *)malloc(sizeof(float) * (config.n + 1));
+    if (positions == NULL || masses == NULL)
+        return 1;
+    for (int i = 0; i < config.n; i += 1) {
+        masses[i] = rand() % 1000 + 100;
+        for (int axis = 0; axis < 3; axis += 1)
+            positions[3 * i + axis] = (float)(rand() % VIEW_SIZE);
+    }
+    simulation = bh_create_simulation(&config, config.n, positions, NULL,
+                                      masses);
+    free(positions);
+    free(masses);
+    if (simulation == NULL) {
+        fprintf(stderr, "the force kernel is not supported by this CPU\n");
+        return 1;
+    }
+    dt = config.dt;
+    glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB);
+    glutInitWindowSize(800, 800);
+    glutCreateWindow("barnes_hut");
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    gluOrtho2D(0, VIEW_SIZE, 0, VIEW_SIZE);
+    glutDisplayFunc(display);
+    glutIdleFunc(idle);
+    glutKeyboardFunc(keyboard);
+    glutMainLoop();
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "barnes_hut.h"
+
+/*
+ * checks that the library refuses what it cannot run: kinds out of their
+ * enum at creation, and time steps which are not positive and finite at
+ * each step, a refused step leaving the simulation as it is
+ */
+
+static const int BODIES = 100;
+
+// kinds just below and just above the enums of the integrator, kernel, mac,
+// expansion, engine and build
+static const int BAD_KINDS[6][2] = {
+    {BH_INTEGRATOR_LEAPFROG - 1, BH_INTEGRATOR_VERLET + 1},
+    {BH_KERNEL_AUTO - 1, BH_KERNEL_AVX512 + 1},
+    {BH_MAC_BH - 1, BH_MAC_RELATIVE + 1},
+    {BH_EXPANSION_MONOPOLE - 1, BH_EXPANSION_QUADRUPOLE + 1},
+    {BH_ENGINE_TREE - 1, BH_ENGINE_FMM + 1},
+    {BH_BUILD_INSERT - 1, BH_BUILD_MORTON + 1},
+};
+
+/* FUNCTION: create
+ * --------------------------------------
+ * creates a simulation of BODIES bodies on a diagonal
+ *
+ * config: parameters of the simulation
+ *
+ * returns: the simulation, NULL if the library refuses it
+ */
+static bh_simulation_t *create(const bh_config_t *config)
+{
+    float positions[3 * BODIES];
+    float masses[BODIES];
+
+    for (int i = 0; i < BODIES; i += 1) {
+        positions[3 * i] = i;
+        positions[3 * i + 1] = 2 * i;
+        positions[3 * i + 2] = 3 * i;
+        masses[i] = 1;
+    }
+    return bh_create_simulation(config, BODIES, positions, NULL, masses);
+}
+
+int main(void)
+{
+    const float bad_steps[] = {0, -1, NAN, INFINITY};
+    bh_config_t defaults;
+    bh_config_t config;
+    bh_simulation_t *simulation;
+    int failed = 0;
+
+    bh_init_config(&defaults);
+    defaults.threads = 2;
+    for (int field = 0; field < 6; field += 1) {
+        for (int i = 0; i < 2; i += 1) {
+            config = defaults;
+            if (field == 0)
+                config.integrator = (bh_integrator_et)BAD_KINDS[field][i];
+            else if (field == 1)
+                config.kernel = (bh_kernel_et)BAD_KINDS[field][i];
+            else if (field == 2)
+                config.mac = (bh_mac_et)BAD_KINDS[field][i];
+            else if (field == 3)
+                config.expansion = (bh_expansion_et)BAD_KINDS[field][i];
+            else if (field == 4)
+                config.engine = (bh_engine_et)BAD_KINDS[field][i];
+            else
+                config.build = (bh_build_et)BAD_KINDS[field][i];
+            simulation = create(&config);
+            if (simulation != NULL) {
+                printf("FAIL test_api: kind %d of field %d is accepted\n",
+                       BAD_KINDS[field][i], field);
+                bh_free_simulation(simulation);
+                failed += 1;
+            }
+        }
+    }
+    simulation = create(&defaults);
+    if (simulation == NULL)
+        exit(1);
+    for (size_t i = 0; i < sizeof(bad_steps) / sizeof(bad_steps[0]); i += 1) {
+        if (bh_step_simulation(simulation, bad_steps[i])
+            || bh_get_stats(simulation)->step != 0) {
+            printf("FAIL test_api: time step %g is accepted\n", bad_steps[i]);
+            failed += 1;
+        }
+    }
+    if (!bh_step_simulation(simulation, 0.5f)
+        || bh_get_stats(simulation)->step != 1) {
+        printf("FAIL test_api: time step 0.5 is refused\n");
+        failed += 1;
+    }
+    bh_free_simulation(simulation);
+    if (!failed)
+        printf("ok test_api\n");
+    return failed ? 1 : 0;
+}
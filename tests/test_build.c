@@ -0,0 +1,215 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "simulation.h"
+
+/*
+ * checks that BH_BUILD_INSERT and BH_BUILD_MORTON build the same octree on
+ * the same bodies: every body in the same leaf cell with the same bodies,
+ * and the same accelerations up to the order of the sums, on random bodies,
+ * on coincident bodies (sharing a leaf at the deepest level) and on bodies
+ * out of the initial galaxy
+ */
+
+static const int BODIES = 20000;
+
+// bodies moved to the same position, or out of [0, GALAXY_SIZE]
+static const int MOVED = 500;
+
+/* FUNCTION: set_up
+ * --------------------------------------
+ * sets up a simulation of a copy of some bodies with one of the builds
+ *
+ * simulation: simulation to set up
+ * bodies: bodies to copy, their id being their index
+ * build: construction of the octree
+ *
+ * returns: false if the simulation cannot be set up
+ */
+static bool set_up(simulation_t *simulation, const particles_t *bodies,
+                   bh_build_et build)
+{
+    particles_t particles;
+    config_t config;
+
+    bh_init_config(&config);
+    config.threads = 2;
+    config.build = build;
+    init_particles(&particles, bodies->count);
+    FOREACH_PARTICLE(bodies, i)
+        add_particle(&particles, bodies->x[i], bodies->y[i], bodies->z[i],
+                     bodies->mass[i]);
+    if (init_simulation(simulation, &config, &particles))
+        return true;
+    free_particles(&particles);
+    return false;
+}
+
+/* FUNCTION: in_cell
+ * --------------------------------------
+ * checks if a body is in the cell of a node, faces included
+ *
+ * particles: store of the bodies
+ * body: index of the body
+ * node: node of the cell
+ *
+ * returns: true if the body is in the cell
+ */
+static bool in_cell(const particles_t *particles, int body,
+                    const oct_node_t *node)
+{
+    return particles->x[body] >= node->min[X]
+           && particles->x[body] <= node->max[X]
+           && particles->y[body] >= node->min[Y]
+           && particles->y[body] <= node->max[Y]
+           && particles->z[body] >= node->min[Z]
+           && particles->z[body] <= node->max[Z];
+}
+
+/* FUNCTION: find_leaves
+ * --------------------------------------
+ * finds the leaf of each body of a simulation
+ *
+ * simulation: simulation whose octree is built
+ * leaves: output, for the body of id i the index of its leaf, -1 if none
+ *
+ * returns: false if a body is in several leaves or out of the cell of its
+ * leaf, or if a leaf holds more than a bucket of bodies which are not
+ * coincident
+ */
+static bool find_leaves(const simulation_t *simulation, int *leaves)
+{
+    const octree_t *tree = &simulation->tree;
+    const particles_t *particles = &simulation->particles;
+    const oct_node_t *leaf;
+    int id;
+
+    memset(leaves, -1, sizeof(int) * particles->count);
+    for (int i = 0; i < tree->count; i += 1) {
+        leaf = &tree->nodes[i];
+        if (leaf->type != CHILD)
+            continue;
+        for (int j = leaf->body; j < leaf->body + leaf->count; j += 1) {
+            id = particles->id[j];
+            if (leaves[id] >= 0 || !in_cell(particles, j, leaf))
+                return false;
+            leaves[id] = i;
+            if (leaf->count > tree->bucket_size
+                && (particles->x[j] != particles->x[leaf->body]
+                    || particles->y[j] != particles->y[leaf->body]
+                    || particles->z[j] != particles->z[leaf->body]))
+                return false;
+        }
+    }
+    return true;
+}
+
+/* FUNCTION: compare_builds
+ * --------------------------------------
+ * builds the octree of some bodies with both builds and compares them
+ *
+ * name: name of the bodies in the messages
+ * bodies: bodies to build the octree of, their id being their index
+ *
+ * returns: the number of failed checks
+ */
+static int compare_builds(const char *name, const particles_t *bodies)
+{
+    simulation_t simulations[2];
+    int *leaves[2];
+    const oct_node_t *a;
+    const oct_node_t *b;
+    const particles_t *p;
+    const particles_t *q;
+    float *accelerations;
+    float error;
+    float norm;
+    int failed = 0;
+    int body;
+
+    accelerations = (float *)malloc(sizeof(float) * 3 * bodies->count);
+    leaves[0] = (int *)malloc(sizeof(int) * bodies->count);
+    leaves[1] = (int *)malloc(sizeof(int) * bodies->count);
+    if (accelerations == NULL || leaves[0] == NULL || leaves[1] == NULL)
+        exit(1);
+    if (!set_up(&simulations[0], bodies, BH_BUILD_INSERT)
+        || !set_up(&simulations[1], bodies, BH_BUILD_MORTON))
+        exit(1);
+    for (int build = 0; build < 2; build += 1) {
+        if (!find_leaves(&simulations[build], leaves[build])) {
+            printf("FAIL test_build: %s, a body of the %s build is out of "
+                   "its leaf or in an overfull leaf\n", name,
+                   build ? "morton" : "insert");
+            failed += 1;
+        }
+    }
+    for (int id = 0; !failed && id < bodies->count; id += 1) {
+        if (leaves[0][id] < 0 || leaves[1][id] < 0) {
+            printf("FAIL test_build: %s, body %d is in no leaf\n", name, id);
+            failed += 1;
+            break;
+        }
+        a = &simulations[0].tree.nodes[leaves[0][id]];
+        b = &simulations[1].tree.nodes[leaves[1][id]];
+        if (a->count != b->count || memcmp(a->min, b->min, sizeof(a->min))
+            || memcmp(a->max, b->max, sizeof(a->max))) {
+            printf("FAIL test_build: %s, body %d is in different leaves\n",
+                   name, id);
+            failed += 1;
+        }
+    }
+    p = &simulations[0].particles;
+    q = &simulations[1].particles;
+    FOREACH_PARTICLE(p, i) {
+        accelerations[3 * p->id[i]] = p->ax[i];
+        accelerations[3 * p->id[i] + 1] = p->ay[i];
+        accelerations[3 * p->id[i] + 2] = p->az[i];
+    }
+    FOREACH_PARTICLE(q, i) {
+        body = q->id[i];
+        error = fabsf(q->ax[i] - accelerations[3 * body])
+                + fabsf(q->ay[i] - accelerations[3 * body + 1])
+                + fabsf(q->az[i] - accelerations[3 * body + 2]);
+        norm = fabsf(q->ax[i]) + fabsf(q->ay[i]) + fabsf(q->az[i]);
+        if (!failed && !(error <= 1e-4f * norm + 1e-30f)) {
+            printf("FAIL test_build: %s, body %d has different "
+                   "accelerations\n", name, body);
+            failed += 1;
+        }
+    }
+    free_simulation(&simulations[0]);
+    free_simulation(&simulations[1]);
+    free(accelerations);
+    free(leaves[0]);
+    free(leaves[1]);
+    return failed;
+}
+
+int main(void)
+{
+    particles_t bodies;
+    int failed;
+
+    init_bodies(&bodies, BODIES, 0);
+    failed = compare_builds("random bodies", &bodies);
+    // more coincident bodies than a bucket, which can never be split
+    for (int i = 1; i < MOVED; i += 1) {
+        bodies.x[i] = bodies.x[0];
+        bodies.y[i] = bodies.y[0];
+        bodies.z[i] = bodies.z[0];
+    }
+    failed += compare_builds("coincident bodies", &bodies);
+    // bodies escaping the galaxy on every side, far from the others
+    for (int i = 0; i < MOVED; i += 1) {
+        bodies.x[i] = i % 2 ? -5 * GALAXY_SIZE - i : 9 * GALAXY_SIZE + i;
+        bodies.y[i] = i % 3 ? -0.5f * i : GALAXY_SIZE + 0.25f * i;
+        bodies.z[i] = i % 5 ? 40 * GALAXY_SIZE : -GALAXY_SIZE;
+    }
+    failed += compare_builds("escaped bodies", &bodies);
+    free_particles(&bodies);
+    if (!failed)
+        printf("ok test_build\n");
+    return failed ? 1 : 0;
+}
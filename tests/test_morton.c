@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "simulation.h"
+
+/*
+ * checks that the parallel Morton sort of the octree build (sort_bodies,
+ * several chunks on several threads) orders the bodies as a sequential
+ * stable sort of their keys
+ */
+
+// more bodies than a chunk of sort_bodies, so that several chunks scatter
+static const int BODIES = 100000;
+
+typedef struct entry_s {
+    uint64_t key;
+    int index;
+} entry_t;
+
+static int compare_entries(const void *a, const void *b)
+{
+    const entry_t *left = (const entry_t *)a;
+    const entry_t *right = (const entry_t *)b;
+
+    if (left->key != right->key)
+        return left->key < right->key ? -1 : 1;
+    return left->index - right->index;
+}
+
+int main(void)
+{
+    particles_t particles;
+    particles_t copy;
+    octree_t tree;
+    pool_t pool;
+    uint64_t *keys = (uint64_t *)malloc(sizeof(uint64_t) * BODIES);
+    entry_t *entries = (entry_t *)malloc(sizeof(entry_t) * BODIES);
+    oct_node_t *root;
+    int failed = 0;
+
+    if (keys == NULL || entries == NULL)
+        exit(1);
+    init_bodies(&particles, BODIES, 0);
+    // coincident bodies share a key, the sort keeping them in their order
+    for (int i = 0; i < BODIES; i += 100) {
+        particles.x[i + 1] = particles.x[i];
+        particles.y[i + 1] = particles.y[i];
+        particles.z[i + 1] = particles.z[i];
+    }
+    init_particles(&copy, BODIES);
+    FOREACH_PARTICLE(&particles, i)
+        add_particle(&copy, particles.x[i], particles.y[i], particles.z[i],
+                     particles.mass[i]);
+    init_pool(&pool, 4);
+    init_octree(&tree, BODIES, 16);
+    create_octree(&tree, &particles, &pool);
+    root = &tree.nodes[0];
+    compute_morton_keys(&copy, root->min, root->max[X] - root->min[X], keys,
+                        0, BODIES);
+    for (int i = 0; i < BODIES; i += 1) {
+        entries[i].key = keys[i];
+        entries[i].index = i;
+    }
+    qsort(entries, BODIES, sizeof(entry_t), compare_entries);
+    for (int i = 0; !failed && i < BODIES; i += 1) {
+        if (tree.keys[i] != entries[i].key
+            || particles.id[i] != entries[i].index
+            || particles.x[i] != copy.x[entries[i].index]) {
+            printf("FAIL test_morton: body %d is %d, expected %d\n", i,
+                   particles.id[i], entries[i].index);
+            failed = 1;
+        }
+    }
+    if (!failed)
+        printf("ok test_morton\n");
+    free_octree(&tree);
+    free_pool(&pool);
+    free_particles(&particles);
+    free_particles(&copy);
+    free(keys);
+    free(entries);
+    return failed;
+}
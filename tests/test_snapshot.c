@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "simulation.h"
+
+/*
+ * checks that a run resumed from a checkpoint ends with the same snapshot,
+ * byte for byte, as the run going through without interruption
+ */
+
+static const int BODIES = 5000;
+static const int STEPS = 4;
+
+/* FUNCTION: read_file
+ * --------------------------------------
+ * reads a whole file
+ *
+ * path: path of the file
+ * size: output, size of the file in bytes
+ *
+ * returns: the bytes of the file, to free, NULL if it cannot be read
+ */
+static char *read_file(const char *path, long *size)
+{
+    FILE *file = fopen(path, "rb");
+    char *bytes;
+
+    if (file == NULL)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+    bytes = (char *)malloc(*size + 1);
+    if (bytes == NULL || fread(bytes, 1, *size, file) != (size_t)*size) {
+        free(bytes);
+        bytes = NULL;
+    }
+    fclose(file);
+    return bytes;
+}
+
+/* FUNCTION: make_path
+ * --------------------------------------
+ * creates an empty temporary file
+ *
+ * path: template of the path, ending with XXXXXX, replaced by the path
+ */
+static void make_path(char *path)
+{
+    int file = mkstemp(path);
+
+    if (file < 0)
+        exit(1);
+    close(file);
+}
+
+/* FUNCTION: run_steps
+ * --------------------------------------
+ * moves a simulation by STEPS steps and writes its snapshot
+ *
+ * simulation: simulation to move
+ * path: snapshot to write
+ *
+ * returns: false if the snapshot cannot be written
+ */
+static bool run_steps(simulation_t *simulation, const char *path)
+{
+    for (int i = 0; i < STEPS; i += 1)
+        bh_step_simulation(simulation, simulation->config.dt);
+    return save_snapshot(&simulation->particles, path,
+                         simulation->stats.step, simulation->stats.time);
+}
+
+int main(void)
+{
+    char checkpoint[] = "/tmp/test_snapshot_XXXXXX";
+    char through[] = "/tmp/test_snapshot_XXXXXX";
+    char resumed[] = "/tmp/test_snapshot_XXXXXX";
+    snapshot_header_t header;
+    simulation_t simulation;
+    particles_t particles;
+    config_t config;
+    char *expected = NULL;
+    char *got = NULL;
+    long expected_size = 0;
+    long got_size = -1;
+    bool ok;
+
+    make_path(checkpoint);
+    make_path(through);
+    make_path(resumed);
+    bh_init_config(&config);
+    config.threads = 2;
+    config.dt = 0.5;
+    init_bodies(&particles, BODIES, 0);
+    ok = init_simulation(&simulation, &config, &particles)
+         && run_steps(&simulation, checkpoint)
+         && run_steps(&simulation, through);
+    if (ok)
+        free_simulation(&simulation);
+    ok = ok && load_snapshot(&particles, checkpoint, &header);
+    if (ok && !init_simulation(&simulation, &config, &particles)) {
+        free_particles(&particles);
+        ok = false;
+    }
+    if (ok) {
+        simulation.stats.step = header.step;
+        simulation.stats.time = header.time;
+        ok = run_steps(&simulation, resumed);
+        free_simulation(&simulation);
+    }
+    if (ok) {
+        expected = read_file(through, &expected_size);
+        got = read_file(resumed, &got_size);
+    }
+    ok = expected != NULL && got != NULL && expected_size == got_size
+         && !memcmp(expected, got, expected_size);
+    printf(ok ? "ok test_snapshot\n"
+              : "FAIL test_snapshot: the resumed run differs from the run "
+                "without interruption\n");
+    free(expected);
+    free(got);
+    unlink(checkpoint);
+    unlink(through);
+    unlink(resumed);
+    return ok ? 0 : 1;
+}
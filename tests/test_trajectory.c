@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "simulation.h"
+
+/*
+ * checks the rounding of the 16-bit encodings of the trajectory frames on
+ * their edge cases: ties to even, subnormals, overflow and NaN for
+ * BH_ENCODING_FLOAT16, ties to even and the top of the range for
+ * BH_ENCODING_QUANTIZED
+ */
+
+typedef struct case_s {
+    float value;                    // x of the body
+    uint16_t expected;              // encoded x
+} case_t;
+
+static const case_t HALF_CASES[] = {
+    {0.0f, 0x0000},
+    {1.0f, 0x3c00},
+    {-1.0f, 0xbc00},
+    {2049.0f, 0x6800},              // tie between 2048 and 2050, even kept
+    {2051.0f, 0x6802},              // tie between 2050 and 2052, even kept
+    {65519.0f, 0x7bff},             // below the tie with 65536, largest half
+    {65520.0f, 0x7c00},             // tie rounding to infinity
+    {1e6f, 0x7c00},
+    {0x1p-24f, 0x0001},             // smallest subnormal
+    {0x1p-25f, 0x0000},             // tie between 0 and 2^-24, even kept
+    {0x3p-25f, 0x0002},             // tie between 2^-24 and 2^-23, even kept
+    {0x1.ffcp-15f, 0x0400},         // subnormal carrying into the exponent
+    {NAN, 0x7e00},
+};
+
+static const case_t QUANTIZED_CASES[] = {
+    {0.0f, 0},
+    {0.5f, 0},                      // ties to even
+    {1.5f, 2},
+    {2.5f, 2},
+    {65535.0f, 65535},              // top of the range, scale = 1
+};
+
+/* FUNCTION: check_encoding
+ * --------------------------------------
+ * writes a frame of bodies on the x axis and compares its encoded x array
+ * to the expected values
+ *
+ * encoding: encoding of the frame
+ * cases: x of the bodies and their expected encoding
+ * count: number of cases
+ *
+ * returns: the number of failed cases
+ */
+static int check_encoding(bh_encoding_et encoding, const case_t *cases,
+                          int count)
+{
+    char path[] = "/tmp/test_trajectory_XXXXXX";
+    size_t ids = ((sizeof(int) * count + SNAPSHOT_ALIGNMENT - 1)
+                  / SNAPSHOT_ALIGNMENT) * SNAPSHOT_ALIGNMENT;
+    uint16_t encoded[16];
+    particles_t particles;
+    writer_t writer;
+    FILE *file;
+    int failed = 0;
+    int fd = mkstemp(path);
+
+    if (fd < 0)
+        exit(1);
+    close(fd);
+    init_particles(&particles, count);
+    for (int i = 0; i < count; i += 1)
+        add_particle(&particles, cases[i].value, 0, 0, 1);
+    if (!init_writer(&writer, path, encoding))
+        exit(1);
+    push_frame(&writer, &particles, 0, 0);
+    if (!free_writer(&writer))
+        exit(1);
+    file = fopen(path, "rb");
+    if (file == NULL || fseek(file, sizeof(frame_header_t) + ids, SEEK_SET)
+        || fread(encoded, sizeof(uint16_t), count, file) != (size_t)count)
+        exit(1);
+    fclose(file);
+    for (int i = 0; i < count; i += 1) {
+        if (encoded[i] != cases[i].expected) {
+            printf("FAIL test_trajectory: %s of %a is 0x%04x, expected "
+                   "0x%04x\n", encoding == BH_ENCODING_FLOAT16 ? "float16"
+                   : "quantized", cases[i].value, encoded[i],
+                   cases[i].expected);
+            failed += 1;
+        }
+    }
+    free_particles(&particles);
+    unlink(path);
+    return failed;
+}
+
+int main(void)
+{
+    int failed = check_encoding(BH_ENCODING_FLOAT16, HALF_CASES,
+                                sizeof(HALF_CASES) / sizeof(case_t))
+                 + check_encoding(BH_ENCODING_QUANTIZED, QUANTIZED_CASES,
+                                  sizeof(QUANTIZED_CASES) / sizeof(case_t));
+
+    if (!failed)
+        printf("ok test_trajectory\n");
+    return failed ? 1 : 0;
+}